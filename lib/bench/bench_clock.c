@@ -0,0 +1,35 @@
+/*
+ * Benchmark clock. Scan merge code is built with clock_gettime() mapped to
+ * bench_clock_gettime() (see stubs/includes.h); once a benchmark sets the
+ * virtual time, aging follows it instead of the host clock.
+ */
+#include "includes.h"
+#include "bench_clock.h"
+
+#undef clock_gettime
+
+static int bench_virtual;
+static unsigned long bench_msec;
+
+int bench_clock_gettime( clockid_t clk_id, struct timespec *ts )
+{
+    if( !bench_virtual || (clk_id != CLOCK_MONOTONIC) )
+        return clock_gettime(clk_id, ts);
+    ts->tv_sec = bench_msec / 1000;
+    ts->tv_nsec = (bench_msec % 1000) * 1000000;
+    return 0;
+}
+
+void bench_clock_set( unsigned long msec )
+{
+    bench_virtual = 1;
+    bench_msec = msec;
+}
+
+unsigned long long bench_nsec( void )
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
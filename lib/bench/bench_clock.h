@@ -0,0 +1,11 @@
+/*
+ * Benchmark clock: virtual monotonic time for the scan merge code, and
+ * host time for measurements.
+ */
+#ifndef BENCH_CLOCK_H
+#define BENCH_CLOCK_H
+
+void bench_clock_set( unsigned long msec );
+unsigned long long bench_nsec( void );
+
+#endif
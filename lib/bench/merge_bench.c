@@ -0,0 +1,489 @@
+/*
+ * Scan merge benchmark: runs scan_merge() or scan_merge_delta() over a
+ * stream of scans and reports time, heap calls and memory per merge.
+ *
+ * The scan stream is either synthetic (N BSSes with churn, hidden SSIDs,
+ * probe responses and partial visibility, from a fixed seed) or replayed from a capture file
+ * written by scan_capture_start() on a device. A synthetic stream can be
+ * saved with -w, which records it through the same capture code.
+ *
+ * Scans are merged on a virtual clock taken from the stream, so aging and
+ * the output digest are reproducible; compare the digest before and after a
+ * change of the merge logic, and the numbers for its cost.
+ */
+#include "includes.h"
+#include <sys/resource.h>
+#include "scanmerge.h"
+#include "bench_clock.h"
+
+#define BENCH_CLOCK_BASE    1000000     /* msec, virtual time of first scan */
+
+typedef struct {
+    unsigned int bss;           /* BSSes visible at a time */
+    unsigned int scans;
+    unsigned int churn;         /* % of BSSes replaced per scan */
+    unsigned int hidden;        /* % of BSSes with hidden SSID */
+    unsigned int probed;        /* % of hidden ones also answering a probe */
+    unsigned int visible;       /* % chance a BSS is in a scan */
+    unsigned int interval;      /* msec between scans */
+    unsigned int seed;
+    int delta;                  /* use scan_merge_delta() */
+    unsigned int top_k;         /* ranked output, 0 - off */
+    int band_bonus;             /* dB, ranked output */
+    unsigned long max_bytes;    /* cache bound, 0 - unlimited */
+    const char *capture;        /* record synthetic scans to this file */
+    const char *replay;         /* replay this capture file */
+    const char *shm;            /* publish to this shared segment */
+} bench_opts_t;
+
+typedef struct {
+    unsigned long merges;
+    unsigned long results;      /* scan results merged */
+    unsigned long reported;     /* results or deltas returned */
+    unsigned long long nsec;
+    unsigned long heap_calls;
+    unsigned long allocs;
+    u32 digest;
+} bench_stats_t;
+
+static u32 bench_rand_state;
+
+static u32 bench_rand( void )
+{
+    /* xorshift32, same stream on every host */
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 17;
+    bench_rand_state ^= bench_rand_state << 5;
+    return bench_rand_state;
+}
+
+static u32 bench_hash( u32 hash, const void *data, size_t len )
+{
+    const u8 *pos = data;
+    size_t i;
+
+    for(i=0;( i < len );i++) {
+        hash ^= pos[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static scan_result_t *bench_alloc_res( size_t ie_len )
+{
+    scan_result_t *res_ptr;
+
+    res_ptr = os_zalloc(sizeof(scan_result_t) + ie_len);
+    if( res_ptr == NULL ) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    res_ptr->ie_len = ie_len;
+    return res_ptr;
+}
+
+static u8 *bench_add_ie( u8 *pos, u8 eid, u8 len, u8 fill )
+{
+    pos[0] = eid;
+    pos[1] = len;
+    os_memset(pos + 2, fill, len);
+    return pos + 2 + len;
+}
+
+/* Synthetic BSS: everything but the level follows from its id. The IE set
+ * is modelled on a managed network: most elements are common to every AP
+ * of a deployment, a few depend on the channel or on the AP itself. With
+ * reveal, a hidden BSS answers with its SSID, as in a probe response. */
+static int bench_synth_hidden( const bench_opts_t *opts, unsigned int id )
+{
+    return (bench_hash(2166136261U, &id, sizeof(id)) % 100) < opts->hidden;
+}
+
+static scan_result_t *bench_synth_res( const bench_opts_t *opts,
+                                       unsigned int id, int reveal )
+{
+    scan_result_t *res_ptr;
+    u32 h = bench_hash(2166136261U, &id, sizeof(id));
+    int hidden = !reveal && bench_synth_hidden(opts, id);
+    int band5 = (h & 0x100) != 0;
+    u8 chan = band5 ? (u8)(36 + 4 * (h % 8)) : (u8)(1 + h % 13);
+    size_t ssid_len = hidden ? 0 : 4 + (id % 37) % 10;
+    size_t vendor_len = (id % 3) * 8;
+    size_t ie_len;
+    u8 *pos;
+
+    ie_len = 2 + ssid_len + 2 + 8 + 2 + 1 + 2 + 4 + 2 + 6 + 2 + 26 +
+             2 + 22 + 2 + 8 + 2 + 24 + 2 + vendor_len;
+    if( id & 1 )
+        ie_len += 2 + 20;   /* RSN */
+    if( band5 )
+        ie_len += 2 + 12 + 2 + 5;   /* VHT capabilities and operation */
+    res_ptr = bench_alloc_res(ie_len);
+    res_ptr->bssid[0] = 0x02;
+    res_ptr->bssid[1] = (u8)(h >> 24);
+    res_ptr->bssid[2] = (u8)(h >> 16);
+    res_ptr->bssid[3] = (u8)(id >> 16);
+    res_ptr->bssid[4] = (u8)(id >> 8);
+    res_ptr->bssid[5] = (u8)id;
+    res_ptr->freq = band5 ? 5000 + 5 * chan : 2407 + 5 * chan;
+    res_ptr->beacon_int = 100;
+    res_ptr->caps = (id & 1) ? 0x0411 : 0x0401;
+    res_ptr->noise = -95;
+    res_ptr->level = -45 - (int)(h % 45) + (int)(bench_rand() % 7) - 3;
+    res_ptr->tsf = (u64)id * 1024;
+
+    pos = (u8 *)(res_ptr + 1);
+    pos[0] = WLAN_EID_SSID;
+    pos[1] = (u8)ssid_len;
+    snprintf((char *)pos + 2, MAX_SSID_LEN, "ess-%08u", id % 37);
+    pos += 2 + ssid_len;
+    pos = bench_add_ie(pos, 1, 8, 0x82);            /* supported rates */
+    pos = bench_add_ie(pos, 3, 1, chan);            /* DS parameter set */
+    pos = bench_add_ie(pos, 5, 4, (u8)(h % 3));     /* TIM */
+    pos = bench_add_ie(pos, 7, 6, 0x55);            /* country */
+    pos = bench_add_ie(pos, 45, 26, 0x2c);          /* HT capabilities */
+    pos = bench_add_ie(pos, 61, 22, chan);          /* HT operation */
+    pos = bench_add_ie(pos, 127, 8, 0x04);          /* extended caps */
+    if( id & 1 )
+        pos = bench_add_ie(pos, 48, 20, 0x01);      /* RSN */
+    if( band5 ) {
+        pos = bench_add_ie(pos, 191, 12, 0x91);     /* VHT capabilities */
+        pos = bench_add_ie(pos, 192, 5, chan);      /* VHT operation */
+    }
+    pos = bench_add_ie(pos, 221, 24, 0x02);         /* WMM parameters */
+    bench_add_ie(pos, 221, (u8)vendor_len, 0x50);
+    return res_ptr;
+}
+
+static void bench_merge( struct wpa_driver_ti_data *drv, bench_stats_t *stats,
+                         const bench_opts_t *opts, scan_result_t **results,
+                         unsigned int number_items, unsigned int max_size,
+                         int force_flag )
+{
+    scan_alloc_stats_t alloc;
+    scan_delta_t delta;
+    unsigned long long start;
+    unsigned long allocs;
+    unsigned int i, ret;
+
+    scan_get_alloc_stats(&alloc);
+    allocs = alloc.allocs;
+    start = bench_nsec();
+    if( opts->delta ) {
+        if( scan_merge_delta(drv, results, number_items, &delta) )
+            delta.num_added = delta.num_changed = delta.num_removed = 0;
+        ret = number_items;
+    }
+    else {
+        ret = scan_merge(drv, results, force_flag, number_items, max_size);
+    }
+    stats->nsec += bench_nsec() - start;
+    scan_get_alloc_stats(&alloc);
+    stats->heap_calls += alloc.last_merge;
+    stats->allocs += alloc.allocs - allocs;
+    stats->merges++;
+    stats->results += number_items;
+
+    if( opts->delta ) {
+        stats->reported += delta.num_added + delta.num_changed +
+                           delta.num_removed;
+        for(i=0;( i < delta.num_added );i++)
+            stats->digest = bench_hash(stats->digest,
+                                       delta.added[i]->bssid, ETH_ALEN);
+        for(i=0;( i < delta.num_changed );i++) {
+            stats->digest = bench_hash(stats->digest,
+                                       delta.changed[i]->bssid, ETH_ALEN);
+            stats->digest = bench_hash(stats->digest,
+                                       &(delta.changed[i]->level),
+                                       sizeof(int));
+        }
+        for(i=0;( i < delta.num_removed );i++)
+            stats->digest = bench_hash(stats->digest,
+                                       delta.removed[i], ETH_ALEN);
+    }
+    else {
+        stats->reported += ret;
+        for(i=0;( i < ret );i++) {
+            stats->digest = bench_hash(stats->digest,
+                                       results[i]->bssid, ETH_ALEN);
+            stats->digest = bench_hash(stats->digest,
+                                       &(results[i]->level), sizeof(int));
+            stats->digest = bench_hash(stats->digest,
+                                       results[i] + 1, results[i]->ie_len);
+        }
+    }
+    for(i=0;( i < ret );i++)
+        os_free(results[i]);
+}
+
+static void bench_synth( struct wpa_driver_ti_data *drv, bench_stats_t *stats,
+                         const bench_opts_t *opts )
+{
+    unsigned int *ids, next_id, scan, i, n, max_size;
+    scan_result_t **results;
+
+    ids = os_malloc(opts->bss * sizeof(unsigned int));
+    if( ids == NULL )
+        exit(1);
+    for(i=0;( i < opts->bss );i++)
+        ids[i] = i;
+    next_id = opts->bss;
+    bench_rand_state = opts->seed ? opts->seed : 1;
+    drv->last_scan = SCAN_TYPE_NORMAL_ACTIVE;
+
+    for(scan=0;( scan < opts->scans );scan++) {
+        bench_clock_set(BENCH_CLOCK_BASE + scan * opts->interval);
+        max_size = 2 * opts->bss + scan_count(drv);
+        results = os_zalloc(max_size * sizeof(scan_result_t *));
+        if( results == NULL )
+            exit(1);
+        for(i=0,n=0;( i < opts->bss );i++) {
+            if( scan && (bench_rand() % 100 < opts->churn) )
+                ids[i] = next_id++;
+            if( bench_rand() % 100 >= opts->visible )
+                continue;
+            results[n++] = bench_synth_res(opts, ids[i], 0);
+            /* Same BSSID twice in one scan: the beacon, then the probe
+               response naming the SSID */
+            if( opts->probed && bench_synth_hidden(opts, ids[i]) &&
+                (bench_rand() % 100 < opts->probed) )
+                results[n++] = bench_synth_res(opts, ids[i], 1);
+        }
+        bench_merge(drv, stats, opts, results, n, max_size, 0);
+        os_free(results);
+    }
+    os_free(ids);
+}
+
+static int bench_replay( struct wpa_driver_ti_data *drv, bench_stats_t *stats,
+                         const bench_opts_t *opts )
+{
+    scan_capture_hdr_t hdr;
+    scan_capture_scan_t scan_hdr;
+    scan_capture_res_t rec;
+    scan_result_t **results, *res_ptr;
+    unsigned int i, max_size;
+    FILE *fp;
+
+    fp = fopen(opts->replay, "rb");
+    if( fp == NULL ) {
+        perror(opts->replay);
+        return -1;
+    }
+    if( (fread(&hdr, sizeof(hdr), 1, fp) != 1) ||
+        (hdr.magic != SCAN_MERGE_CAPTURE_MAGIC) ||
+        (hdr.version != SCAN_MERGE_CAPTURE_VERSION) ||
+        (hdr.res_size != sizeof(scan_capture_res_t)) ) {
+        fprintf(stderr, "%s: not a scan capture file\n", opts->replay);
+        fclose(fp);
+        return -1;
+    }
+    while( fread(&scan_hdr, sizeof(scan_hdr), 1, fp) == 1 ) {
+        bench_clock_set(BENCH_CLOCK_BASE + scan_hdr.msec);
+        drv->last_scan = scan_hdr.scan_type;
+        max_size = scan_hdr.count + scan_count(drv);
+        results = os_zalloc((max_size + 1) * sizeof(scan_result_t *));
+        if( results == NULL )
+            exit(1);
+        for(i=0;( i < scan_hdr.count );i++) {
+            if( fread(&rec, sizeof(rec), 1, fp) != 1 )
+                break;
+            res_ptr = bench_alloc_res(rec.ie_len);
+            os_memcpy(res_ptr->bssid, rec.bssid, ETH_ALEN);
+            res_ptr->freq = rec.freq;
+            res_ptr->beacon_int = rec.beacon_int;
+            res_ptr->caps = rec.caps;
+            res_ptr->qual = rec.qual;
+            res_ptr->noise = rec.noise;
+            res_ptr->level = rec.level;
+            res_ptr->tsf = rec.tsf;
+            results[i] = res_ptr;
+            if( (fread(res_ptr + 1, 1, rec.ie_len, fp) != rec.ie_len) ||
+                fseek(fp, SCAN_CAPTURE_REC_LEN(rec.ie_len) - sizeof(rec) -
+                      rec.ie_len, SEEK_CUR) ) {
+                i++;
+                break;
+            }
+        }
+        if( i < scan_hdr.count ) {
+            fprintf(stderr, "%s: truncated, %lu scans replayed\n",
+                    opts->replay, stats->merges);
+            while( i > 0 )
+                os_free(results[--i]);
+            os_free(results);
+            break;
+        }
+        bench_merge(drv, stats, opts, results, scan_hdr.count, max_size,
+                    scan_hdr.force_flag);
+        os_free(results);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void bench_shm_check( const bench_opts_t *opts, unsigned int count,
+                             scan_shm_hdr_t *out )
+{
+    const scan_shm_hdr_t *hdr;
+    const scan_shm_res_t *rec = NULL;
+    u64 *buf;
+    unsigned int n = 0;
+    int len;
+
+    buf = os_malloc(SCAN_MERGE_SHM_SIZE);
+    if( buf == NULL )
+        exit(1);
+    len = scan_shm_read(opts->shm, (u8 *)buf, SCAN_MERGE_SHM_SIZE);
+    if( len < 0 ) {
+        fprintf(stderr, "%s: no shared scan list\n", opts->shm);
+        exit(1);
+    }
+    hdr = (const scan_shm_hdr_t *)buf;
+    while( (rec = scan_shm_next((u8 *)buf, len, rec)) != NULL )
+        n++;
+    if( (n != hdr->count) ||
+        (!(hdr->flags & SCAN_SHM_F_TRUNCATED) && (n != count)) ) {
+        fprintf(stderr, "%s: shared list mismatch\n", opts->shm);
+        exit(1);
+    }
+    *out = *hdr;
+    os_free(buf);
+}
+
+static void bench_usage( void )
+{
+    fprintf(stderr,
+            "usage: merge_bench [-d] [-n bss] [-s scans] [-c churn%%] "
+            "[-H hidden%%]\n"
+            "                   [-p probed%%] [-v visible%%] [-i msec] "
+            "[-S seed]\n"
+            "                   [-k top] [-b dB] [-M bytes]\n"
+            "                   [-w capture] [-m segment]\n"
+            "       merge_bench [-d] [-k top] [-b dB] -r capture\n"
+            "  -d  delta mode (scan_merge_delta)\n"
+            "  -p  hidden BSSes also reported by SSID in the same scan\n"
+            "  -k  ranked output, top items only\n"
+            "  -b  5 GHz bonus of ranked output\n"
+            "  -M  bound cache memory, fail if the peak exceeds it\n"
+            "  -w  record synthetic scans to capture file\n"
+            "  -r  replay capture file\n"
+            "  -m  publish merge list to shared segment, read it back\n");
+    exit(2);
+}
+
+int main( int argc, char *argv[] )
+{
+    struct wpa_driver_ti_data drv;
+    bench_opts_t opts;
+    bench_stats_t stats;
+    scan_mem_stats_t mem;
+    scan_rank_t rank;
+    scan_shm_hdr_t shm;
+    struct rusage usage;
+    int opt;
+
+    os_memset(&opts, 0, sizeof(opts));
+    opts.bss = 100;
+    opts.scans = 1000;
+    opts.churn = 2;
+    opts.hidden = 10;
+    opts.visible = 85;
+    opts.interval = 15000;
+    opts.seed = 1;
+    while( (opt = getopt(argc, argv, "dn:s:c:H:p:v:i:S:k:b:M:w:r:m:")) != -1 ) {
+        switch( opt ) {
+        case 'd': opts.delta = 1; break;
+        case 'n': opts.bss = atoi(optarg); break;
+        case 's': opts.scans = atoi(optarg); break;
+        case 'c': opts.churn = atoi(optarg); break;
+        case 'H': opts.hidden = atoi(optarg); break;
+        case 'p': opts.probed = atoi(optarg); break;
+        case 'v': opts.visible = atoi(optarg); break;
+        case 'i': opts.interval = atoi(optarg); break;
+        case 'S': opts.seed = atoi(optarg); break;
+        case 'k': opts.top_k = atoi(optarg); break;
+        case 'b': opts.band_bonus = atoi(optarg); break;
+        case 'M': opts.max_bytes = strtoul(optarg, NULL, 0); break;
+        case 'w': opts.capture = optarg; break;
+        case 'r': opts.replay = optarg; break;
+        case 'm': opts.shm = optarg; break;
+        default: bench_usage();
+        }
+    }
+    if( (optind != argc) || (opts.bss == 0) )
+        bench_usage();
+
+    os_memset(&drv, 0, sizeof(drv));
+    os_memset(&stats, 0, sizeof(stats));
+    stats.digest = 2166136261U;
+    bench_clock_set(BENCH_CLOCK_BASE);
+    scan_init(&drv, NULL);
+    if( opts.max_bytes )
+        scan_set_limits(&drv, 0, opts.max_bytes, SCAN_MERGE_EVICT_LRU);
+    if( opts.top_k ) {
+        os_memset(&rank, 0, sizeof(rank));
+        rank.top_k = opts.top_k;
+        rank.flags = opts.band_bonus ? SCAN_RANK_F_BAND : 0;
+        rank.band_bonus = opts.band_bonus;
+        if( scan_set_ranking(&drv, &rank) ) {
+            fprintf(stderr, "ranking failed\n");
+            return 1;
+        }
+    }
+
+    if( opts.shm && scan_shm_start(&drv, opts.shm) ) {
+        perror(opts.shm);
+        return 1;
+    }
+    if( opts.replay ) {
+        if( bench_replay(&drv, &stats, &opts) )
+            return 1;
+    }
+    else {
+        if( opts.capture && scan_capture_start(&drv, opts.capture) ) {
+            perror(opts.capture);
+            return 1;
+        }
+        bench_synth(&drv, &stats, &opts);
+        scan_capture_stop(&drv);
+    }
+    scan_get_mem_stats(&drv, &mem);
+    if( opts.shm )
+        bench_shm_check(&opts, scan_count(&drv), &shm);
+    scan_exit(&drv);
+    getrusage(RUSAGE_SELF, &usage);
+
+    if( stats.merges == 0 ) {
+        fprintf(stderr, "no scans\n");
+        return 1;
+    }
+    printf("%s%s%s: %lu merges, %.1f results/scan, %.1f reported/merge\n",
+           opts.replay ? opts.replay : "synthetic",
+           opts.delta ? " (delta)" : "", opts.top_k ? " (ranked)" : "",
+           stats.merges,
+           (double)stats.results / stats.merges,
+           (double)stats.reported / stats.merges);
+    printf("  time      %10.0f ns/merge %8.1f ns/result\n",
+           (double)stats.nsec / stats.merges,
+           stats.results ? (double)stats.nsec / stats.results : 0.0);
+    printf("  heap      %10.2f allocs/merge %6.2f calls/merge\n",
+           (double)stats.allocs / stats.merges,
+           (double)stats.heap_calls / stats.merges);
+    printf("  memory    %10lu peak cache bytes, %lu entries at end, "
+           "%lu evictions, %ld kB max RSS\n",
+           mem.peak_bytes, mem.entries, mem.evictions, usage.ru_maxrss);
+    if( mem.ie_chunks )
+        printf("  ie pool   %10lu bytes in %lu shared chunks at end\n",
+               mem.ie_bytes, mem.ie_chunks);
+    if( opts.shm )
+        printf("  shared    %10u records, %u bytes, seq %u%s\n",
+               shm.count, shm.data_len, shm.seq,
+               (shm.flags & SCAN_SHM_F_TRUNCATED) ? " (truncated)" : "");
+    printf("  digest    %08x\n", stats.digest);
+    if( opts.max_bytes && (mem.peak_bytes > opts.max_bytes) ) {
+        fprintf(stderr, "peak %lu bytes exceeds bound %lu\n",
+                mem.peak_bytes, opts.max_bytes);
+        return 1;
+    }
+    return 0;
+}
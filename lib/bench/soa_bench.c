@@ -0,0 +1,120 @@
+/*
+ * Scan merge lookup microbenchmark.
+ *
+ * Fills the merge cache with 64, 256 and 1024 BSSes and measures the cost
+ * of a cache lookup: scan_get_by_bssid() for cached and unknown BSSIDs,
+ * and a full scan_merge() of a scan that sees every cached BSS again.
+ * Build with and without CONFIG_SCAN_MERGE_SOA to compare the SoA index
+ * with the hash chains (see Makefile).
+ */
+#include "includes.h"
+#include "scanmerge.h"
+#include "bench_clock.h"
+
+#define BENCH_LOOKUPS   (1 << 22)
+#define BENCH_MERGES    200
+#define BENCH_IE_LEN    64
+
+static const unsigned int bench_sizes[] = { 64, 256, 1024 };
+
+static void bench_bssid( u8 *bssid, unsigned int id )
+{
+    /* Real BSSIDs of one vendor share the first three octets */
+    bssid[0] = 0x00;
+    bssid[1] = 0x1a;
+    bssid[2] = 0x2b;
+    bssid[3] = (u8)(id >> 16);
+    bssid[4] = (u8)(id >> 8);
+    bssid[5] = (u8)id;
+}
+
+static scan_result_t *bench_res( unsigned int id )
+{
+    scan_result_t *res_ptr;
+    u8 *pos;
+    int len;
+
+    res_ptr = os_zalloc(sizeof(scan_result_t) + BENCH_IE_LEN);
+    if( res_ptr == NULL )
+        exit(1);
+    bench_bssid(res_ptr->bssid, id);
+    res_ptr->freq = 2412 + 5 * (id % 13);
+    res_ptr->level = -40 - (int)(id % 50);
+    pos = (u8 *)(res_ptr + 1);
+    len = snprintf((char *)pos + 2, MAX_SSID_LEN, "ap-%u", id % 97);
+    pos[0] = WLAN_EID_SSID;
+    pos[1] = (u8)len;
+    res_ptr->ie_len = BENCH_IE_LEN;
+    pos += 2 + len;
+    pos[0] = 221;   /* pad with vendor IE */
+    pos[1] = (u8)(BENCH_IE_LEN - 4 - len);
+    return res_ptr;
+}
+
+static void bench_run( unsigned int size )
+{
+    struct wpa_driver_ti_data drv;
+    scan_result_t **results;
+    unsigned long long start, lookup_hit, lookup_miss, merge;
+    unsigned int i, j, found = 0;
+    u8 bssid[ETH_ALEN];
+
+    os_memset(&drv, 0, sizeof(drv));
+    scan_init(&drv, NULL);
+    scan_set_limits(&drv, 0, 0, SCAN_MERGE_EVICT_LRU);
+    results = os_zalloc(2 * size * sizeof(scan_result_t *));
+    if( results == NULL )
+        exit(1);
+
+    for(i=0;( i < size );i++)
+        results[i] = bench_res(i * 7);
+    scan_merge(&drv, results, 0, size, size);
+
+    start = bench_nsec();
+    for(i=0;( i < BENCH_LOOKUPS );i++) {
+        bench_bssid(bssid, (i % size) * 7);
+        found += scan_get_by_bssid(&drv, bssid) != NULL;
+    }
+    lookup_hit = bench_nsec() - start;
+
+    start = bench_nsec();
+    for(i=0;( i < BENCH_LOOKUPS );i++) {
+        bench_bssid(bssid, (i % size) * 7 + 1);
+        found += scan_get_by_bssid(&drv, bssid) != NULL;
+    }
+    lookup_miss = bench_nsec() - start;
+
+    merge = 0;
+    for(j=0;( j < BENCH_MERGES );j++) {
+        for(i=0;( i < size );i++)
+            results[i]->level = -40 - (int)((i + j) % 50);
+        start = bench_nsec();
+        scan_merge(&drv, results, 0, size, size);
+        merge += bench_nsec() - start;
+    }
+
+    printf("%5u entries: hit %6.1f ns  miss %6.1f ns  merge %8.1f ns/result"
+           "  (%u found)\n", size,
+           (double)lookup_hit / BENCH_LOOKUPS,
+           (double)lookup_miss / BENCH_LOOKUPS,
+           (double)merge / ((double)BENCH_MERGES * size), found);
+
+    for(i=0;( i < size );i++)
+        os_free(results[i]);
+    os_free(results);
+    scan_exit(&drv);
+}
+
+int main( void )
+{
+    unsigned int i;
+
+#ifdef CONFIG_SCAN_MERGE_SOA
+    printf("scan merge lookup, SoA index\n");
+#else
+    printf("scan merge lookup, hash chains\n");
+#endif
+    for(i=0;( i < sizeof(bench_sizes) / sizeof(bench_sizes[0]) );i++)
+        bench_run(bench_sizes[i]);
+    return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * Host build stand-in for wpa_supplicant common.h, used by the scan merge
+ * benchmarks only. Provides the types and os_* wrappers lib/ relies on.
+ */
+#ifndef COMMON_H
+#define COMMON_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+typedef uint16_t u16;
+typedef uint8_t u8;
+typedef int32_t s32;
+
+#define ETH_ALEN        6
+#define MAX_SSID_LEN    32
+#define WLAN_EID_SSID   0
+
+#define os_malloc(s)            malloc((s))
+#define os_zalloc(s)            calloc(1, (s))
+#define os_realloc(p, s)        realloc((p), (s))
+#define os_free(p)              free((p))
+#define os_memcpy(d, s, n)      memcpy((d), (s), (n))
+#define os_memmove(d, s, n)     memmove((d), (s), (n))
+#define os_memset(s, c, n)      memset((s), (c), (n))
+#define os_memcmp(s1, s2, n)    memcmp((s1), (s2), (n))
+#define os_strlen(s)            strlen((s))
+#define os_strchr(s, c)         strchr((s), (c))
+#define os_snprintf             snprintf
+
+enum { MSG_MSGDUMP, MSG_DEBUG, MSG_INFO, MSG_WARNING, MSG_ERROR };
+#define wpa_printf(level, ...)  do { } while (0)
+
+#endif
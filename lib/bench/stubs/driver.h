@@ -0,0 +1,57 @@
+/*
+ * Host build stand-in for wpa_supplicant driver.h, used by the scan merge
+ * benchmarks only. Scan result layouts follow wpa_supplicant 0.6.x/0.5.x.
+ */
+#ifndef DRIVER_H
+#define DRIVER_H
+
+#include "common.h"
+
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+struct wpa_scan_res {
+    u8 bssid[ETH_ALEN];
+    int freq;
+    u16 beacon_int;
+    u16 caps;
+    int qual;
+    int noise;
+    int level;
+    u64 tsf;
+    size_t ie_len;
+    /* followed by ie_len octets of IEs */
+};
+
+static inline const u8 *wpa_scan_get_ie( const struct wpa_scan_res *res,
+                                         u8 ie )
+{
+    const u8 *pos = (const u8 *)(res + 1);
+    const u8 *end = pos + res->ie_len;
+
+    while( pos + 1 < end ) {
+        if( pos + 2 + pos[1] > end )
+            break;
+        if( pos[0] == ie )
+            return pos;
+        pos += 2 + pos[1];
+    }
+    return NULL;
+}
+#else
+struct wpa_scan_result {
+    u8 bssid[ETH_ALEN];
+    u8 ssid[MAX_SSID_LEN];
+    size_t ssid_len;
+    u8 wpa_ie[80];
+    size_t wpa_ie_len;
+    u8 rsn_ie[80];
+    size_t rsn_ie_len;
+    int freq;
+    u16 caps;
+    int qual;
+    int noise;
+    int level;
+    int maxrate;
+};
+#endif
+
+#endif
@@ -0,0 +1,19 @@
+/*
+ * Host build stand-in for the wl12xx driver_ti.h, used by the scan merge
+ * benchmarks only. Holds just the fields lib/ touches.
+ */
+#ifndef DRIVER_TI_H
+#define DRIVER_TI_H
+
+#include "shlist.h"
+
+#define SCAN_TYPE_NORMAL_PASSIVE    0
+#define SCAN_TYPE_NORMAL_ACTIVE     1
+
+struct wpa_driver_ti_data {
+    void *ctx;
+    int last_scan;
+    SHLIST scan_merge_list;
+};
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * Host build stand-in for wpa_supplicant includes.h, used by the scan
+ * merge benchmarks only.
+ */
+#ifndef INCLUDES_H
+#define INCLUDES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* Scan merge code reads the benchmark clock, so that replayed scans age
+   the cache as they did when recorded (see bench_clock.c) */
+int bench_clock_gettime( clockid_t clk_id, struct timespec *ts );
+#define clock_gettime   bench_clock_gettime
+
+#endif
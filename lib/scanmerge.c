@@ -15,329 +15,3375 @@
  */
 /*-------------------------------------------------------------------*/
 #include "includes.h"
+#include <stddef.h>
+#include <time.h>
+#ifdef CONFIG_SCAN_MERGE_SOA
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#endif
+#if defined(CONFIG_SCAN_MERGE_SNAPSHOT) || defined(CONFIG_SCAN_MERGE_CAPTURE) \
+    || defined(CONFIG_SCAN_MERGE_SHM)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(CONFIG_SCAN_MERGE_SNAPSHOT) || defined(CONFIG_SCAN_MERGE_SHM)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef CONFIG_SCAN_MERGE_SHM
+#include <sched.h>
+#endif
 #include "scanmerge.h"
 #include "shlist.h"
 
-#define IS_HIDDEN_AP(a)	(((a)->ssid_len == 0) || ((a)->ssid[0] == '\0'))
+#define IS_HIDDEN_AP(a)	(((a)->ssid_len == 0) || ((a)->ssid[0] == '\0'))
+
+#define SCAN_MERGE_LEVEL_ONE    (1 << SCAN_MERGE_LEVEL_FRAC)
+
+/* scan_merge_one() outcome */
+#define SCAN_MERGE_SAME         0
+#define SCAN_MERGE_ADDED        1
+#define SCAN_MERGE_CHANGED      2
+#define SCAN_MERGE_FAILED       3
+
+#ifdef CONFIG_SCAN_MERGE_SHM
+/* Orders shared list stores against seq updates, for other CPUs too */
+#define SCAN_SHM_BARRIER()      __sync_synchronize()
+#endif
+
+/* Ranking score of items with configured SSID, above any level */
+#define SCAN_RANK_SSID_BONUS    (1 << 16)
+
+/* Scan merge item of scan result handed out by the cache */
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+#define SCAN_RES_ITEM(r)        (((scan_flat_t *)((u8 *)(r) - \
+                                 offsetof(scan_flat_t, res)))->item)
+#else
+#define SCAN_RES_ITEM(r)        ((scan_merge_t *)((u8 *)(r) - \
+                                 offsetof(scan_merge_t, scanres)))
+#endif
+
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+#define SCAN_ITEM_BYTES(p)      (sizeof(scan_merge_t) + (p)->ie_size)
+#else
+#define SCAN_ITEM_BYTES(p)      sizeof(scan_merge_t)
+#endif
+
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+/* IE references of pooled scan merge item */
+#define SCAN_ITEM_IES(p)        ((scan_ie_t **)(&((p)->scanres) + 1))
+#endif
+
+static scan_cache_t *scan_cache_list = NULL;
+static scan_alloc_stats_t scan_alloc_stats;
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+static scan_ie_t *scan_ie_pool[SCAN_MERGE_IE_POOL_SIZE];
+static unsigned long scan_ie_chunks;
+static unsigned long scan_ie_bytes;
+#endif
+
+static unsigned long scan_heap_calls( void )
+{
+    return scan_alloc_stats.allocs + scan_alloc_stats.frees +
+           shListGetHeapCalls();
+}
+
+/* Lookup key of a new scan result, built once per result */
+typedef struct {
+    const u8 *bssid;
+    const scan_ssid_view_t *ssid;   /* NULL if result has no SSID */
+} scan_key_t;
+
+#ifdef CONFIG_SCAN_MERGE_SNAPSHOT
+static void scan_snapshot_name( scan_cache_t *cache, const char *ifname );
+static void scan_snapshot_load( struct wpa_driver_ti_data *mydrv );
+static void scan_snapshot_save( struct wpa_driver_ti_data *mydrv );
+#endif
+#ifdef CONFIG_SCAN_MERGE_CAPTURE
+static void scan_capture_write( scan_cache_t *cache, scan_result_t **results,
+                                unsigned int number_items, int scan_type,
+                                int force_flag );
+#endif
+#ifdef CONFIG_SCAN_MERGE_SHM
+static void scan_shm_publish( SHLIST *head, scan_cache_t *cache );
+#endif
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_free
+Routine Description: Frees scan structure private data
+Arguments:
+   ptr - pointer to private data structure
+Return Value:
+-----------------------------------------------------------------------------*/
+static void scan_free( void *ptr )
+{
+    scan_alloc_stats.frees++;
+    os_free(ptr);
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_get_msec
+Routine Description: Gets monotonic time, so aging does not follow clock steps
+Arguments:
+Return Value: Time in msec; wraps, compare by difference only
+-----------------------------------------------------------------------------*/
+static unsigned long scan_get_msec( void )
+{
+    struct timespec ts;
+
+    if( clock_gettime(CLOCK_MONOTONIC, &ts) )
+        return 0;
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_level_round
+Routine Description: Converts smoothed level to integer level
+Arguments:
+   level_avg - smoothed level with SCAN_MERGE_LEVEL_FRAC fraction bits
+Return Value: Rounded level
+-----------------------------------------------------------------------------*/
+static int scan_level_round( int level_avg )
+{
+    if( level_avg >= 0 )
+        return (level_avg + SCAN_MERGE_LEVEL_ONE / 2) / SCAN_MERGE_LEVEL_ONE;
+    return -((-level_avg + SCAN_MERGE_LEVEL_ONE / 2) / SCAN_MERGE_LEVEL_ONE);
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_get_ttl
+Routine Description: Gets time to keep unseen items after given scan type
+Arguments:
+   cache     - pointer to hash index, or NULL for defaults
+   scan_type - type of the last scan
+Return Value: TTL in msec
+-----------------------------------------------------------------------------*/
+static unsigned long scan_get_ttl( scan_cache_t *cache, int scan_type )
+{
+    if( (scan_type < 0) || (scan_type >= SCAN_MERGE_TYPES) )
+        return SCAN_MERGE_TTL_DEFAULT;
+    if( cache == NULL ) /* full active scan sees every BSS in range */
+        return (scan_type == SCAN_TYPE_NORMAL_ACTIVE) ?
+               0 : SCAN_MERGE_TTL_DEFAULT;
+    return cache->ttl[scan_type];
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_get_ssid_view
+Routine Description: Gets SSID of scan result without copying it
+Arguments:
+   res_ptr - pointer to scan result structure
+   view    - pointer to SSID view to fill
+Return Value: 0 - on success, -1 - if result has no SSID
+-----------------------------------------------------------------------------*/
+int scan_get_ssid_view( scan_result_t *res_ptr, scan_ssid_view_t *view )
+{
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+    const u8 *res_ie;
+
+    res_ie = wpa_scan_get_ie(res_ptr, WLAN_EID_SSID);
+    if (!res_ie)
+        return -1;
+    view->ssid_len = (size_t)res_ie[1];
+    view->ssid = res_ie + 2;
+#else
+    view->ssid_len = res_ptr->ssid_len;
+    view->ssid = res_ptr->ssid;
+#endif
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_get_ssid
+Routine Description: Gets copy of scan result SSID. The copy lives in a static
+                     buffer; scan_get_ssid_view() is the re-entrant variant
+Arguments:
+   res_ptr - pointer to scan result structure
+Return Value: Pointer to SSID structure, or NULL
+-----------------------------------------------------------------------------*/
+scan_ssid_t *scan_get_ssid( scan_result_t *res_ptr )
+{
+    static scan_ssid_t ssid_temp;
+    scan_ssid_view_t view;
+
+    if( scan_get_ssid_view(res_ptr, &view) )
+        return NULL;
+    if( view.ssid_len > MAX_SSID_LEN )
+        view.ssid_len = MAX_SSID_LEN;
+    ssid_temp.ssid_len = view.ssid_len;
+    os_memcpy(ssid_temp.ssid, view.ssid, view.ssid_len);
+    return &ssid_temp;
+}
+
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+/*-----------------------------------------------------------------------------
+Routine Name: scan_ie_get
+Routine Description: Gets reference to interned IE, adding it to the pool if
+                     not there yet
+Arguments:
+   data - pointer to IE
+   len  - IE length, including header
+Return Value: Pointer to interned IE, or NULL
+-----------------------------------------------------------------------------*/
+static scan_ie_t *scan_ie_get( const u8 *data, size_t len )
+{
+    scan_ie_t **bucket, *ie;
+    u32 hash = 2166136261U;
+    size_t i;
+
+    for(i=0;( i < len );i++) {
+        hash ^= data[i];
+        hash *= 16777619U;
+    }
+    bucket = &(scan_ie_pool[hash & (SCAN_MERGE_IE_POOL_SIZE - 1)]);
+    for(ie=*bucket;( ie != NULL );ie=ie->next) {
+        if( (ie->hash == hash) && (ie->len == len) &&
+            !os_memcmp(ie->data, data, len) ) {
+            ie->refcnt++;
+            return ie;
+        }
+    }
+    ie = (scan_ie_t *)os_malloc(offsetof(scan_ie_t, data) + len);
+    scan_alloc_stats.allocs++;
+    if( ie == NULL )
+        return NULL;
+    ie->hash = hash;
+    ie->refcnt = 1;
+    ie->len = len;
+    os_memcpy(ie->data, data, len);
+    ie->next = *bucket;
+    *bucket = ie;
+    scan_ie_chunks++;
+    scan_ie_bytes += offsetof(scan_ie_t, data) + len;
+    return ie;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_ie_put
+Routine Description: Drops reference to interned IE, frees it with the last
+Arguments:
+   ie - pointer to interned IE
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_ie_put( scan_ie_t *ie )
+{
+    scan_ie_t **pptr;
+
+    if( --ie->refcnt != 0 )
+        return;
+    pptr = &(scan_ie_pool[ie->hash & (SCAN_MERGE_IE_POOL_SIZE - 1)]);
+    while( *pptr != ie )
+        pptr = &((*pptr)->next);
+    *pptr = ie->next;
+    scan_ie_chunks--;
+    scan_ie_bytes -= offsetof(scan_ie_t, data) + ie->len;
+    scan_free(ie);
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_ie_next
+Routine Description: Gets length of next chunk of IEs to intern: one IE, or
+                     all remaining bytes if they do not form a whole IE
+Arguments:
+   pos - pointer to IEs
+   end - pointer to end of IEs
+Return Value: Chunk length
+-----------------------------------------------------------------------------*/
+static size_t scan_ie_next( const u8 *pos, const u8 *end )
+{
+    if( (end - pos < 2) || (pos + 2 + pos[1] > end) )
+        return end - pos;
+    return 2 + pos[1];
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_ie_count
+Routine Description: Gets number of IE references scan result needs
+Arguments:
+   res_ptr - pointer to scan result structure
+Return Value: Number of chunks
+-----------------------------------------------------------------------------*/
+static unsigned int scan_ie_count( scan_result_t *res_ptr )
+{
+    const u8 *pos = (const u8 *)(res_ptr + 1);
+    const u8 *end = pos + res_ptr->ie_len;
+    unsigned int num = 0;
+
+    for(;( pos < end );num++)
+        pos += scan_ie_next(pos, end);
+    return num;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_ie_intern
+Routine Description: Sets IE references of scan merge item from scan result.
+                     IEs that match the old reference at the same position
+                     keep it; others are looked up in the pool before the old
+                     reference is dropped, so shared IEs are never freed and
+                     allocated again
+Arguments:
+   scan_ptr - pointer to scan merge item with room for the references
+   res_ptr  - pointer to scan result structure
+Return Value: 1 - IEs changed, 0 - IEs unchanged,
+              -1 - on failure: item is left without IEs
+-----------------------------------------------------------------------------*/
+static int scan_ie_intern( scan_merge_t *scan_ptr, scan_result_t *res_ptr )
+{
+    scan_ie_t **refs = SCAN_ITEM_IES(scan_ptr);
+    scan_ie_t *ie;
+    const u8 *pos = (const u8 *)(res_ptr + 1);
+    const u8 *end = pos + res_ptr->ie_len;
+    unsigned int i;
+    size_t len;
+    int changed = (scan_ptr->num_ies != scan_ie_count(res_ptr));
+
+    for(i=0;( pos < end );i++,pos+=len) {
+        len = scan_ie_next(pos, end);
+        if( (i < scan_ptr->num_ies) && (refs[i]->len == len) &&
+            !os_memcmp(refs[i]->data, pos, len) )
+            continue;
+        changed = 1;
+        ie = scan_ie_get(pos, len);
+        if( ie == NULL )
+            break;
+        if( i < scan_ptr->num_ies )
+            scan_ie_put(refs[i]);
+        refs[i] = ie;
+    }
+    for(;( i < scan_ptr->num_ies );i++)   /* Old IEs left over */
+        scan_ie_put(refs[i]);
+    if( pos < end ) {
+        while( i > 0 )
+            scan_ie_put(refs[--i]);
+        scan_ptr->num_ies = 0;
+        scan_ptr->scanres.ie_len = 0;
+        return -1;
+    }
+    scan_ptr->num_ies = i;
+    scan_ptr->scanres.ie_len = res_ptr->ie_len;
+    return changed;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_flat_drop
+Routine Description: Frees contiguous copy of pooled scan merge item
+Arguments:
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_flat_drop( scan_merge_t *scan_ptr )
+{
+    if( scan_ptr->flat ) {
+        scan_free(scan_ptr->flat);
+        scan_ptr->flat = NULL;
+    }
+}
+#endif
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_copy_ies
+Routine Description: Copies IEs of scan merge item into contiguous buffer
+Arguments:
+   scan_ptr - pointer to scan merge item
+   buf      - buffer of scanres.ie_len octets
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+static void scan_copy_ies( scan_merge_t *scan_ptr, u8 *buf )
+{
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    scan_ie_t **refs = SCAN_ITEM_IES(scan_ptr);
+    unsigned int i;
+
+    for(i=0;( i < scan_ptr->num_ies );i++) {
+        os_memcpy(buf, refs[i]->data, refs[i]->len);
+        buf += refs[i]->len;
+    }
+#else
+    os_memcpy(buf, &(scan_ptr->scanres) + 1, scan_ptr->scanres.ie_len);
+#endif
+}
+#endif
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_item_res
+Routine Description: Gets scan result of scan merge item to hand out. Pooled
+                     item gets contiguous copy: the IEs are kept until they
+                     change, the rest is refreshed on every call
+Arguments:
+   scan_ptr - pointer to scan merge item
+Return Value: Pointer to scan result, or NULL
+-----------------------------------------------------------------------------*/
+static scan_result_t *scan_item_res( scan_merge_t *scan_ptr )
+{
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    scan_flat_t *flat = scan_ptr->flat;
+
+    if( flat == NULL ) {
+        flat = (scan_flat_t *)os_malloc(offsetof(scan_flat_t, res) +
+                                        sizeof(scan_result_t) +
+                                        scan_ptr->scanres.ie_len);
+        scan_alloc_stats.allocs++;
+        if( flat == NULL )
+            return NULL;
+        flat->item = scan_ptr;
+        scan_copy_ies(scan_ptr, (u8 *)(&(flat->res) + 1));
+        scan_ptr->flat = flat;
+    }
+    os_memcpy(&(flat->res), &(scan_ptr->scanres), sizeof(scan_result_t));
+    return &(flat->res);
+#else
+    return &(scan_ptr->scanres);
+#endif
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_item_ssid_view
+Routine Description: Gets SSID of scan merge item without copying it
+Arguments:
+   scan_ptr - pointer to scan merge item
+   view     - pointer to SSID view to fill
+Return Value: 0 - on success, -1 - if item has no SSID
+-----------------------------------------------------------------------------*/
+static int scan_item_ssid_view( scan_merge_t *scan_ptr,
+                                scan_ssid_view_t *view )
+{
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    scan_ie_t **refs = SCAN_ITEM_IES(scan_ptr);
+    unsigned int i;
+
+    for(i=0;( i < scan_ptr->num_ies );i++) {
+        if( (refs[i]->len >= 2) && (refs[i]->data[0] == WLAN_EID_SSID) &&
+            (refs[i]->len == (size_t)refs[i]->data[1] + 2) ) {
+            view->ssid_len = refs[i]->data[1];
+            view->ssid = refs[i]->data + 2;
+            return 0;
+        }
+    }
+    return -1;
+#else
+    return scan_get_ssid_view(&(scan_ptr->scanres), view);
+#endif
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_freq_to_slot
+Routine Description: Converts frequency to channel slot. Channel numbers are
+                     reused across bands (5 GHz channels 7-16 of Japan vs
+                     2.4 GHz channels 7-14), so 2.4 GHz channels keep their
+                     numbers and 4.9/5 GHz ones are counted from 4000 MHz
+Arguments:
+   freq - frequency in MHz
+Return Value: Channel slot below SCAN_MERGE_CHANNELS, 0 - unknown
+-----------------------------------------------------------------------------*/
+static u16 scan_freq_to_slot( int freq )
+{
+    if( freq == 2484 )
+        return 14;
+    if( (freq >= 2412) && (freq <= 2472) )
+        return (freq - 2407) / 5;
+    if( (freq >= 4915) && (freq <= 5825) )  /* slots 183-365 */
+        return (freq - 4000) / 5;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_chan_scanned
+Routine Description: Checks if merged scan covered channel of scan merge item
+Arguments:
+   cache    - pointer to hash index, or NULL
+   scan_ptr - pointer to scan merge item
+Return Value: 1 - channel was scanned or is unknown, 0 - otherwise
+-----------------------------------------------------------------------------*/
+static int scan_chan_scanned( scan_cache_t *cache, scan_merge_t *scan_ptr )
+{
+    if( (cache == NULL) || !cache->scan_chans_set ||
+        (scan_ptr->chan_slot == 0) )
+        return 1;
+    return (cache->scan_chans[scan_ptr->chan_slot / 32] >>
+            (scan_ptr->chan_slot % 32)) & 1;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_set_ssid
+Routine Description: Caches SSID location, channel and flags of scan merge
+                     item
+Arguments:
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_set_ssid( scan_merge_t *scan_ptr )
+{
+    scan_ptr->chan_slot = scan_freq_to_slot(scan_ptr->scanres.freq);
+    scan_ptr->flags &= ~(SCAN_MERGE_F_NO_SSID | SCAN_MERGE_F_HIDDEN);
+    if( scan_item_ssid_view(scan_ptr, &(scan_ptr->ssid)) ) {
+        scan_ptr->ssid.ssid = NULL;
+        scan_ptr->ssid.ssid_len = 0;
+        scan_ptr->flags |= SCAN_MERGE_F_NO_SSID;
+    }
+    else if( IS_HIDDEN_AP(&(scan_ptr->ssid)) ) {
+        scan_ptr->flags |= SCAN_MERGE_F_HIDDEN;
+    }
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_cache_get
+Routine Description: Finds hash index attached to driver
+Arguments:
+   mydrv   - pointer to private driver data structure
+Return Value: Pointer to hash index, or NULL
+-----------------------------------------------------------------------------*/
+static scan_cache_t *scan_cache_get( struct wpa_driver_ti_data *mydrv )
+{
+    scan_cache_t *cache;
+
+    for(cache=scan_cache_list;( cache != NULL );cache=cache->next) {
+        if( cache->drv == mydrv )
+            return cache;
+    }
+    return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_hash
+Routine Description: Calculates hash bucket of bssid (FNV-1a)
+Arguments:
+   bssid - pointer to bssid value
+Return Value: Bucket index
+-----------------------------------------------------------------------------*/
+static unsigned int scan_hash( const u8 *bssid )
+{
+    u32 hash = 2166136261U;
+    int i;
+
+    for(i=0;( i < ETH_ALEN );i++) {
+        hash ^= bssid[i];
+        hash *= 16777619U;
+    }
+    return hash & (SCAN_MERGE_HASH_SIZE - 1);
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_ie_hash
+Routine Description: Calculates hash of the IEs carried by scan result (FNV-1a)
+Arguments:
+   res_ptr - pointer to scan result structure
+Return Value: Hash value
+-----------------------------------------------------------------------------*/
+static u32 scan_ie_hash( scan_result_t *res_ptr )
+{
+    u32 hash = 2166136261U;
+    const u8 *pos, *end;
+
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+    pos = (const u8 *)(res_ptr + 1);
+    end = pos + res_ptr->ie_len;
+    for(;( pos < end );pos++) {
+        hash ^= *pos;
+        hash *= 16777619U;
+    }
+#else
+    pos = res_ptr->ssid;
+    for(end=pos + res_ptr->ssid_len;( pos < end );pos++) {
+        hash ^= *pos;
+        hash *= 16777619U;
+    }
+    pos = res_ptr->wpa_ie;
+    for(end=pos + res_ptr->wpa_ie_len;( pos < end );pos++) {
+        hash ^= *pos;
+        hash *= 16777619U;
+    }
+    pos = res_ptr->rsn_ie;
+    for(end=pos + res_ptr->rsn_ie_len;( pos < end );pos++) {
+        hash ^= *pos;
+        hash *= 16777619U;
+    }
+#endif
+    return hash;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_item_ie_hash
+Routine Description: Calculates hash of the IEs of scan merge item, same as
+                     scan_ie_hash() of its scan result
+Arguments:
+   scan_ptr - pointer to scan merge item
+Return Value: Hash value
+-----------------------------------------------------------------------------*/
+static u32 scan_item_ie_hash( scan_merge_t *scan_ptr )
+{
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    scan_ie_t **refs = SCAN_ITEM_IES(scan_ptr);
+    u32 hash = 2166136261U;
+    unsigned int i;
+    size_t j;
+
+    for(i=0;( i < scan_ptr->num_ies );i++) {
+        for(j=0;( j < refs[i]->len );j++) {
+            hash ^= refs[i]->data[j];
+            hash *= 16777619U;
+        }
+    }
+    return hash;
+#else
+    return scan_ie_hash(&(scan_ptr->scanres));
+#endif
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_level_bucket
+Routine Description: Gets level bucket used to detect material level changes
+Arguments:
+   level - level in dBm
+Return Value: Bucket number
+-----------------------------------------------------------------------------*/
+static int scan_level_bucket( int level )
+{
+    /* Shift into positive range, so buckets are equally wide around 0 */
+    return (level + 256) / SCAN_MERGE_DELTA_LEVEL;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_ssid_hash
+Routine Description: Calculates hash of SSID (FNV-1a)
+Arguments:
+   view - pointer to SSID view
+Return Value: Hash value
+-----------------------------------------------------------------------------*/
+static u32 scan_ssid_hash( const scan_ssid_view_t *view )
+{
+    u32 hash = 2166136261U;
+    size_t i;
+
+    for(i=0;( i < view->ssid_len );i++) {
+        hash ^= view->ssid[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+#ifdef CONFIG_SCAN_MERGE_SOA
+#define SCAN_SOA_EMPTY          (~(u64)0)       /* never a packed BSSID */
+#define SCAN_SOA_DELETED        (~(u64)1)
+#define SCAN_SOA_GROUP          4               /* slots compared at once */
+#define SCAN_MERGE_SOA_MIN_SIZE 64
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_soa_key
+Routine Description: Packs BSSID into 64-bit SoA key
+Arguments:
+   bssid - pointer to BSSID
+Return Value: Key
+-----------------------------------------------------------------------------*/
+static u64 scan_soa_key( const u8 *bssid )
+{
+    u64 key = 0;
+
+    os_memcpy(&key, bssid, ETH_ALEN);
+    return key;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_soa_slot
+Routine Description: Gets first slot group to probe for BSSID key
+Arguments:
+   cache - pointer to hash index
+   key   - BSSID key
+Return Value: Slot number, multiple of SCAN_SOA_GROUP
+-----------------------------------------------------------------------------*/
+static unsigned int scan_soa_slot( scan_cache_t *cache, u64 key )
+{
+    /* 64-bit finalizer of MurmurHash3: every octet reaches the low bits */
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return (unsigned int)key & (cache->soa_size - SCAN_SOA_GROUP);
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_soa_match
+Routine Description: Compares slot group of SoA keys with BSSID key and with
+                     empty key, using SSE2/NEON when available
+Arguments:
+   keys - pointer to first key of the group
+   key  - BSSID key
+Return Value: Bits 0-3 - slots holding key, bits 4-7 - empty slots
+-----------------------------------------------------------------------------*/
+static unsigned int scan_soa_match( const u64 *keys, u64 key )
+{
+#if defined(__SSE2__)
+    __m128i k = _mm_set1_epi64x((long long)key);
+    __m128i e = _mm_set1_epi64x((long long)SCAN_SOA_EMPTY);
+    __m128i v0 = _mm_loadu_si128((const __m128i *)keys);
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(keys + 2));
+    __m128i m0, m1, n0, n1;
+
+    /* 64-bit compare from 32-bit halves: both halves must be equal */
+    m0 = _mm_cmpeq_epi32(v0, k);
+    m1 = _mm_cmpeq_epi32(v1, k);
+    n0 = _mm_cmpeq_epi32(v0, e);
+    n1 = _mm_cmpeq_epi32(v1, e);
+    m0 = _mm_and_si128(m0, _mm_shuffle_epi32(m0, _MM_SHUFFLE(2,3,0,1)));
+    m1 = _mm_and_si128(m1, _mm_shuffle_epi32(m1, _MM_SHUFFLE(2,3,0,1)));
+    n0 = _mm_and_si128(n0, _mm_shuffle_epi32(n0, _MM_SHUFFLE(2,3,0,1)));
+    n1 = _mm_and_si128(n1, _mm_shuffle_epi32(n1, _MM_SHUFFLE(2,3,0,1)));
+    return _mm_movemask_pd(_mm_castsi128_pd(m0)) |
+           (_mm_movemask_pd(_mm_castsi128_pd(m1)) << 2) |
+           (_mm_movemask_pd(_mm_castsi128_pd(n0)) << 4) |
+           (_mm_movemask_pd(_mm_castsi128_pd(n1)) << 6);
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    static const u32 bits[SCAN_SOA_GROUP] = { 0x01, 0x02, 0x04, 0x08 };
+    uint32x4_t k = vreinterpretq_u32_u64(vdupq_n_u64(key));
+    uint32x4_t e = vreinterpretq_u32_u64(vdupq_n_u64(SCAN_SOA_EMPTY));
+    uint32x4_t v0 = vreinterpretq_u32_u64(vld1q_u64(keys));
+    uint32x4_t v1 = vreinterpretq_u32_u64(vld1q_u64(keys + 2));
+    uint32x4_t b = vld1q_u32(bits);
+    uint32x4_t m0, m1, n0, n1, r;
+    uint32x2_t t;
+
+    /* 64-bit compare from 32-bit halves: both halves must be equal */
+    m0 = vceqq_u32(v0, k);
+    m1 = vceqq_u32(v1, k);
+    n0 = vceqq_u32(v0, e);
+    n1 = vceqq_u32(v1, e);
+    m0 = vandq_u32(m0, vrev64q_u32(m0));
+    m1 = vandq_u32(m1, vrev64q_u32(m1));
+    n0 = vandq_u32(n0, vrev64q_u32(n0));
+    n1 = vandq_u32(n1, vrev64q_u32(n1));
+    /* One lane per slot, weighted by slot bit */
+    r = vandq_u32(vcombine_u32(vmovn_u64(vreinterpretq_u64_u32(m0)),
+                               vmovn_u64(vreinterpretq_u64_u32(m1))), b);
+    r = vorrq_u32(r, vandq_u32(
+                     vcombine_u32(vmovn_u64(vreinterpretq_u64_u32(n0)),
+                                  vmovn_u64(vreinterpretq_u64_u32(n1))),
+                     vshlq_n_u32(b, 4)));
+    t = vorr_u32(vget_low_u32(r), vget_high_u32(r));
+    return vget_lane_u32(t, 0) | vget_lane_u32(t, 1);
+#else
+    unsigned int i, mask = 0;
+
+    for(i=0;( i < SCAN_SOA_GROUP );i++) {
+        if( keys[i] == key )
+            mask |= 1 << i;
+        else if( keys[i] == SCAN_SOA_EMPTY )
+            mask |= 0x10 << i;
+    }
+    return mask;
+#endif
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_soa_set
+Routine Description: Refreshes SoA slot of scan merge item
+Arguments:
+   cache    - pointer to hash index
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_soa_set( scan_cache_t *cache, scan_merge_t *scan_ptr )
+{
+    unsigned int idx = scan_ptr->soa_idx;
+
+    if( cache->soa_failed )
+        return;
+    cache->soa_ssid_hash[idx] = scan_ssid_hash(&(scan_ptr->ssid));
+    cache->soa_flags[idx] = (u8)scan_ptr->flags;
+    cache->soa_item[idx] = scan_ptr;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_soa_insert
+Routine Description: Puts scan merge item to first free slot of its probe
+                     sequence; table must have room
+Arguments:
+   cache    - pointer to hash index
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_soa_insert( scan_cache_t *cache, scan_merge_t *scan_ptr )
+{
+    u64 key = scan_soa_key(scan_ptr->scanres.bssid);
+    unsigned int idx = scan_soa_slot(cache, key);
+
+    while( (cache->soa_key[idx] != SCAN_SOA_EMPTY) &&
+           (cache->soa_key[idx] != SCAN_SOA_DELETED) )
+        idx = (idx + 1) & (cache->soa_size - 1);
+    if( cache->soa_key[idx] == SCAN_SOA_EMPTY )
+        cache->soa_used++;
+    cache->soa_key[idx] = key;
+    cache->soa_count++;
+    scan_ptr->soa_idx = idx;
+    scan_soa_set(cache, scan_ptr);
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_soa_resize
+Routine Description: Rebuilds SoA table, dropping deleted slots. All arrays
+                     share one allocation
+Arguments:
+   cache - pointer to hash index
+   size  - new number of slots, power of 2
+Return Value: 0 - on success, -1 - on failure
+-----------------------------------------------------------------------------*/
+static int scan_soa_resize( scan_cache_t *cache, unsigned int size )
+{
+    u64 *old_key = cache->soa_key;
+    scan_merge_t **old_item = cache->soa_item;
+    unsigned int old_size = cache->soa_size;
+    unsigned int i;
+    u8 *ptr;
+
+    ptr = os_malloc(size * (sizeof(u64) + sizeof(scan_merge_t *) +
+                            sizeof(u32) + sizeof(u8)));
+    scan_alloc_stats.allocs++;
+    if( ptr == NULL )
+        return -1;
+    cache->soa_key = (u64 *)ptr;
+    cache->soa_item = (scan_merge_t **)(ptr + size * sizeof(u64));
+    cache->soa_ssid_hash = (u32 *)(ptr + size * (sizeof(u64) +
+                                                 sizeof(scan_merge_t *)));
+    cache->soa_flags = ptr + size * (sizeof(u64) + sizeof(scan_merge_t *) +
+                                     sizeof(u32));
+    cache->soa_size = size;
+    cache->soa_count = 0;
+    cache->soa_used = 0;
+    for(i=0;( i < size );i++)
+        cache->soa_key[i] = SCAN_SOA_EMPTY;
+    for(i=0;( i < old_size );i++) {
+        if( (old_key[i] != SCAN_SOA_EMPTY) && (old_key[i] != SCAN_SOA_DELETED) )
+            scan_soa_insert(cache, old_item[i]);
+    }
+    if( old_key )
+        scan_free(old_key);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_soa_add
+Routine Description: Adds scan merge item to SoA table, keeping load under 3/4.
+                     If table can not grow, it is dropped and hash chains
+                     are used
+Arguments:
+   cache    - pointer to hash index
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_soa_add( scan_cache_t *cache, scan_merge_t *scan_ptr )
+{
+    unsigned int size = cache->soa_size;
+
+    if( cache->soa_failed )
+        return;
+    scan_ptr->soa_seq = cache->soa_seq++;
+    if( (cache->soa_used + 1) * 4 > size * 3 ) {
+        if( size == 0 )
+            size = SCAN_MERGE_SOA_MIN_SIZE;
+        while( (cache->soa_count + 1) * 2 > size )
+            size *= 2;
+        if( scan_soa_resize(cache, size) ) {
+            wpa_printf(MSG_ERROR, "%s: no memory, using hash chains",
+                       __func__);
+            cache->soa_failed = 1;
+            return;
+        }
+    }
+    scan_soa_insert(cache, scan_ptr);
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_soa_del
+Routine Description: Removes scan merge item from SoA table
+Arguments:
+   cache    - pointer to hash index
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_soa_del( scan_cache_t *cache, scan_merge_t *scan_ptr )
+{
+    if( cache->soa_failed )
+        return;
+    cache->soa_key[scan_ptr->soa_idx] = SCAN_SOA_DELETED;
+    cache->soa_item[scan_ptr->soa_idx] = NULL;
+    cache->soa_count--;
+}
+
+#endif
+/*-----------------------------------------------------------------------------
+Routine Name: scan_ess_del
+Routine Description: Removes scan merge item from ESS index
+Arguments:
+   cache    - pointer to hash index
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_ess_del( scan_cache_t *cache, scan_merge_t *scan_ptr )
+{
+    scan_merge_t **pptr;
+
+    if( !(scan_ptr->flags & SCAN_MERGE_F_ESS) )
+        return;
+    pptr = &(cache->ess[scan_ptr->ssid_hash & (SCAN_MERGE_HASH_SIZE - 1)]);
+    while( *pptr != NULL ) {
+        if( *pptr == scan_ptr ) {
+            *pptr = scan_ptr->ess_next;
+            break;
+        }
+        pptr = &((*pptr)->ess_next);
+    }
+    scan_ptr->ess_next = NULL;
+    scan_ptr->flags &= ~SCAN_MERGE_F_ESS;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_ess_set
+Routine Description: Files scan merge item in ESS index under its current
+                     SSID; called whenever the SSID may have changed
+Arguments:
+   cache    - pointer to hash index
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_ess_set( scan_cache_t *cache, scan_merge_t *scan_ptr )
+{
+    scan_merge_t **pptr;
+    u32 hash;
+
+    if( scan_ptr->flags & (SCAN_MERGE_F_NO_SSID | SCAN_MERGE_F_HIDDEN) ) {
+        scan_ess_del(cache, scan_ptr);
+        return;
+    }
+    hash = scan_ssid_hash(&(scan_ptr->ssid));
+    if( (scan_ptr->flags & SCAN_MERGE_F_ESS) && (scan_ptr->ssid_hash == hash) )
+        return;
+    scan_ess_del(cache, scan_ptr);
+    pptr = &(cache->ess[hash & (SCAN_MERGE_HASH_SIZE - 1)]);
+    scan_ptr->ssid_hash = hash;
+    scan_ptr->ess_next = *pptr;
+    *pptr = scan_ptr;
+    scan_ptr->flags |= SCAN_MERGE_F_ESS;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_hash_add
+Routine Description: Appends scan merge item to its hash chain. Chains keep
+                     list order, so lookups match what a list walk would find
+Arguments:
+   cache    - pointer to hash index
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_hash_add( scan_cache_t *cache, scan_merge_t *scan_ptr )
+{
+    scan_merge_t **pptr;
+
+    pptr = &(cache->hash[scan_hash(scan_ptr->scanres.bssid)]);
+    while( *pptr != NULL )
+        pptr = &((*pptr)->hash_next);
+    scan_ptr->hash_next = NULL;
+    *pptr = scan_ptr;
+    scan_ptr->flags &= ~SCAN_MERGE_F_ESS;
+    scan_ess_set(cache, scan_ptr);
+#ifdef CONFIG_SCAN_MERGE_SOA
+    scan_soa_add(cache, scan_ptr);
+#endif
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_hash_del
+Routine Description: Removes scan merge item from its hash chain
+Arguments:
+   cache    - pointer to hash index
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_hash_del( scan_cache_t *cache, scan_merge_t *scan_ptr )
+{
+    scan_merge_t **pptr;
+
+    pptr = &(cache->hash[scan_hash(scan_ptr->scanres.bssid)]);
+    while( *pptr != NULL ) {
+        if( *pptr == scan_ptr ) {
+            *pptr = scan_ptr->hash_next;
+            break;
+        }
+        pptr = &((*pptr)->hash_next);
+    }
+    scan_ptr->hash_next = NULL;
+    scan_ess_del(cache, scan_ptr);
+#ifdef CONFIG_SCAN_MERGE_SOA
+    scan_soa_del(cache, scan_ptr);
+#endif
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_init
+Routine Description: Inits scan merge list
+Arguments:
+   mydrv   - pointer to private driver data structure
+   ifname  - interface name, keys the snapshot file; NULL - no snapshot
+Return Value:
+-----------------------------------------------------------------------------*/
+void scan_init( struct wpa_driver_ti_data *mydrv, const char *ifname )
+{
+    scan_cache_t *cache;
+    int i;
+
+    mydrv->last_scan = -1;
+    shListInitList(&(mydrv->scan_merge_list));
+
+    cache = scan_cache_get(mydrv);
+    if( cache == NULL ) {
+        cache = (scan_cache_t *)os_malloc(sizeof(scan_cache_t));
+        scan_alloc_stats.allocs++;
+        if( cache == NULL ) {
+            wpa_printf(MSG_ERROR, "%s: no hash index, using list walk",
+                       __func__);
+            return;
+        }
+        cache->drv = mydrv;
+        cache->next = scan_cache_list;
+        scan_cache_list = cache;
+        for(i=0;( i < SCAN_MERGE_TYPES );i++)
+            cache->ttl[i] = scan_get_ttl(NULL, i);
+        cache->level_shift = SCAN_MERGE_LEVEL_SHIFT;
+        cache->delta_res = NULL;
+        cache->delta_size = 0;
+        cache->delta_gone = NULL;
+        cache->gone_size = 0;
+        cache->delta = NULL;
+        cache->max_entries = SCAN_MERGE_MAX_ENTRIES;
+        cache->max_bytes = SCAN_MERGE_MAX_BYTES;
+        cache->evict_policy = SCAN_MERGE_EVICT_LRU;
+        cache->victims = NULL;
+        cache->victims_size = 0;
+        os_memset(&(cache->mem), 0, sizeof(cache->mem));
+        cache->scan_chans_set = 0;
+        os_memset(&(cache->rank), 0, sizeof(cache->rank));
+        cache->rank_heap = NULL;
+#ifndef WPA_SUPPLICANT_VER_0_6_X
+        cache->rank_buf = NULL;
+#endif
+#ifdef CONFIG_SCAN_MERGE_SOA
+        cache->soa_key = NULL;
+#endif
+#ifdef CONFIG_SCAN_MERGE_CAPTURE
+        cache->capture_fd = -1;
+#endif
+#ifdef CONFIG_SCAN_MERGE_SHM
+        cache->shm = NULL;
+#endif
+    }
+    os_memset(cache->hash, 0, sizeof(cache->hash));
+    os_memset(cache->ess, 0, sizeof(cache->ess));
+    cache->num_victims = 0;
+#ifdef CONFIG_SCAN_MERGE_SOA
+    if( cache->soa_key )
+        scan_free(cache->soa_key);
+    cache->soa_key = NULL;
+    cache->soa_size = 0;
+    cache->soa_count = 0;
+    cache->soa_used = 0;
+    cache->soa_seq = 0;
+    cache->soa_failed = 0;
+#endif
+    cache->mem.entries = 0;
+    cache->mem.bytes = 0;
+#ifdef CONFIG_SCAN_MERGE_SNAPSHOT
+    scan_snapshot_name(cache, ifname);
+    scan_snapshot_load(mydrv);
+#else
+    (void)ifname;
+#endif
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_put
+Routine Description: Drops reference to scan merge item, frees it with the last
+Arguments:
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_put( scan_merge_t *scan_ptr )
+{
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    unsigned int i;
+
+    if( --scan_ptr->refcnt != 0 )
+        return;
+    scan_flat_drop(scan_ptr);
+    for(i=0;( i < scan_ptr->num_ies );i++)
+        scan_ie_put(SCAN_ITEM_IES(scan_ptr)[i]);
+    scan_free(scan_ptr);
+#else
+    if( --scan_ptr->refcnt == 0 )
+        scan_free(scan_ptr);
+#endif
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_exit
+Routine Description: Cleans scan merge list
+Arguments:
+   mydrv   - pointer to private driver data structure
+Return Value:
+-----------------------------------------------------------------------------*/
+void scan_exit( struct wpa_driver_ti_data *mydrv )
+{
+    SHLIST *head = &(mydrv->scan_merge_list);
+    SHLIST *item;
+    scan_cache_t **pptr, *cache;
+
+#ifdef CONFIG_SCAN_MERGE_SNAPSHOT
+    scan_snapshot_save(mydrv);
+#endif
+#ifdef CONFIG_SCAN_MERGE_SHM
+    scan_shm_stop(mydrv);
+#endif
+    while( (item = shListGetFirstItem(head)) != NULL ) {
+        shListUnlinkNode(head, item);
+        scan_put((scan_merge_t *)(item->data));
+    }
+    for(pptr=&scan_cache_list;( *pptr != NULL );pptr=&((*pptr)->next)) {
+        if( (*pptr)->drv == mydrv ) {
+            cache = *pptr;
+            *pptr = cache->next;
+            if( cache->delta_res )
+                scan_free(cache->delta_res);
+            if( cache->delta_gone )
+                scan_free(cache->delta_gone);
+            if( cache->victims )
+                scan_free(cache->victims);
+            if( cache->rank_heap )
+                scan_free(cache->rank_heap);
+#ifndef WPA_SUPPLICANT_VER_0_6_X
+            if( cache->rank_buf )
+                scan_free(cache->rank_buf);
+#endif
+#ifdef CONFIG_SCAN_MERGE_SOA
+            if( cache->soa_key )
+                scan_free(cache->soa_key);
+#endif
+#ifdef CONFIG_SCAN_MERGE_CAPTURE
+            if( cache->capture_fd >= 0 )
+                close(cache->capture_fd);
+#endif
+            scan_free(cache);
+            break;
+        }
+    }
+    shListPoolFlush();
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_count
+Routine Description: Gives number of list elements
+Arguments:
+   mydrv   - pointer to private driver data structure
+Return Value: Number of elements in the list
+-----------------------------------------------------------------------------*/
+unsigned long scan_count( struct wpa_driver_ti_data *mydrv )
+{
+    return shListGetCount(&(mydrv->scan_merge_list));
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_match
+Routine Description: Compares lookup key with cached fields of scan merge item
+Arguments:
+   key      - pointer to lookup key of new scan result
+   scan_ptr - pointer to scan merge item
+Return Value: 1 - if equal, 0 - if not
+-----------------------------------------------------------------------------*/
+static int scan_match( const scan_key_t *key, scan_merge_t *scan_ptr )
+{
+    if( (key->ssid == NULL) || (scan_ptr->flags & SCAN_MERGE_F_NO_SSID) )
+        return 0;
+    if( os_memcmp(key->bssid, scan_ptr->scanres.bssid, ETH_ALEN) )
+        return 0;
+    if( IS_HIDDEN_AP(key->ssid) || (scan_ptr->flags & SCAN_MERGE_F_HIDDEN) )
+        return 1;
+    return (key->ssid->ssid_len == scan_ptr->ssid.ssid_len) &&
+           !os_memcmp(key->ssid->ssid, scan_ptr->ssid.ssid,
+                      key->ssid->ssid_len);
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_equal
+Routine Description: List callback wrapper of scan_match
+Arguments:
+   val   - pointer to lookup key
+   idata - pointer to scan merge structure
+Return Value: 1 - if equal, 0 - if not
+-----------------------------------------------------------------------------*/
+static int scan_equal( void *val,  void *idata )
+{
+    return scan_match((const scan_key_t *)val, (scan_merge_t *)idata);
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_set_key
+Routine Description: Builds lookup key of scan result
+Arguments:
+   key     - pointer to lookup key to fill
+   view    - storage for SSID view referenced by the key
+   res_ptr - pointer to scan result structure
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_set_key( scan_key_t *key, scan_ssid_view_t *view,
+                          scan_result_t *res_ptr )
+{
+    key->bssid = res_ptr->bssid;
+    key->ssid = scan_get_ssid_view(res_ptr, view) ? NULL : view;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: copy_scan_res
+Routine Description: copies scan result structure to scan merge list item
+Arguments:
+   dst - pointer to scan result structure in the list
+   src - source pointer to scan result structure
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+void copy_scan_res( scan_result_t *dst, scan_result_t *src )
+{
+#ifdef WPA_SUPPLICANT_VER_0_5_X
+    if( IS_HIDDEN_AP(src) ) {
+        os_memcpy(src->ssid, dst->ssid, dst->ssid_len);
+        src->ssid_len = dst->ssid_len;
+    }
+#endif
+    os_memcpy(dst, src, sizeof(scan_result_t));
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_mem_add
+Routine Description: Accounts memory of cache items
+Arguments:
+   cache   - pointer to hash index
+   entries - number of items added (negative if removed)
+   bytes   - number of bytes added (negative if freed)
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_mem_add( scan_cache_t *cache, long entries, long bytes )
+{
+    cache->mem.entries += entries;
+    cache->mem.bytes += bytes;
+    if( cache->mem.bytes > cache->mem.peak_bytes )
+        cache->mem.peak_bytes = cache->mem.bytes;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_victim_less
+Routine Description: Compares two scan merge items by eviction policy
+Arguments:
+   cache - pointer to hash index
+   a, b  - pointers to scan merge items
+Return Value: 1 - if a is to be evicted before b, 0 - otherwise
+-----------------------------------------------------------------------------*/
+static int scan_victim_less( scan_cache_t *cache, scan_merge_t *a,
+                             scan_merge_t *b )
+{
+    if( cache->evict_policy == SCAN_MERGE_EVICT_LEVEL )
+        return( a->level_avg < b->level_avg );
+    return( (long)(a->last_seen - b->last_seen) < 0 );
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_victim_sift
+Routine Description: Restores victim heap order around one slot
+Arguments:
+   cache - pointer to hash index
+   pos   - heap slot whose item may be out of order
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_victim_sift( scan_cache_t *cache, unsigned int pos )
+{
+    scan_merge_t **heap = cache->victims;
+    scan_merge_t *tmp;
+    unsigned int child;
+
+    while( (pos > 0) &&
+           scan_victim_less(cache, heap[pos], heap[(pos - 1) / 2]) ) {
+        tmp = heap[pos];
+        heap[pos] = heap[(pos - 1) / 2];
+        heap[(pos - 1) / 2] = tmp;
+        heap[pos]->victim_pos = pos;
+        pos = (pos - 1) / 2;
+        heap[pos]->victim_pos = pos;
+    }
+    while( (child = 2 * pos + 1) < cache->num_victims ) {
+        if( (child + 1 < cache->num_victims) &&
+            scan_victim_less(cache, heap[child + 1], heap[child]) )
+            child++;
+        if( !scan_victim_less(cache, heap[child], heap[pos]) )
+            break;
+        tmp = heap[pos];
+        heap[pos] = heap[child];
+        heap[child] = tmp;
+        heap[pos]->victim_pos = pos;
+        heap[child]->victim_pos = child;
+        pos = child;
+    }
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_victim_add
+Routine Description: Makes scan merge item evictable. Items enter the heap
+                     once the merge that refreshed them is over, their
+                     last_seen and level_avg do not change while in it
+Arguments:
+   cache    - pointer to hash index, or NULL
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_victim_add( scan_cache_t *cache, scan_merge_t *scan_ptr )
+{
+    scan_merge_t **heap;
+    unsigned int size;
+
+    if( (cache == NULL) || (scan_ptr->flags & SCAN_MERGE_F_VICTIM) )
+        return;
+    if( cache->num_victims == cache->victims_size ) {
+        size = cache->victims_size ? 2 * cache->victims_size : 32;
+        heap = os_realloc(cache->victims, size * sizeof(*heap));
+        scan_alloc_stats.allocs++;
+        if( heap == NULL )  /* scan_victim() falls back to list walk */
+            return;
+        cache->victims = heap;
+        cache->victims_size = size;
+    }
+    scan_ptr->flags |= SCAN_MERGE_F_VICTIM;
+    scan_ptr->victim_pos = cache->num_victims;
+    cache->victims[cache->num_victims++] = scan_ptr;
+    scan_victim_sift(cache, scan_ptr->victim_pos);
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_victim_del
+Routine Description: Takes scan merge item out of victim heap
+Arguments:
+   cache    - pointer to hash index, or NULL
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_victim_del( scan_cache_t *cache, scan_merge_t *scan_ptr )
+{
+    scan_merge_t *last;
+    unsigned int pos = scan_ptr->victim_pos;
+
+    if( (cache == NULL) || !(scan_ptr->flags & SCAN_MERGE_F_VICTIM) )
+        return;
+    scan_ptr->flags &= ~SCAN_MERGE_F_VICTIM;
+    last = cache->victims[--cache->num_victims];
+    if( last != scan_ptr ) {
+        cache->victims[pos] = last;
+        last->victim_pos = pos;
+        scan_victim_sift(cache, pos);
+    }
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_del
+Routine Description: Removes scan merge item from list and hash index
+Arguments:
+   head     - pointer to scan merge list head
+   cache    - pointer to hash index, or NULL
+   scan_ptr - pointer to scan merge item
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_del( SHLIST *head, scan_cache_t *cache,
+                      scan_merge_t *scan_ptr )
+{
+    if( cache ) {
+        scan_victim_del(cache, scan_ptr);
+        scan_hash_del(cache, scan_ptr);
+        scan_mem_add(cache, -1, -(long)SCAN_ITEM_BYTES(scan_ptr));
+    }
+    shListUnlinkNode(head, &(scan_ptr->link));
+    scan_put(scan_ptr);
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_victim
+Routine Description: Selects scan merge item to evict according to policy:
+                     the victim heap root, or a list walk if the heap is
+                     empty or refreshed items may be evicted too
+Arguments:
+   head  - pointer to scan merge list head
+   cache - pointer to hash index
+   all   - 0 - skip items refreshed by the scan being merged
+Return Value: Pointer to scan merge item, or NULL if none can be evicted
+-----------------------------------------------------------------------------*/
+static scan_merge_t *scan_victim( SHLIST *head, scan_cache_t *cache, int all )
+{
+    SHLIST *item;
+    scan_merge_t *scan_ptr, *victim = NULL;
+
+    if( !all && cache->num_victims )
+        return cache->victims[0];
+    item = shListGetFirstItem(head);
+    for(;( item != NULL );item=shListGetNextItem(head, item)) {
+        scan_ptr = (scan_merge_t *)(item->data);
+        if( !all && (scan_ptr->count == SCAN_MERGE_COUNT) )
+            continue;
+        if( victim == NULL )
+            victim = scan_ptr;
+        else if( cache->evict_policy == SCAN_MERGE_EVICT_LEVEL ) {
+            if( scan_ptr->level_avg < victim->level_avg )
+                victim = scan_ptr;
+        }
+        else if( (long)(scan_ptr->last_seen - victim->last_seen) < 0 ) {
+            victim = scan_ptr;
+        }
+    }
+    return victim;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_make_room
+Routine Description: Evicts scan merge items until cache limits allow to add
+                     given number of items and bytes. Evicted BSSIDs are
+                     reported as removed during delta merge
+Arguments:
+   head    - pointer to scan merge list head
+   cache   - pointer to hash index
+   entries - number of items to be added
+   bytes   - number of bytes to be added
+   all     - 0 - keep items refreshed by the scan being merged
+Return Value: 0 - on success, -1 - if limits can not be met
+-----------------------------------------------------------------------------*/
+static int scan_make_room( SHLIST *head, scan_cache_t *cache,
+                           unsigned long entries, unsigned long bytes,
+                           int all )
+{
+    scan_merge_t *victim;
+    scan_delta_t *delta = cache->delta;
+
+    if( cache->max_bytes && (bytes > cache->max_bytes) )
+        return -1;
+    while( (cache->max_entries &&
+            (cache->mem.entries + entries > cache->max_entries)) ||
+           (cache->max_bytes &&
+            (cache->mem.bytes + bytes > cache->max_bytes)) ) {
+        victim = scan_victim(head, cache, all);
+        if( victim == NULL )
+            return -1;
+        if( delta ) {
+            os_memcpy(delta->removed[delta->num_removed++],
+                      victim->scanres.bssid, ETH_ALEN);
+        }
+        scan_del(head, cache, victim);
+        cache->mem.evictions++;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_add
+Routine Description: adds scan result structure to scan merge list
+Arguments:
+   head    - pointer to scan merge list head
+   cache   - pointer to hash index, or NULL
+   res_ptr - pointer to scan result structure
+   now     - current time in msec
+Return Value: Pointer to scan merge item
+-----------------------------------------------------------------------------*/
+static scan_merge_t *scan_add( SHLIST *head, scan_cache_t *cache,
+                               scan_result_t *res_ptr, unsigned long now )
+{
+    scan_merge_t *scan_ptr;
+    unsigned size = 0;
+
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    size += scan_ie_count(res_ptr) * sizeof(scan_ie_t *);
+#elif defined(WPA_SUPPLICANT_VER_0_6_X)
+    size += res_ptr->ie_len;
+#endif
+    if( cache &&
+        scan_make_room(head, cache, 1, sizeof(scan_merge_t) + size, 0) ) {
+        cache->mem.rejects++;
+        return( NULL );
+    }
+    scan_ptr = (scan_merge_t *)os_malloc(sizeof(scan_merge_t) + size);
+    scan_alloc_stats.allocs++;
+    if( !scan_ptr )
+        return( NULL );
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    os_memcpy(&(scan_ptr->scanres), res_ptr, sizeof(scan_result_t));
+    scan_ptr->num_ies = 0;
+    scan_ptr->flat = NULL;
+    if( scan_ie_intern(scan_ptr, res_ptr) < 0 ) {
+        scan_free(scan_ptr);
+        return( NULL );
+    }
+#else
+    os_memcpy(&(scan_ptr->scanres), res_ptr, sizeof(scan_result_t) + size);
+#endif
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+    scan_ptr->ie_size = size;
+#endif
+    scan_ptr->count = SCAN_MERGE_COUNT;
+    scan_ptr->last_seen = now;
+    scan_ptr->level_avg = res_ptr->level * SCAN_MERGE_LEVEL_ONE;
+    scan_ptr->level_bucket = scan_level_bucket(res_ptr->level);
+    scan_ptr->ie_hash = scan_ie_hash(res_ptr);
+    scan_ptr->flags = 0;
+    scan_ptr->refcnt = 1;
+    scan_ptr->hash_next = NULL;
+    scan_set_ssid(scan_ptr);
+    shListInsLastNode(head, &(scan_ptr->link), (void *)scan_ptr);
+    if( cache ) {
+        scan_hash_add(cache, scan_ptr);
+        scan_mem_add(cache, 1, SCAN_ITEM_BYTES(scan_ptr));
+    }
+    return scan_ptr;
+}
+
+#ifdef CONFIG_SCAN_MERGE_SOA
+/*-----------------------------------------------------------------------------
+Routine Name: scan_soa_find
+Routine Description: Finds scan merge item by BSSID in SoA table. Slots are
+                     compared a group at a time; SSID hash and flags filter
+                     candidates before the item itself is touched. Among
+                     several matches the oldest item wins, like on hash chains
+Arguments:
+   cache     - pointer to hash index
+   bssid     - pointer to BSSID
+   key       - pointer to lookup key with SSID, or NULL to skip SSID check
+   skip_flags - candidates with any of these flags are ignored
+Return Value: Pointer to scan merge item, or NULL
+-----------------------------------------------------------------------------*/
+static scan_merge_t *scan_soa_find( scan_cache_t *cache, const u8 *bssid,
+                                    const scan_key_t *key,
+                                    unsigned int skip_flags )
+{
+    u64 bssid_key = scan_soa_key(bssid);
+    unsigned int idx = scan_soa_slot(cache, bssid_key);
+    unsigned int mask, hits, slot;
+    u32 ssid_hash = 0;
+    int wildcard = 1;
+    scan_merge_t *scan_ptr, *found = NULL;
+
+    if( cache->soa_count == 0 )
+        return NULL;
+    if( key != NULL ) {
+        ssid_hash = scan_ssid_hash(key->ssid);
+        wildcard = IS_HIDDEN_AP(key->ssid);
+    }
+    for(;;) {
+        mask = scan_soa_match(&(cache->soa_key[idx]), bssid_key);
+        for(slot=idx,hits=mask & 0x0f;( hits != 0 );slot++,hits>>=1) {
+            if( !(hits & 1) || (cache->soa_flags[slot] & skip_flags) )
+                continue;
+            scan_ptr = cache->soa_item[slot];
+            if( !wildcard && !(cache->soa_flags[slot] & SCAN_MERGE_F_HIDDEN) &&
+                ((cache->soa_ssid_hash[slot] != ssid_hash) ||
+                 !scan_match(key, scan_ptr)) )
+                continue;
+            if( (found == NULL) ||
+                ((int)(scan_ptr->soa_seq - found->soa_seq) < 0) )
+                found = scan_ptr;
+        }
+        if( mask & 0xf0 )   /* Empty slot ends probe sequence */
+            return found;
+        idx = (idx + SCAN_SOA_GROUP) & (cache->soa_size - 1);
+    }
+}
+#endif
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_lookup
+Routine Description: Looks for scan merge item matching scan result
+Arguments:
+   head    - pointer to scan merge list head
+   cache   - pointer to hash index, or NULL to walk the list
+   key     - pointer to lookup key of scan result
+Return Value: Pointer to scan merge item, or NULL
+-----------------------------------------------------------------------------*/
+static scan_merge_t *scan_lookup( SHLIST *head, scan_cache_t *cache,
+                                  scan_key_t *key )
+{
+    scan_merge_t *scan_ptr;
+    SHLIST *item;
+
+    if( key->ssid == NULL )
+        return NULL;
+    if( cache == NULL ) {
+        item = shListFindItem(head, key, scan_equal);
+        return item ? (scan_merge_t *)(item->data) : NULL;
+    }
+#ifdef CONFIG_SCAN_MERGE_SOA
+    if( !cache->soa_failed )
+        return scan_soa_find(cache, key->bssid, key, SCAN_MERGE_F_NO_SSID);
+#endif
+    scan_ptr = cache->hash[scan_hash(key->bssid)];
+    for(;( scan_ptr != NULL );scan_ptr=scan_ptr->hash_next) {
+        if( scan_match(key, scan_ptr) )
+            return scan_ptr;
+    }
+    return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_replace
+Routine Description: Replaces scan merge item with its copy in list and hash
+                     index. Used when item does not fit new IEs, or when it
+                     is held and must not change under its holders
+Arguments:
+   cache    - pointer to hash index, or NULL
+   scan_ptr - pointer to scan merge item
+   ie_size  - IE room of new item (0.6.x)
+Return Value: Pointer to new scan merge item, or NULL
+-----------------------------------------------------------------------------*/
+static scan_merge_t *scan_replace( scan_cache_t *cache,
+                                   scan_merge_t *scan_ptr, size_t ie_size )
+{
+    scan_merge_t *new_ptr, **pptr;
+    size_t size = sizeof(scan_merge_t);
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    unsigned int i;
+#endif
+
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+    size += ie_size;
+#else
+    (void)ie_size;
+#endif
+    new_ptr = (scan_merge_t *)os_malloc(size);
+    scan_alloc_stats.allocs++;
+    if( new_ptr == NULL )
+        return NULL;
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    os_memcpy(new_ptr, scan_ptr, sizeof(scan_merge_t) +
+              scan_ptr->num_ies * sizeof(scan_ie_t *));
+    new_ptr->ie_size = ie_size;
+    new_ptr->flat = NULL;
+    for(i=0;( i < new_ptr->num_ies );i++)
+        SCAN_ITEM_IES(new_ptr)[i]->refcnt++;
+#elif defined(WPA_SUPPLICANT_VER_0_6_X)
+    os_memcpy(new_ptr, scan_ptr,
+              sizeof(scan_merge_t) + scan_ptr->scanres.ie_len);
+    new_ptr->ie_size = ie_size;
+#else
+    os_memcpy(new_ptr, scan_ptr, sizeof(scan_merge_t));
+#endif
+    new_ptr->refcnt = 1;
+    scan_set_ssid(new_ptr);
+    shListReplaceNode(&(scan_ptr->link), &(new_ptr->link), new_ptr);
+    if( cache ) {
+        pptr = &(cache->hash[scan_hash(scan_ptr->scanres.bssid)]);
+        while( (*pptr != NULL) && (*pptr != scan_ptr) )
+            pptr = &((*pptr)->hash_next);
+        if( *pptr != NULL )
+            *pptr = new_ptr;
+        if( new_ptr->flags & SCAN_MERGE_F_ESS ) {
+            pptr = &(cache->ess[new_ptr->ssid_hash &
+                                (SCAN_MERGE_HASH_SIZE - 1)]);
+            while( (*pptr != NULL) && (*pptr != scan_ptr) )
+                pptr = &((*pptr)->ess_next);
+            if( *pptr != NULL )
+                *pptr = new_ptr;
+        }
+#ifdef CONFIG_SCAN_MERGE_SOA
+        scan_soa_set(cache, new_ptr);
+#endif
+        scan_mem_add(cache, 0, (long)SCAN_ITEM_BYTES(new_ptr) -
+                               (long)SCAN_ITEM_BYTES(scan_ptr));
+    }
+    scan_put(scan_ptr);
+    return new_ptr;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_update
+Routine Description: Refreshes scan merge item from new scan result. On 0.6.x
+                     a hidden result keeps the IEs (and SSID) already known;
+                     otherwise the IEs are copied too. Held items are never
+                     modified: they are swapped for a copy first. An item
+                     that would grow past max_bytes keeps its old data
+Arguments:
+   head     - pointer to scan merge list head
+   cache    - pointer to hash index, or NULL
+   scan_ptr - pointer to scan merge item
+   res_ptr  - pointer to scan result structure
+   key      - pointer to lookup key of scan result (0.6.x)
+Return Value: Pointer to scan merge item, or NULL if it was not updated
+-----------------------------------------------------------------------------*/
+static scan_merge_t *scan_update( SHLIST *head, scan_cache_t *cache,
+                                  scan_merge_t *scan_ptr,
+                                  scan_result_t *res_ptr, scan_key_t *key )
+{
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+    int keep_ies = IS_HIDDEN_AP(key->ssid) &&
+                   !(scan_ptr->flags & SCAN_MERGE_F_HIDDEN);
+    size_t ie_size = scan_ptr->ie_size;
+    size_t ie_len;
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    size_t new_size = scan_ie_count(res_ptr) * sizeof(scan_ie_t *);
+    int ret;
+#else
+    size_t new_size = res_ptr->ie_len;
+#endif
+
+    if( !keep_ies && (new_size > ie_size) )
+        ie_size = new_size;
+    if( cache && (ie_size > scan_ptr->ie_size) &&
+        scan_make_room(head, cache, 0, ie_size - scan_ptr->ie_size, 0) ) {
+        cache->mem.rejects++;
+        return NULL;
+    }
+    if( (scan_ptr->refcnt > 1) || (ie_size > scan_ptr->ie_size) ) {
+        scan_ptr = scan_replace(cache, scan_ptr, ie_size);
+        if( scan_ptr == NULL )
+            return NULL;
+    }
+    if( keep_ies ) {
+        ie_len = scan_ptr->scanres.ie_len;
+        os_memcpy(&(scan_ptr->scanres), res_ptr, sizeof(scan_result_t));
+        scan_ptr->scanres.ie_len = ie_len;
+        return scan_ptr;
+    }
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    os_memcpy(&(scan_ptr->scanres), res_ptr, sizeof(scan_result_t));
+    ret = scan_ie_intern(scan_ptr, res_ptr);
+    if( ret < 0 )
+        wpa_printf(MSG_ERROR, "%s: no memory for IEs", __func__);
+    if( ret != 0 )  /* Contiguous copy is stale */
+        scan_flat_drop(scan_ptr);
+#else
+    os_memcpy(&(scan_ptr->scanres), res_ptr,
+              sizeof(scan_result_t) + res_ptr->ie_len);
+#endif
+#else
+    (void)head;
+    (void)key;
+    if( scan_ptr->refcnt > 1 ) {
+        scan_ptr = scan_replace(cache, scan_ptr, 0);
+        if( scan_ptr == NULL )
+            return NULL;
+    }
+    copy_scan_res(&(scan_ptr->scanres), res_ptr);
+#endif
+    scan_set_ssid(scan_ptr);
+    if( cache )
+        scan_ess_set(cache, scan_ptr);
+#ifdef CONFIG_SCAN_MERGE_SOA
+    if( cache )
+        scan_soa_set(cache, scan_ptr);
+#endif
+    return scan_ptr;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_smooth_level
+Routine Description: Folds level of new scan result into smoothed level of
+                     scan merge item and reports the smoothed value back
+Arguments:
+   cache    - pointer to hash index, or NULL
+   scan_ptr - pointer to updated scan merge item
+   res_ptr  - pointer to scan result structure
+   fresh    - 1 if item was not seen for SCAN_MERGE_LEVEL_RESTART
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_smooth_level( scan_cache_t *cache, scan_merge_t *scan_ptr,
+                               scan_result_t *res_ptr, int fresh )
+{
+    unsigned int shift = cache ? cache->level_shift : SCAN_MERGE_LEVEL_SHIFT;
+    int level = res_ptr->level * SCAN_MERGE_LEVEL_ONE;
+
+    if( fresh || (shift == 0) )
+        scan_ptr->level_avg = level;
+    else
+        scan_ptr->level_avg += (level - scan_ptr->level_avg) / (1 << shift);
+    scan_ptr->scanres.level = scan_level_round(scan_ptr->level_avg);
+    res_ptr->level = scan_ptr->scanres.level;
+}
+
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+/*-----------------------------------------------------------------------------
+Routine Name: scan_dup
+Routine Description: Create copy of scan results entry
+Arguments:
+   scan_ptr - pointer to scan merge item
+Return Value: pointer to new scan result item, or NULL
+-----------------------------------------------------------------------------*/
+static scan_result_t *scan_dup( scan_merge_t *scan_ptr )
+{
+    unsigned size;
+    scan_result_t *new_ptr;
+
+    if (!scan_ptr)
+        return NULL;
+
+    size = sizeof(scan_result_t) + scan_ptr->scanres.ie_len;
+    new_ptr = os_malloc(size);
+    scan_alloc_stats.allocs++;
+    if (!new_ptr)
+        return NULL;
+    os_memcpy(new_ptr, &(scan_ptr->scanres), sizeof(scan_result_t));
+    scan_copy_ies(scan_ptr, (u8 *)(new_ptr + 1));
+    return new_ptr;
+}
+#endif
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_age
+Routine Description: Marks all scan merge items as not seen in this merge,
+                     which makes them evictable
+Arguments:
+   head  - pointer to scan merge list head
+   cache - pointer to hash index, or NULL
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_age( SHLIST *head, scan_cache_t *cache )
+{
+    SHLIST *item;
+    scan_merge_t *scan_ptr;
+
+    item = shListGetFirstItem(head);
+    while( item != NULL ) {
+        scan_ptr = (scan_merge_t *)(item->data);
+        if( scan_ptr->count != 0 )
+            scan_ptr->count--;
+        scan_victim_add(cache, scan_ptr);
+        item = shListGetNextItem(head, item);
+    }
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_merge_one
+Routine Description: Finds/Adds scan merge item for one new scan result
+Arguments:
+   head     - pointer to scan merge list head
+   cache    - pointer to hash index, or NULL
+   res_ptr  - pointer to scan result structure
+   now      - current time in msec
+   scan_pptr - returns pointer to scan merge item, NULL on failure
+Return Value: SCAN_MERGE_SAME/ADDED/CHANGED/FAILED
+-----------------------------------------------------------------------------*/
+static int scan_merge_one( SHLIST *head, scan_cache_t *cache,
+                           scan_result_t *res_ptr, unsigned long now,
+                           scan_merge_t **scan_pptr )
+{
+    scan_merge_t *scan_ptr;
+    scan_ssid_view_t view;
+    scan_key_t key;
+    int fresh, ret = SCAN_MERGE_SAME;
+    int freq;
+    u16 caps;
+    u32 ie_hash;
+
+    scan_set_key(&key, &view, res_ptr);
+    scan_ptr = scan_lookup(head, cache, &key);
+    if( scan_ptr == NULL ) {
+        scan_ptr = scan_add(head, cache, res_ptr, now);
+        *scan_pptr = scan_ptr;
+        return scan_ptr ? SCAN_MERGE_ADDED : SCAN_MERGE_FAILED;
+    }
+    /* TTL is for expiry only, it may be 0 for scans merged every time */
+    fresh = (now - scan_ptr->last_seen) > SCAN_MERGE_LEVEL_RESTART;
+    scan_victim_del(cache, scan_ptr);
+    caps = scan_ptr->scanres.caps;
+    freq = scan_ptr->scanres.freq;
+    scan_ptr->count = SCAN_MERGE_COUNT;
+    scan_ptr->last_seen = now;
+    *scan_pptr = scan_ptr;
+    scan_ptr = scan_update(head, cache, scan_ptr, res_ptr, &key);
+    if( scan_ptr == NULL )  /* Keep old data */
+        return SCAN_MERGE_SAME;
+    scan_smooth_level(cache, scan_ptr, res_ptr, fresh);
+
+    ie_hash = scan_item_ie_hash(scan_ptr);
+    if( (ie_hash != scan_ptr->ie_hash) ||
+        (caps != scan_ptr->scanres.caps) ||
+        (freq != scan_ptr->scanres.freq) ||
+        (scan_level_bucket(scan_ptr->scanres.level) !=
+         scan_ptr->level_bucket) ) {
+        scan_ptr->ie_hash = ie_hash;
+        scan_ptr->level_bucket = scan_level_bucket(scan_ptr->scanres.level);
+        ret = SCAN_MERGE_CHANGED;
+    }
+    *scan_pptr = scan_ptr;
+    return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_rank_score
+Routine Description: Calculates ranking score of scan result
+Arguments:
+   cache   - pointer to hash index
+   res_ptr - pointer to scan result structure
+   item    - pointer to cache item of the result, or NULL
+Return Value: Score, higher is better
+-----------------------------------------------------------------------------*/
+static int scan_rank_score( scan_cache_t *cache, scan_result_t *res_ptr,
+                            scan_merge_t *item )
+{
+    scan_ssid_view_t view;
+    int score = res_ptr->level;
+    unsigned int i;
+
+    if( (cache->rank.flags & SCAN_RANK_F_BAND) && (res_ptr->freq > 4000) )
+        score += cache->rank.band_bonus;
+    if( !(cache->rank.flags & SCAN_RANK_F_SSID) )
+        return score;
+    if( item != NULL ) {
+        if( item->flags & (SCAN_MERGE_F_NO_SSID | SCAN_MERGE_F_HIDDEN) )
+            return score;
+        view = item->ssid;
+    }
+    else if( scan_get_ssid_view(res_ptr, &view) || IS_HIDDEN_AP(&view) ) {
+        return score;
+    }
+    for(i=0;( i < cache->rank.num_ssids );i++) {
+        if( (view.ssid_len == cache->rank.ssids[i].ssid_len) &&
+            !os_memcmp(view.ssid, cache->rank.ssids[i].ssid, view.ssid_len) )
+            return score + SCAN_RANK_SSID_BONUS;
+    }
+    return score;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_rank_better
+Routine Description: Compares ranking candidates; on equal score the earlier
+                     one wins, so output order is stable
+Arguments:
+   a - pointer to first candidate
+   b - pointer to second candidate
+Return Value: 1 - if a ranks above b, 0 - otherwise
+-----------------------------------------------------------------------------*/
+static int scan_rank_better( const scan_rank_ent_t *a, const scan_rank_ent_t *b )
+{
+    if( a->score != b->score )
+        return a->score > b->score;
+    return a->idx < b->idx;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_rank_sift
+Routine Description: Moves candidate down the ranking heap. The heap keeps the
+                     worst of the top candidates at its root
+Arguments:
+   heap - pointer to ranking heap
+   num  - number of candidates in heap
+   i    - position of candidate to move
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_rank_sift( scan_rank_ent_t *heap, unsigned int num,
+                            unsigned int i )
+{
+    scan_rank_ent_t ent = heap[i];
+    unsigned int child;
+
+    while( (child = 2 * i + 1) < num ) {
+        if( (child + 1 < num) &&
+            scan_rank_better(&(heap[child]), &(heap[child + 1])) )
+            child++;
+        if( !scan_rank_better(&ent, &(heap[child])) )
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = ent;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_rank_push
+Routine Description: Offers candidate to the ranking heap: O(log top_k)
+Arguments:
+   cache   - pointer to hash index
+   num     - pointer to number of candidates in heap
+   top_k   - heap capacity
+   res_ptr - pointer to scan result structure
+   idx     - order of arrival
+   item    - cache item missing from scan, or NULL for new scan result
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_rank_push( scan_cache_t *cache, unsigned int *num,
+                            unsigned int top_k, scan_result_t *res_ptr,
+                            unsigned int idx, scan_merge_t *item )
+{
+    scan_rank_ent_t *heap = cache->rank_heap;
+    scan_rank_ent_t ent;
+    unsigned int i, parent;
+
+    ent.res_ptr = res_ptr;
+    ent.score = scan_rank_score(cache, res_ptr, item);
+    ent.idx = idx;
+    ent.item = item;
+    if( *num < top_k ) {
+        for(i=(*num)++;( i > 0 );i=parent) {
+            parent = (i - 1) / 2;
+            if( !scan_rank_better(&(heap[parent]), &ent) )
+                break;
+            heap[i] = heap[parent];
+        }
+        heap[i] = ent;
+    }
+    else if( scan_rank_better(&ent, &(heap[0])) ) {
+        heap[0] = ent;
+        scan_rank_sift(heap, *num, 0);
+    }
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_rank_output
+Routine Description: Replaces merged results with ranked candidates, best
+                     first. Cache items are copied out only if they made it
+                     into the top; new results that did not are freed
+Arguments:
+   cache   - pointer to hash index
+   results - pointer to scan results array
+   number_items - current number of items
+   num     - number of candidates in heap
+Return Value: Number of items in results
+-----------------------------------------------------------------------------*/
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+static unsigned int scan_rank_output( scan_cache_t *cache,
+                                      scan_result_t **results,
+                                      unsigned int number_items,
+                                      unsigned int num )
+#else
+static unsigned int scan_rank_output( scan_cache_t *cache,
+                                      scan_result_t *results,
+                                      unsigned int number_items,
+                                      unsigned int num )
+#endif
+{
+    scan_rank_ent_t *heap = cache->rank_heap;
+    scan_rank_ent_t ent;
+    unsigned int i, n;
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+    scan_result_t *res_ptr;
+#endif
+
+    for(n=num;( n > 1 );n--) {  /* Worst to the end: best first */
+        ent = heap[0];
+        heap[0] = heap[n - 1];
+        heap[n - 1] = ent;
+        scan_rank_sift(heap, n - 1, 0);
+    }
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+    for(i=0;( i < num );i++) {
+        if( heap[i].item == NULL )
+            results[heap[i].idx] = NULL;
+    }
+    for(i=0;( i < number_items );i++) {
+        if( results[i] )
+            scan_free(results[i]);
+    }
+    for(i=0,n=0;( i < num );i++) {
+        res_ptr = heap[i].res_ptr;
+        if( heap[i].item && ((res_ptr = scan_dup(heap[i].item)) == NULL) )
+            continue;
+        results[n++] = res_ptr;
+    }
+    return n;
+#else
+    (void)number_items;
+    for(i=0;( i < num );i++)
+        os_memcpy(&(cache->rank_buf[i]), heap[i].res_ptr,
+                  sizeof(scan_result_t));
+    os_memcpy(results, cache->rank_buf, num * sizeof(scan_result_t));
+    return num;
+#endif
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_merge
+Routine Description: Merges current scan results with previous. Items missing
+                     from current results are reported until their TTL for
+                     the last scan type runs out; levels are smoothed. Items
+                     on channels the scan skipped (scan_set_scan_freqs()) are
+                     never dropped. With ranking set, only the top items are
+                     reported, best first
+Arguments:
+   mydrv   - pointer to private driver data structure
+   results - pointer to scan results array
+   number_items - current number of items
+   max_size - maximum namber of items
+Return Value: Merged number of items
+-----------------------------------------------------------------------------*/
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+unsigned int scan_merge( struct wpa_driver_ti_data *mydrv,
+                         scan_result_t **results, int force_flag,
+                         unsigned int number_items, unsigned int max_size )
+#else
+unsigned int scan_merge( struct wpa_driver_ti_data *mydrv,
+                         scan_result_t *results, int force_flag,
+                         unsigned int number_items, unsigned int max_size )
+#endif
+{
+    SHLIST *head = &(mydrv->scan_merge_list);
+    SHLIST *item;
+    scan_cache_t *cache = scan_cache_get(mydrv);
+    scan_result_t *res_ptr;
+    scan_merge_t *scan_ptr;
+    unsigned long heap_calls = scan_heap_calls();
+    unsigned long now = scan_get_msec();
+    unsigned long ttl = scan_get_ttl(cache, mydrv->last_scan);
+    unsigned int i, top_k = 0, num_ranked = 0, idx;
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+    int ret;
+#endif
+
+#ifdef CONFIG_SCAN_MERGE_CAPTURE
+    if( cache && (cache->capture_fd >= 0) )
+        scan_capture_write(cache, results, number_items, mydrv->last_scan,
+                           force_flag);
+#endif
+    scan_age(head, cache); /* Prepare items for removal */
+
+    for(i=0;( i < number_items );i++) { /* Find/Add new items */
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+        scan_ssid_view_t view;
+        scan_result_t *new_ptr;
+
+        res_ptr = results[i];
+#else
+        res_ptr = &(results[i]);
+#endif
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+        ret = scan_merge_one(head, cache, res_ptr, now, &scan_ptr);
+        if( ((ret == SCAN_MERGE_SAME) || (ret == SCAN_MERGE_CHANGED)) &&
+            !(scan_ptr->flags & (SCAN_MERGE_F_NO_SSID | SCAN_MERGE_F_HIDDEN)) &&
+            !scan_get_ssid_view(res_ptr, &view) && IS_HIDDEN_AP(&view) ) {
+            /* Report known SSID of hidden AP, as 0.5.x does */
+            if( scan_ptr->scanres.ie_len <= res_ptr->ie_len ) {
+                scan_copy_ies(scan_ptr, (u8 *)(res_ptr + 1));
+                res_ptr->ie_len = scan_ptr->scanres.ie_len;
+            }
+            else if( (new_ptr = scan_dup(scan_ptr)) != NULL ) {
+                new_ptr->level = res_ptr->level;
+                results[i] = new_ptr;
+                scan_free(res_ptr);
+            }
+        }
+#else
+        scan_merge_one(head, cache, res_ptr, now, &scan_ptr);
+#endif
+    }
+
+    if( cache ) /* Updated items may have grown */
+        scan_make_room(head, cache, 0, 0, 0);
+
+    if( cache && cache->rank.top_k ) {
+        top_k = (cache->rank.top_k < max_size) ? cache->rank.top_k : max_size;
+        for(i=0;( i < number_items );i++)
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+            scan_rank_push(cache, &num_ranked, top_k, results[i], i, NULL);
+#else
+            scan_rank_push(cache, &num_ranked, top_k, &(results[i]), i,
+                           NULL);
+#endif
+    }
+
+    idx = number_items;
+    item = shListGetFirstItem( head );  /* Add/Remove missing items */
+    while( item != NULL ) {
+        scan_ptr = (scan_merge_t *)(item->data);
+        item = shListGetNextItem(head, item);
+        if( scan_ptr->count == SCAN_MERGE_COUNT )
+            continue;
+        if( !force_flag && ((now - scan_ptr->last_seen) >= ttl) &&
+            scan_chan_scanned(cache, scan_ptr) ) {
+            scan_del(head, cache, scan_ptr);
+        }
+        else if( top_k ) {
+            scan_rank_push(cache, &num_ranked, top_k, &(scan_ptr->scanres),
+                           idx++, scan_ptr);
+        }
+        else if( number_items < max_size ) {
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+            res_ptr = scan_dup(scan_ptr);
+            if (res_ptr) {
+                results[number_items] = res_ptr;
+                number_items++;
+            }
+#else
+            os_memcpy(&(results[number_items]),
+                      &(scan_ptr->scanres), sizeof(scan_result_t));
+            number_items++;
+#endif
+        }
+    }
+
+    if( cache )
+        cache->scan_chans_set = 0;
+    if( top_k )
+        number_items = scan_rank_output(cache, results, number_items,
+                                        num_ranked);
+#ifdef CONFIG_SCAN_MERGE_SHM
+    if( cache && cache->shm )
+        scan_shm_publish(head, cache);
+#endif
+
+    scan_alloc_stats.last_merge = scan_heap_calls() - heap_calls;
+    wpa_printf(MSG_DEBUG, "%s: %u items, %lu heap calls", __func__,
+               number_items, scan_alloc_stats.last_merge);
+    return( number_items );
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_delta_grow
+Routine Description: Makes room for delta mode output. Storage is kept between
+                     merges, so steady state does not allocate
+Arguments:
+   cache - pointer to hash index
+   size  - number of entries needed
+Return Value: 0 - on success, -1 - on failure
+-----------------------------------------------------------------------------*/
+static int scan_delta_grow( scan_cache_t *cache, unsigned int size )
+{
+    scan_result_t **res;
+    u8 (*gone)[ETH_ALEN];
+    unsigned int new_size;
+
+    if( size > cache->delta_size ) {
+        new_size = cache->delta_size ? cache->delta_size : 32;
+        while( new_size < size )
+            new_size *= 2;
+        res = os_realloc(cache->delta_res, new_size * sizeof(*res));
+        scan_alloc_stats.allocs++;
+        if( res == NULL )
+            return -1;
+        cache->delta_res = res;
+        cache->delta_size = new_size;
+    }
+    if( shListGetCount(&(cache->drv->scan_merge_list)) > cache->gone_size ) {
+        new_size = cache->gone_size ? cache->gone_size : 32;
+        while( new_size < shListGetCount(&(cache->drv->scan_merge_list)) )
+            new_size *= 2;
+        gone = os_realloc(cache->delta_gone, new_size * ETH_ALEN);
+        scan_alloc_stats.allocs++;
+        if( gone == NULL )
+            return -1;
+        cache->delta_gone = gone;
+        cache->gone_size = new_size;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_merge_delta
+Routine Description: Merges current scan results into the cache like
+                     scan_merge(), but reports only items that were added,
+                     changed materially (level bucket, IEs, capabilities,
+                     frequency) or expired. Results array is not modified
+                     apart from smoothed levels
+Arguments:
+   mydrv   - pointer to private driver data structure
+   results - pointer to scan results array
+   number_items - current number of items
+   delta   - pointer to delta structure to fill
+Return Value: 0 - on success, -1 - on failure
+-----------------------------------------------------------------------------*/
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+int scan_merge_delta( struct wpa_driver_ti_data *mydrv,
+                      scan_result_t **results, unsigned int number_items,
+                      scan_delta_t *delta )
+#else
+int scan_merge_delta( struct wpa_driver_ti_data *mydrv,
+                      scan_result_t *results, unsigned int number_items,
+                      scan_delta_t *delta )
+#endif
+{
+    SHLIST *head = &(mydrv->scan_merge_list);
+    SHLIST *item;
+    scan_cache_t *cache = scan_cache_get(mydrv);
+    scan_result_t *res_ptr;
+    scan_merge_t *scan_ptr;
+    unsigned long heap_calls = scan_heap_calls();
+    unsigned long now = scan_get_msec();
+    unsigned long ttl = scan_get_ttl(cache, mydrv->last_scan);
+    unsigned int i, num_changed = 0;
+    int ret;
+
+    os_memset(delta, 0, sizeof(scan_delta_t));
+    if( (cache == NULL) || scan_delta_grow(cache, number_items) )
+        return -1;
+    delta->added = cache->delta_res;
+    delta->removed = cache->delta_gone;
+    cache->delta = delta;
+#ifdef CONFIG_SCAN_MERGE_CAPTURE
+    if( cache->capture_fd >= 0 )
+        scan_capture_write(cache, results, number_items, mydrv->last_scan, 0);
+#endif
+
+    scan_age(head, cache);
+
+    for(i=0;( i < number_items );i++) {
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+        res_ptr = results[i];
+#else
+        res_ptr = &(results[i]);
+#endif
+        /* Only marked here: a later result of the same BSS in this scan
+           may replace the item, and the marks move with it */
+        ret = scan_merge_one(head, cache, res_ptr, now, &scan_ptr);
+        if( ret == SCAN_MERGE_ADDED )
+            scan_ptr->flags |= SCAN_MERGE_F_ADDED;
+        else if( ret == SCAN_MERGE_CHANGED )
+            scan_ptr->flags |= SCAN_MERGE_F_CHANGED;
+    }
+    scan_make_room(head, cache, 0, 0, 0);
+    cache->delta = NULL;
+
+    /* Added items fill delta_res from the start, changed ones from the end */
+    item = shListGetFirstItem(head);
+    while( item != NULL ) {
+        scan_ptr = (scan_merge_t *)(item->data);
+        item = shListGetNextItem(head, item);
+        if( (scan_ptr->count != SCAN_MERGE_COUNT) &&
+            ((now - scan_ptr->last_seen) >= ttl) &&
+            scan_chan_scanned(cache, scan_ptr) ) {
+            os_memcpy(delta->removed[delta->num_removed++],
+                      scan_ptr->scanres.bssid, ETH_ALEN);
+            scan_del(head, cache, scan_ptr);
+            continue;
+        }
+        if( !(scan_ptr->flags & (SCAN_MERGE_F_ADDED | SCAN_MERGE_F_CHANGED)) )
+            continue;
+        res_ptr = scan_item_res(scan_ptr);
+        if( res_ptr && (scan_ptr->flags & SCAN_MERGE_F_ADDED) ) {
+            delta->added[delta->num_added++] = res_ptr;
+        }
+        else if( res_ptr ) {
+            num_changed++;
+            cache->delta_res[cache->delta_size - num_changed] = res_ptr;
+        }
+        scan_ptr->flags &= ~(SCAN_MERGE_F_ADDED | SCAN_MERGE_F_CHANGED);
+    }
+    if( num_changed )
+        delta->changed = &(cache->delta_res[cache->delta_size - num_changed]);
+    delta->num_changed = num_changed;
+    cache->scan_chans_set = 0;
+#ifdef CONFIG_SCAN_MERGE_SHM
+    if( cache->shm )
+        scan_shm_publish(head, cache);
+#endif
+
+    scan_alloc_stats.last_merge = scan_heap_calls() - heap_calls;
+    wpa_printf(MSG_DEBUG, "%s: +%u ~%u -%u, %lu heap calls", __func__,
+               delta->num_added, delta->num_changed, delta->num_removed,
+               scan_alloc_stats.last_merge);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_get_by_bssid
+Routine Description: Gets scan_result pointer to item by bssid
+Arguments:
+   mydrv   - pointer to private driver data structure
+   bssid   - pointer to bssid value
+Return Value: pointer to scan_result item
+-----------------------------------------------------------------------------*/
+scan_result_t *scan_get_by_bssid( struct wpa_driver_ti_data *mydrv, u8 *bssid )
+{
+    SHLIST *head = &(mydrv->scan_merge_list);
+    SHLIST *item;
+    scan_cache_t *cache = scan_cache_get(mydrv);
+    scan_merge_t *scan_ptr;
+
+#ifdef CONFIG_SCAN_MERGE_SOA
+    if( (cache != NULL) && !cache->soa_failed ) {
+        scan_ptr = scan_soa_find(cache, bssid, NULL,
+                                 SCAN_MERGE_F_NO_SSID | SCAN_MERGE_F_HIDDEN);
+        return scan_ptr ? scan_item_res(scan_ptr) : NULL;
+    }
+#endif
+    if( cache != NULL ) {
+        scan_ptr = cache->hash[scan_hash(bssid)];
+    }
+    else {
+        item = shListGetFirstItem(head);
+        scan_ptr = item ? (scan_merge_t *)(item->data) : NULL;
+    }
+    while( scan_ptr != NULL ) {
+        if( !os_memcmp(scan_ptr->scanres.bssid, bssid, ETH_ALEN) &&
+            !(scan_ptr->flags & (SCAN_MERGE_F_NO_SSID | SCAN_MERGE_F_HIDDEN)) )
+            return( scan_item_res(scan_ptr) );
+        if( cache != NULL ) {
+            scan_ptr = scan_ptr->hash_next;
+        }
+        else {
+            item = shListGetNextItem(head, &(scan_ptr->link));
+            scan_ptr = item ? (scan_merge_t *)(item->data) : NULL;
+        }
+    }
+    return( NULL );
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_ess_better
+Routine Description: Compares scan results for ESS order: higher level first,
+                     ties by BSSID so the order does not depend on the index
+Arguments:
+   a - pointer to scan result structure
+   b - pointer to scan result structure
+Return Value: 1 - if a goes first, 0 - otherwise
+-----------------------------------------------------------------------------*/
+static int scan_ess_better( scan_result_t *a, scan_result_t *b )
+{
+    if( a->level != b->level )
+        return a->level > b->level;
+    return os_memcmp(a->bssid, b->bssid, ETH_ALEN) < 0;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_get_ess
+Routine Description: Gets BSSes of an ESS from the cache, strongest first.
+                     Result pointers follow scan_get_by_bssid() rules
+Arguments:
+   mydrv       - pointer to private driver data structure
+   ssid        - pointer to SSID
+   ssid_len    - SSID length
+   results     - array to fill
+   max_results - size of results; only the strongest BSSes are returned
+Return Value: Number of results
+-----------------------------------------------------------------------------*/
+unsigned int scan_get_ess( struct wpa_driver_ti_data *mydrv,
+                           const u8 *ssid, size_t ssid_len,
+                           scan_result_t **results, unsigned int max_results )
+{
+    SHLIST *head = &(mydrv->scan_merge_list);
+    SHLIST *item;
+    scan_cache_t *cache = scan_cache_get(mydrv);
+    scan_merge_t *scan_ptr;
+    scan_result_t *res_ptr;
+    scan_ssid_view_t view;
+    unsigned int num = 0, i;
+    u32 hash;
+
+    view.ssid = ssid;
+    view.ssid_len = ssid_len;
+    hash = scan_ssid_hash(&view);
+    if( cache != NULL ) {
+        scan_ptr = cache->ess[hash & (SCAN_MERGE_HASH_SIZE - 1)];
+    }
+    else {
+        item = shListGetFirstItem(head);
+        scan_ptr = item ? (scan_merge_t *)(item->data) : NULL;
+    }
+    while( scan_ptr != NULL ) {
+        if( ((cache == NULL) || (scan_ptr->ssid_hash == hash)) &&
+            !(scan_ptr->flags & (SCAN_MERGE_F_NO_SSID | SCAN_MERGE_F_HIDDEN)) &&
+            (scan_ptr->ssid.ssid_len == ssid_len) &&
+            !os_memcmp(scan_ptr->ssid.ssid, ssid, ssid_len) &&
+            ((res_ptr = scan_item_res(scan_ptr)) != NULL) ) {
+            /* Insertion into the sorted array, dropping the weakest */
+            for(i=num;( (i > 0) &&
+                        scan_ess_better(res_ptr, results[i - 1]) );i--) {
+                if( i < max_results )
+                    results[i] = results[i - 1];
+            }
+            if( i < max_results ) {
+                results[i] = res_ptr;
+                if( num < max_results )
+                    num++;
+            }
+        }
+        if( cache != NULL ) {
+            scan_ptr = scan_ptr->ess_next;
+        }
+        else {
+            item = shListGetNextItem(head, &(scan_ptr->link));
+            scan_ptr = item ? (scan_merge_t *)(item->data) : NULL;
+        }
+    }
+    return num;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_res_hold
+Routine Description: Keeps scan result returned by the cache (delta mode,
+                     scan_get_by_bssid) valid and unchanged until released.
+                     Merges update a held item by swapping in a copy
+Arguments:
+   res_ptr - pointer to scan result owned by the cache
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+void scan_res_hold( scan_result_t *res_ptr )
+{
+    SCAN_RES_ITEM(res_ptr)->refcnt++;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_res_release
+Routine Description: Releases scan result kept by scan_res_hold()
+Arguments:
+   res_ptr - pointer to scan result owned by the cache
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+void scan_res_release( scan_result_t *res_ptr )
+{
+    scan_put(SCAN_RES_ITEM(res_ptr));
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_get_alloc_stats
+Routine Description: Gets heap accounting of the scan merge code
+Arguments:
+   stats - pointer to statistics structure to fill
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+void scan_get_alloc_stats( scan_alloc_stats_t *stats )
+{
+    os_memcpy(stats, &scan_alloc_stats, sizeof(scan_alloc_stats_t));
+    stats->list_calls = shListGetHeapCalls();
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_set_ttl
+Routine Description: Sets how long items missing from results are kept
+Arguments:
+   mydrv     - pointer to private driver data structure
+   scan_type - scan type the TTL applies to
+   ttl       - time in msec, 0 - drop missing items at once
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+void scan_set_ttl( struct wpa_driver_ti_data *mydrv, int scan_type,
+                   unsigned long ttl )
+{
+    scan_cache_t *cache = scan_cache_get(mydrv);
+
+    if( (cache == NULL) || (scan_type < 0) || (scan_type >= SCAN_MERGE_TYPES) )
+        return;
+    cache->ttl[scan_type] = ttl;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_set_smoothing
+Routine Description: Sets weight of new level in smoothed level
+Arguments:
+   mydrv       - pointer to private driver data structure
+   level_shift - new level weight is 1/2^level_shift, 0 - no smoothing
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+void scan_set_smoothing( struct wpa_driver_ti_data *mydrv,
+                         unsigned int level_shift )
+{
+    scan_cache_t *cache = scan_cache_get(mydrv);
+
+    if( (cache == NULL) || (level_shift > 8) )
+        return;
+    cache->level_shift = level_shift;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_set_scan_freqs
+Routine Description: Sets channels covered by the scan merged next, so items on
+                     other channels are kept instead of aged out. Applies to
+                     one scan_merge()/scan_merge_delta() call
+Arguments:
+   mydrv     - pointer to private driver data structure
+   freqs     - pointer to scanned frequencies in MHz, NULL - all channels
+   num_freqs - number of frequencies, 0 - all channels
+Return Value: 0 - on success, -1 - on failure
+-----------------------------------------------------------------------------*/
+int scan_set_scan_freqs( struct wpa_driver_ti_data *mydrv,
+                         const int *freqs, unsigned int num_freqs )
+{
+    scan_cache_t *cache = scan_cache_get(mydrv);
+    unsigned int i;
+    u16 slot;
+
+    if( cache == NULL )
+        return -1;
+    os_memset(cache->scan_chans, 0, sizeof(cache->scan_chans));
+    cache->scan_chans_set = 0;
+    if( (freqs == NULL) || (num_freqs == 0) )
+        return 0;
+    for(i=0;( i < num_freqs );i++) {
+        slot = scan_freq_to_slot(freqs[i]);
+        if( slot == 0 )     /* Unknown channel: age everything */
+            return 0;
+        cache->scan_chans[slot / 32] |= 1U << (slot % 32);
+    }
+    cache->scan_chans_set = 1;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_set_limits
+Routine Description: Sets memory bound of scan merge cache and evicts items
+                     exceeding it. The bound is hard: results that do not
+                     fit are not added, and refreshed items that would grow
+                     past it keep their old data. Delta mode pointers are
+                     invalidated
+Arguments:
+   mydrv        - pointer to private driver data structure
+   max_entries  - maximum number of items, 0 - unlimited
+   max_bytes    - maximum memory of items, 0 - unlimited
+   evict_policy - SCAN_MERGE_EVICT_LRU or SCAN_MERGE_EVICT_LEVEL
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+void scan_set_limits( struct wpa_driver_ti_data *mydrv,
+                      unsigned int max_entries, size_t max_bytes,
+                      int evict_policy )
+{
+    scan_cache_t *cache = scan_cache_get(mydrv);
+    unsigned int i;
 
-scan_ssid_t *scan_get_ssid( scan_result_t *res_ptr )
+    if( cache == NULL )
+        return;
+    cache->max_entries = max_entries;
+    cache->max_bytes = max_bytes;
+    if( cache->evict_policy != evict_policy ) {
+        cache->evict_policy = evict_policy;
+        for(i=cache->num_victims / 2;( i > 0 );i--)  /* Reorder heap */
+            scan_victim_sift(cache, i - 1);
+    }
+    scan_make_room(&(mydrv->scan_merge_list), cache, 0, 0, 1);
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_set_ranking
+Routine Description: Sets ranked output of scan_merge(): top items only, best
+                     first, selected in O(N log top_k)
+Arguments:
+   mydrv - pointer to private driver data structure
+   rank  - pointer to ranking settings, NULL or top_k 0 - ranking off
+Return Value: 0 - on success, -1 - on failure
+-----------------------------------------------------------------------------*/
+int scan_set_ranking( struct wpa_driver_ti_data *mydrv,
+                      const scan_rank_t *rank )
 {
-    static scan_ssid_t ssid_temp;
-#ifdef WPA_SUPPLICANT_VER_0_6_X
-    const u8 *res_ie;
+    scan_cache_t *cache = scan_cache_get(mydrv);
+    scan_rank_ent_t *heap = NULL;
+#ifndef WPA_SUPPLICANT_VER_0_6_X
+    scan_result_t *buf = NULL;
+#endif
+    unsigned int i;
 
-    res_ie = wpa_scan_get_ie(res_ptr, WLAN_EID_SSID);
-    if (!res_ie)
-        return NULL;
-    ssid_temp.ssid_len = (size_t)res_ie[1];
-    os_memcpy(ssid_temp.ssid, (res_ie + 2), ssid_temp.ssid_len);
-#else
-    ssid_temp.ssid_len = res_ptr->ssid_len;
-    os_memcpy(ssid_temp.ssid, res_ptr->ssid, ssid_temp.ssid_len);
+    if( cache == NULL )
+        return -1;
+    if( (rank != NULL) && rank->top_k ) {
+        if( rank->num_ssids > SCAN_RANK_MAX_SSIDS )
+            return -1;
+        for(i=0;( i < rank->num_ssids );i++) {
+            if( rank->ssids[i].ssid_len > MAX_SSID_LEN )
+                return -1;
+        }
+        heap = os_malloc(rank->top_k * sizeof(scan_rank_ent_t));
+        scan_alloc_stats.allocs++;
+        if( heap == NULL )
+            return -1;
+#ifndef WPA_SUPPLICANT_VER_0_6_X
+        buf = os_malloc(rank->top_k * sizeof(scan_result_t));
+        scan_alloc_stats.allocs++;
+        if( buf == NULL ) {
+            scan_free(heap);
+            return -1;
+        }
 #endif
-    return &ssid_temp;
+    }
+    if( cache->rank_heap )
+        scan_free(cache->rank_heap);
+    cache->rank_heap = heap;
+#ifndef WPA_SUPPLICANT_VER_0_6_X
+    if( cache->rank_buf )
+        scan_free(cache->rank_buf);
+    cache->rank_buf = buf;
+#endif
+    if( heap == NULL ) {
+        os_memset(&(cache->rank), 0, sizeof(cache->rank));
+        return 0;
+    }
+    cache->rank = *rank;
+    for(i=0;( i < rank->num_ssids );i++)
+        cache->rank_ssids[i] = rank->ssids[i];
+    cache->rank.ssids = cache->rank_ssids;
+    return 0;
 }
 
 /*-----------------------------------------------------------------------------
-Routine Name: scan_init
-Routine Description: Inits scan merge list
+Routine Name: scan_get_mem_stats
+Routine Description: Gets memory accounting of scan merge cache
+Arguments:
+   mydrv - pointer to private driver data structure
+   stats - pointer to structure to fill
+Return Value: 0 - on success, -1 - if there is no cache
+-----------------------------------------------------------------------------*/
+int scan_get_mem_stats( struct wpa_driver_ti_data *mydrv,
+                        scan_mem_stats_t *stats )
+{
+    scan_cache_t *cache = scan_cache_get(mydrv);
+
+    if( cache == NULL )
+        return -1;
+    os_memcpy(stats, &(cache->mem), sizeof(scan_mem_stats_t));
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    stats->ie_chunks = scan_ie_chunks;
+    stats->ie_bytes = scan_ie_bytes;
+#endif
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_print_mem_stats
+Routine Description: Prints memory accounting of scan merge cache as reply of
+                     driver private command
 Arguments:
    mydrv   - pointer to private driver data structure
-Return Value:
+   buf     - pointer to reply buffer
+   buf_len - reply buffer size
+Return Value: Reply length, or -1 on failure
 -----------------------------------------------------------------------------*/
-void scan_init( struct wpa_driver_ti_data *mydrv )
+int scan_print_mem_stats( struct wpa_driver_ti_data *mydrv,
+                          char *buf, size_t buf_len )
 {
-    mydrv->last_scan = -1;
-    shListInitList(&(mydrv->scan_merge_list));
+    scan_mem_stats_t stats;
+    int ret;
+
+    if( scan_get_mem_stats(mydrv, &stats) )
+        return -1;
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    ret = os_snprintf(buf, buf_len, "ScanCache entries %lu bytes %lu "
+                      "peak %lu evictions %lu rejects %lu "
+                      "iechunks %lu iebytes %lu\n",
+                      stats.entries, stats.bytes, stats.peak_bytes,
+                      stats.evictions, stats.rejects,
+                      stats.ie_chunks, stats.ie_bytes);
+#else
+    ret = os_snprintf(buf, buf_len, "ScanCache entries %lu bytes %lu "
+                      "peak %lu evictions %lu rejects %lu\n",
+                      stats.entries, stats.bytes, stats.peak_bytes,
+                      stats.evictions, stats.rejects);
+#endif
+    if( (ret < 0) || ((size_t)ret >= buf_len) )
+        return -1;
+    return ret;
 }
 
+#ifdef CONFIG_SCAN_MERGE_SNAPSHOT
 /*-----------------------------------------------------------------------------
-Routine Name: scan_free
-Routine Description: Frees scan structure private data
+Routine Name: scan_snapshot_hash
+Routine Description: Calculates hash of snapshot records (FNV-1a)
 Arguments:
-   ptr - pointer to private data structure
-Return Value:
+   data - pointer to records
+   len  - records length
+Return Value: Hash value
 -----------------------------------------------------------------------------*/
-static void scan_free( void *ptr )
+static u32 scan_snapshot_hash( const u8 *data, size_t len )
 {
-    os_free(ptr);
+    u32 hash = 2166136261U;
+    size_t i;
+
+    for(i=0;( i < len );i++) {
+        hash ^= data[i];
+        hash *= 16777619U;
+    }
+    return hash;
 }
 
 /*-----------------------------------------------------------------------------
-Routine Name: scan_exit
-Routine Description: Cleans scan merge list
+Routine Name: scan_snapshot_boot_id
+Routine Description: Gets kernel boot id, monotonic time is valid within it
 Arguments:
-   mydrv   - pointer to private driver data structure
-Return Value:
+   boot_id - buffer to fill, zeroed if boot id is not available
+Return Value: NONE
 -----------------------------------------------------------------------------*/
-void scan_exit( struct wpa_driver_ti_data *mydrv )
+static void scan_snapshot_boot_id( u8 *boot_id )
 {
-    shListDelAllItems(&(mydrv->scan_merge_list), scan_free);
+    int fd;
+
+    os_memset(boot_id, 0, sizeof(((scan_snapshot_hdr_t *)0)->boot_id));
+    fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+    if( fd < 0 )
+        return;
+    if( read(fd, boot_id, 36) != 36 )
+        os_memset(boot_id, 0, 36);
+    close(fd);
 }
 
 /*-----------------------------------------------------------------------------
-Routine Name: scan_count
-Routine Description: Gives number of list elements
+Routine Name: scan_snapshot_rec_len
+Routine Description: Gets length of snapshot record of scan merge item
 Arguments:
-   mydrv   - pointer to private driver data structure
-Return Value: Number of elements in the list
+   scan_ptr - pointer to scan merge item
+Return Value: Record length
 -----------------------------------------------------------------------------*/
-unsigned long scan_count( struct wpa_driver_ti_data *mydrv )
+static size_t scan_snapshot_rec_len( scan_merge_t *scan_ptr )
 {
-    return shListGetCount(&(mydrv->scan_merge_list));
+    size_t len = sizeof(scan_snapshot_rec_t) + sizeof(scan_result_t);
+
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+    len += scan_ptr->scanres.ie_len;
+#else
+    (void)scan_ptr;
+#endif
+    return (len + 7) & ~(size_t)7;
 }
 
 /*-----------------------------------------------------------------------------
-Routine Name: scan_equal
-Routine Description: Compares bssid of scan result and scan merge structure
+Routine Name: scan_snapshot_name
+Routine Description: Sets snapshot file of interface, so caches of several
+                     interfaces do not load each other's BSSes
 Arguments:
-   val   - pointer to scan result structure
-   idata - pointer to scan merge structure
-Return Value: 1 - if equal, 0 - if not
+   cache  - pointer to hash index
+   ifname - interface name, or NULL
+Return Value: NONE
 -----------------------------------------------------------------------------*/
-static int scan_equal( void *val,  void *idata )
+static void scan_snapshot_name( scan_cache_t *cache, const char *ifname )
 {
-    scan_ssid_t n_ssid, l_ssid, *p_ssid;
-    scan_result_t *new_res = (scan_result_t *)val;
-    scan_result_t *lst_res =
-               (scan_result_t *)(&(((scan_merge_t *)idata)->scanres));
     int ret;
-    size_t len;
 
-    p_ssid = scan_get_ssid(new_res);
-    if (!p_ssid)
-        return 0;
-    os_memcpy(&n_ssid, p_ssid, sizeof(scan_ssid_t));
-    p_ssid = scan_get_ssid(lst_res);
-    if (!p_ssid)
-        return 0;
-    os_memcpy(&l_ssid, p_ssid, sizeof(scan_ssid_t));
-
-    len = (IS_HIDDEN_AP(&n_ssid) || IS_HIDDEN_AP(&l_ssid)) ?
-          0 : n_ssid.ssid_len;
-    ret = ((l_ssid.ssid_len != n_ssid.ssid_len) && (len != 0)) ||
-          (os_memcmp(new_res->bssid, lst_res->bssid, ETH_ALEN) ||
-           os_memcmp(n_ssid.ssid, l_ssid.ssid, len));
-    return !ret;
+    cache->snapshot_file[0] = '\0';
+    if( (ifname == NULL) || (*ifname == '\0') || os_strchr(ifname, '/') )
+        return;
+    ret = os_snprintf(cache->snapshot_file, sizeof(cache->snapshot_file),
+                      "%s-%s.bin", SCAN_MERGE_SNAPSHOT_FILE, ifname);
+    if( (ret < 0) || (ret >= (int)sizeof(cache->snapshot_file)) )
+        cache->snapshot_file[0] = '\0';
 }
 
 /*-----------------------------------------------------------------------------
-Routine Name: copy_scan_res
-Routine Description: copies scan result structure to scan merge list item
+Routine Name: scan_snapshot_save
+Routine Description: Writes scan merge list to snapshot file. The file is
+                     replaced atomically, so a reader never sees partial data
 Arguments:
-   dst - pointer to scan result structure in the list
-   src - source pointer to scan result structure
+   mydrv - pointer to private driver data structure
 Return Value: NONE
 -----------------------------------------------------------------------------*/
-void copy_scan_res( scan_result_t *dst, scan_result_t *src )
+static void scan_snapshot_save( struct wpa_driver_ti_data *mydrv )
 {
-#ifdef WPA_SUPPLICANT_VER_0_5_X
-    if( IS_HIDDEN_AP(src) ) {
-        os_memcpy(src->ssid, dst->ssid, dst->ssid_len);
-        src->ssid_len = dst->ssid_len;
+    SHLIST *head = &(mydrv->scan_merge_list);
+    scan_cache_t *cache = scan_cache_get(mydrv);
+    char tmp_file[SCAN_MERGE_SNAPSHOT_PATH + 4];
+    SHLIST *item;
+    scan_merge_t *scan_ptr;
+    scan_snapshot_hdr_t *hdr;
+    scan_snapshot_rec_t *rec;
+    unsigned long now = scan_get_msec();
+    size_t len = sizeof(scan_snapshot_hdr_t), rec_len;
+    u8 *buf, *pos;
+    int fd, ret = -1;
+
+    if( (cache == NULL) || (cache->snapshot_file[0] == '\0') )
+        return;
+    if( shListGetCount(head) == 0 ) {
+        unlink(cache->snapshot_file);
+        return;
     }
+    item = shListGetFirstItem(head);
+    for(;( item != NULL );item=shListGetNextItem(head, item))
+        len += scan_snapshot_rec_len((scan_merge_t *)(item->data));
+    buf = os_zalloc(len);
+    if( buf == NULL )
+        return;
+
+    hdr = (scan_snapshot_hdr_t *)buf;
+    pos = buf + sizeof(scan_snapshot_hdr_t);
+    item = shListGetFirstItem(head);
+    for(;( item != NULL );item=shListGetNextItem(head, item)) {
+        scan_ptr = (scan_merge_t *)(item->data);
+        rec_len = scan_snapshot_rec_len(scan_ptr);
+        rec = (scan_snapshot_rec_t *)pos;
+        rec->rec_len = rec_len;
+        rec->age = now - scan_ptr->last_seen;
+        rec->level_avg = scan_ptr->level_avg;
+        rec->count = scan_ptr->count;
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+        os_memcpy(rec + 1, &(scan_ptr->scanres), sizeof(scan_result_t));
+        scan_copy_ies(scan_ptr, (u8 *)(rec + 1) + sizeof(scan_result_t));
+#else
+        os_memcpy(rec + 1, &(scan_ptr->scanres), sizeof(scan_result_t));
 #endif
-    os_memcpy(dst, src, sizeof(scan_result_t));
+        pos += rec_len;
+        hdr->count++;
+    }
+    hdr->magic = SCAN_MERGE_SNAPSHOT_MAGIC;
+    hdr->version = SCAN_MERGE_SNAPSHOT_VERSION;
+    hdr->res_size = sizeof(scan_result_t);
+    hdr->data_len = len - sizeof(scan_snapshot_hdr_t);
+    hdr->data_hash = scan_snapshot_hash(buf + sizeof(scan_snapshot_hdr_t),
+                                        hdr->data_len);
+    hdr->saved_msec = now;
+    scan_snapshot_boot_id(hdr->boot_id);
+
+    os_snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", cache->snapshot_file);
+    fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if( fd >= 0 ) {
+        if( write(fd, buf, len) == (ssize_t)len )
+            ret = 0;
+        close(fd);
+        if( !ret )
+            ret = rename(tmp_file, cache->snapshot_file);
+        if( ret )
+            unlink(tmp_file);
+    }
+    wpa_printf(MSG_DEBUG, "%s: %s %u items, %u bytes, %s", __func__,
+               cache->snapshot_file, hdr->count, (unsigned)len,
+               ret ? "failed" : "ok");
+    os_free(buf);
 }
 
 /*-----------------------------------------------------------------------------
-Routine Name: scan_add
-Routine Description: adds scan result structure to scan merge list
+Routine Name: scan_snapshot_load
+Routine Description: Fills scan merge list from snapshot file. Items get their
+                     age at writing plus the time since, and those older than
+                     TTL are skipped; snapshot of earlier boot is dropped
 Arguments:
-   head    - pointer to scan merge list head
-   res_ptr - pointer to scan result structure
-Return Value: Pointer to scan merge item
+   mydrv - pointer to private driver data structure
+Return Value: NONE
 -----------------------------------------------------------------------------*/
-static scan_merge_t *scan_add( SHLIST *head, scan_result_t *res_ptr )
+static void scan_snapshot_load( struct wpa_driver_ti_data *mydrv )
 {
+    SHLIST *head = &(mydrv->scan_merge_list);
+    scan_cache_t *cache = scan_cache_get(mydrv);
+    scan_snapshot_hdr_t *hdr;
+    scan_snapshot_rec_t *rec;
+    scan_result_t *res_ptr;
     scan_merge_t *scan_ptr;
-    unsigned size = 0;
+    struct stat st;
+    unsigned long now = scan_get_msec();
+    unsigned long age, elapsed, ttl = scan_get_ttl(cache, -1);
+    u8 boot_id[sizeof(hdr->boot_id)];
+    u8 *map, *pos, *end;
+    unsigned int i, loaded = 0;
+    int fd;
+
+    if( (cache == NULL) || (cache->snapshot_file[0] == '\0') )
+        return;
+    fd = open(cache->snapshot_file, O_RDONLY);
+    if( fd < 0 )
+        return;
+    if( fstat(fd, &st) || (st.st_size < (off_t)sizeof(scan_snapshot_hdr_t)) ) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( map == MAP_FAILED )
+        return;
+
+    hdr = (scan_snapshot_hdr_t *)map;
+    scan_snapshot_boot_id(boot_id);
+    if( (hdr->magic != SCAN_MERGE_SNAPSHOT_MAGIC) ||
+        (hdr->version != SCAN_MERGE_SNAPSHOT_VERSION) ||
+        (hdr->res_size != sizeof(scan_result_t)) ||
+        (hdr->data_len != st.st_size - sizeof(scan_snapshot_hdr_t)) ||
+        os_memcmp(hdr->boot_id, boot_id, sizeof(boot_id)) ||
+        ((u32)now - hdr->saved_msec > 0x7fffffffU) ||
+        (hdr->data_hash != scan_snapshot_hash(map + sizeof(*hdr),
+                                              hdr->data_len)) ) {
+        wpa_printf(MSG_DEBUG, "%s: snapshot dropped", __func__);
+        munmap(map, st.st_size);
+        return;
+    }
 
+    elapsed = (u32)now - hdr->saved_msec;
+    pos = map + sizeof(scan_snapshot_hdr_t);
+    end = pos + hdr->data_len;
+    for(i=0;( i < hdr->count );i++) {
+        rec = (scan_snapshot_rec_t *)pos;
+        if( (end - pos < (long)(sizeof(*rec) + sizeof(scan_result_t))) ||
+            (rec->rec_len > (size_t)(end - pos)) )
+            break;
+        pos += rec->rec_len;
+        res_ptr = (scan_result_t *)(rec + 1);
 #ifdef WPA_SUPPLICANT_VER_0_6_X
-    size += res_ptr->ie_len;
+        if( sizeof(*rec) + sizeof(scan_result_t) + res_ptr->ie_len >
+            rec->rec_len )
+            break;
 #endif
-    scan_ptr = (scan_merge_t *)os_malloc(sizeof(scan_merge_t) + size);
-    if( !scan_ptr )
-        return( NULL );
-    os_memcpy(&(scan_ptr->scanres), res_ptr, sizeof(scan_result_t) + size);
-    scan_ptr->count = SCAN_MERGE_COUNT;
-    shListInsLastItem(head, (void *)scan_ptr);
-    return scan_ptr;
+        age = rec->age + elapsed;
+        if( age >= ttl )
+            continue;
+        scan_ptr = scan_add(head, cache, res_ptr, now - age);
+        if( scan_ptr == NULL )
+            continue;
+        scan_ptr->level_avg = rec->level_avg;
+        scan_ptr->count = rec->count ? rec->count - 1 : 0;
+        scan_victim_add(cache, scan_ptr);
+        loaded++;
+    }
+    munmap(map, st.st_size);
+    wpa_printf(MSG_DEBUG, "%s: %u of %u items", __func__, loaded, hdr->count);
 }
+#endif
 
+#ifdef CONFIG_SCAN_MERGE_CAPTURE
 /*-----------------------------------------------------------------------------
-Routine Name: scan_find
-Routine Description: Looks for scan merge item in scan results array
+Routine Name: scan_capture_write
+Routine Description: Appends scan results to capture file. Capture is stopped
+                     on write error. Heap use is not counted in alloc stats
 Arguments:
-   scan_ptr - pointer to scan merge item
+   cache   - pointer to hash index
    results - pointer to scan results array
    number_items - current number of items
-Return Value: 1 - if item was found, 0 - otherwise
+   scan_type - type of the scan
+   force_flag - force flag passed to scan_merge()
+Return Value: NONE
 -----------------------------------------------------------------------------*/
-static int scan_find( scan_merge_t *scan_ptr, scan_result_t *results,
-                      unsigned int number_items )
+static void scan_capture_write( scan_cache_t *cache, scan_result_t **results,
+                                unsigned int number_items, int scan_type,
+                                int force_flag )
 {
+    scan_capture_scan_t *scan_hdr;
+    scan_capture_res_t *rec;
+    scan_result_t *res_ptr;
+    size_t len = sizeof(scan_capture_scan_t);
     unsigned int i;
+    u8 *buf, *pos;
 
+    for(i=0;( i < number_items );i++)
+        len += SCAN_CAPTURE_REC_LEN(results[i]->ie_len);
+    buf = os_zalloc(len);
+    if( buf == NULL )
+        return;
+    scan_hdr = (scan_capture_scan_t *)buf;
+    scan_hdr->msec = scan_get_msec() - cache->capture_start;
+    scan_hdr->scan_type = scan_type;
+    scan_hdr->count = number_items;
+    scan_hdr->force_flag = force_flag;
+    pos = buf + sizeof(scan_capture_scan_t);
     for(i=0;( i < number_items );i++) {
-        if( scan_equal(&(results[i]), scan_ptr) )
-            return 1;
+        res_ptr = results[i];
+        rec = (scan_capture_res_t *)pos;
+        os_memcpy(rec->bssid, res_ptr->bssid, ETH_ALEN);
+        rec->caps = res_ptr->caps;
+        rec->freq = res_ptr->freq;
+        rec->beacon_int = res_ptr->beacon_int;
+        rec->qual = res_ptr->qual;
+        rec->noise = res_ptr->noise;
+        rec->level = res_ptr->level;
+        rec->ie_len = res_ptr->ie_len;
+        rec->tsf = res_ptr->tsf;
+        os_memcpy(rec + 1, res_ptr + 1, res_ptr->ie_len);
+        pos += SCAN_CAPTURE_REC_LEN(res_ptr->ie_len);
     }
-    return 0;
+    if( write(cache->capture_fd, buf, len) != (ssize_t)len ) {
+        wpa_printf(MSG_ERROR, "%s: write failed, capture stopped", __func__);
+        close(cache->capture_fd);
+        cache->capture_fd = -1;
+    }
+    os_free(buf);
 }
 
-#ifdef WPA_SUPPLICANT_VER_0_6_X
 /*-----------------------------------------------------------------------------
-Routine Name: scan_dup
-Routine Description: Create copy of scan results entry
+Routine Name: scan_capture_start
+Routine Description: Starts recording scan results passed to scan_merge() and
+                     scan_merge_delta() into capture file, for replay by the
+                     host benchmark (lib/bench)
 Arguments:
-   res_ptr - pointer to scan result item
-Return Value: pointer to new scan result item, or NULL
+   mydrv - pointer to private driver data structure
+   path  - capture file, truncated
+Return Value: 0 - on success, -1 - on failure
 -----------------------------------------------------------------------------*/
-static scan_result_t *scan_dup( scan_result_t *res_ptr )
+int scan_capture_start( struct wpa_driver_ti_data *mydrv, const char *path )
 {
-    unsigned size;
-    scan_result_t *new_ptr;
+    scan_cache_t *cache = scan_cache_get(mydrv);
+    scan_capture_hdr_t hdr;
+    int fd;
 
-    if (!res_ptr)
-        return NULL;
-
-    size = sizeof(scan_result_t) + res_ptr->ie_len;
-    new_ptr = os_malloc(size);
-    if (!new_ptr)
-        return NULL;
-    if (res_ptr) {
-        os_memcpy(new_ptr, res_ptr, size);
+    if( cache == NULL )
+        return -1;
+    scan_capture_stop(mydrv);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if( fd < 0 )
+        return -1;
+    os_memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SCAN_MERGE_CAPTURE_MAGIC;
+    hdr.version = SCAN_MERGE_CAPTURE_VERSION;
+    hdr.res_size = sizeof(scan_capture_res_t);
+    if( write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ) {
+        close(fd);
+        return -1;
     }
-    return new_ptr;
+    cache->capture_fd = fd;
+    cache->capture_start = scan_get_msec();
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_capture_stop
+Routine Description: Stops recording scan results
+Arguments:
+   mydrv - pointer to private driver data structure
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+void scan_capture_stop( struct wpa_driver_ti_data *mydrv )
+{
+    scan_cache_t *cache = scan_cache_get(mydrv);
+
+    if( (cache == NULL) || (cache->capture_fd < 0) )
+        return;
+    close(cache->capture_fd);
+    cache->capture_fd = -1;
 }
 #endif
 
+#ifdef CONFIG_SCAN_MERGE_SHM
 /*-----------------------------------------------------------------------------
-Routine Name: scan_merge
-Routine Description: Merges current scan results with previous
+Routine Name: scan_shm_ies
+Routine Description: Gets IEs of scan merge item as exported to shared list
 Arguments:
-   mydrv   - pointer to private driver data structure
-   results - pointer to scan results array
-   number_items - current number of items
-   max_size - maximum namber of items
-Return Value: Merged number of items
+   scan_ptr - pointer to scan merge item
+   buf      - buffer to fill, or NULL to get the length only
+Return Value: IE length
 -----------------------------------------------------------------------------*/
+static size_t scan_shm_ies( scan_merge_t *scan_ptr, u8 *buf )
+{
 #ifdef WPA_SUPPLICANT_VER_0_6_X
-unsigned int scan_merge( struct wpa_driver_ti_data *mydrv,
-                         scan_result_t **results, int force_flag,
-                         unsigned int number_items, unsigned int max_size )
+    if( buf )
+        scan_copy_ies(scan_ptr, buf);
+    return scan_ptr->scanres.ie_len;
 #else
-unsigned int scan_merge( struct wpa_driver_ti_data *mydrv,
-                         scan_result_t *results, int force_flag,
-                         unsigned int number_items, unsigned int max_size )
+    scan_result_t *res_ptr = &(scan_ptr->scanres);
+
+    if( buf ) {
+        buf[0] = WLAN_EID_SSID;
+        buf[1] = (u8)res_ptr->ssid_len;
+        os_memcpy(buf + 2, res_ptr->ssid, res_ptr->ssid_len);
+        buf += 2 + res_ptr->ssid_len;
+        os_memcpy(buf, res_ptr->wpa_ie, res_ptr->wpa_ie_len);
+        buf += res_ptr->wpa_ie_len;
+        os_memcpy(buf, res_ptr->rsn_ie, res_ptr->rsn_ie_len);
+    }
+    return 2 + res_ptr->ssid_len + res_ptr->wpa_ie_len + res_ptr->rsn_ie_len;
 #endif
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_shm_publish
+Routine Description: Writes scan merge list to shared segment. Items that do
+                     not fit are left out, in list order
+Arguments:
+   head  - pointer to scan merge list head
+   cache - pointer to hash index with shared segment
+Return Value: NONE
+-----------------------------------------------------------------------------*/
+static void scan_shm_publish( SHLIST *head, scan_cache_t *cache )
 {
-    SHLIST *head = &(mydrv->scan_merge_list);
-    SHLIST *item, *del_item;
-    scan_result_t *res_ptr;
+    scan_shm_hdr_t *hdr = cache->shm;
+    scan_shm_res_t *rec;
     scan_merge_t *scan_ptr;
-    unsigned int i;
+    SHLIST *item;
+    unsigned long now = scan_get_msec();
+    u8 *pos = (u8 *)(hdr + 1);
+    u8 *end = (u8 *)hdr + cache->shm_size;
+    size_t ie_len, rec_len;
+    u32 count = 0, flags = 0;
 
-    /* Prepare items for removal */
+    hdr->seq++;
+    SCAN_SHM_BARRIER();
     item = shListGetFirstItem(head);
-    while( item != NULL ) {
+    for(;( item != NULL );item=shListGetNextItem(head, item)) {
         scan_ptr = (scan_merge_t *)(item->data);
-        if( scan_ptr->count != 0 )
-            scan_ptr->count--;
-        item = shListGetNextItem(head, item);
-    }
-
-    for(i=0;( i < number_items );i++) { /* Find/Add new items */
-#ifdef WPA_SUPPLICANT_VER_0_6_X
-        res_ptr = results[i];
-#else
-        res_ptr = &(results[i]);
-#endif
-        item = shListFindItem( head, res_ptr, scan_equal );
-        if( item ) {
-#ifdef WPA_SUPPLICANT_VER_0_6_X
-            scan_ssid_t *p_ssid;
-            scan_result_t *new_ptr;
-#endif
-            scan_ptr = (scan_merge_t *)(item->data);
-            copy_scan_res(&(scan_ptr->scanres), res_ptr);
-            scan_ptr->count = SCAN_MERGE_COUNT;
+        ie_len = scan_shm_ies(scan_ptr, NULL);
+        rec_len = SCAN_SHM_REC_LEN(ie_len);
+        if( rec_len > (size_t)(end - pos) ) {
+            flags |= SCAN_SHM_F_TRUNCATED;
+            break;
+        }
+        rec = (scan_shm_res_t *)pos;
+        os_memset(rec, 0, rec_len);
+        os_memcpy(rec->bssid, scan_ptr->scanres.bssid, ETH_ALEN);
+        rec->caps = scan_ptr->scanres.caps;
+        rec->freq = scan_ptr->scanres.freq;
+        rec->qual = scan_ptr->scanres.qual;
+        rec->noise = scan_ptr->scanres.noise;
+        rec->level = scan_ptr->scanres.level;
+        rec->ie_len = ie_len;
+        rec->age = now - scan_ptr->last_seen;
 #ifdef WPA_SUPPLICANT_VER_0_6_X
-	    p_ssid = scan_get_ssid(res_ptr);
-            if (p_ssid && IS_HIDDEN_AP(p_ssid)) {
-                new_ptr = scan_dup(res_ptr);
-                if (new_ptr) {
-                    results[i] = new_ptr;
-                    os_free(res_ptr);
-                }
-            }
+        rec->beacon_int = scan_ptr->scanres.beacon_int;
+        rec->tsf = scan_ptr->scanres.tsf;
 #endif
-        }
-        else {
-            scan_add(head, res_ptr);
-        }
+        scan_shm_ies(scan_ptr, (u8 *)(rec + 1));
+        pos += rec_len;
+        count++;
     }
+    hdr->count = count;
+    hdr->data_len = pos - (u8 *)(hdr + 1);
+    hdr->flags = flags;
+    hdr->msec = now;
+    SCAN_SHM_BARRIER();
+    hdr->seq++;
+}
 
-    item = shListGetFirstItem( head );  /* Add/Remove missing items */
-    while( item != NULL ) {
-        del_item = NULL;
-        scan_ptr = (scan_merge_t *)(item->data);
-        if( scan_ptr->count != SCAN_MERGE_COUNT ) {
-            if( !force_flag && ((scan_ptr->count == 0) ||
-                (mydrv->last_scan == SCAN_TYPE_NORMAL_ACTIVE)) ) {
-                del_item = item;
-            }
-            else {
-                if( number_items < max_size ) {
-#ifdef WPA_SUPPLICANT_VER_0_6_X
-                    res_ptr = scan_dup(&(scan_ptr->scanres));
-                    if (res_ptr) {
-                        results[number_items] = res_ptr;
-                        number_items++;
-                    }
-#else
-                    os_memcpy(&(results[number_items]),
-                          &(scan_ptr->scanres), sizeof(scan_result_t));
-                    number_items++;
-#endif
-                }
-            }
-        }
-        item = shListGetNextItem(head, item);
-        shListDelItem(head, del_item, scan_free);
+/*-----------------------------------------------------------------------------
+Routine Name: scan_shm_start
+Routine Description: Shares scan merge list with other processes: the list is
+                     published to a memory mapped file after every merge, for
+                     lock-free readers using scan_shm_read()
+Arguments:
+   mydrv - pointer to private driver data structure
+   path  - segment file, NULL - SCAN_MERGE_SHM_FILE
+Return Value: 0 - on success, -1 - on failure
+-----------------------------------------------------------------------------*/
+int scan_shm_start( struct wpa_driver_ti_data *mydrv, const char *path )
+{
+    scan_cache_t *cache = scan_cache_get(mydrv);
+    scan_shm_hdr_t *hdr;
+    struct stat st;
+    u32 seq = 0;
+    int fd;
+
+    if( cache == NULL )
+        return -1;
+    scan_shm_stop(mydrv);
+    if( path == NULL )
+        path = SCAN_MERGE_SHM_FILE;
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if( fd < 0 )
+        return -1;
+    /* Never shrink the file: readers may have it mapped */
+    if( fstat(fd, &st) ||
+        ((st.st_size < SCAN_MERGE_SHM_SIZE) &&
+         ftruncate(fd, SCAN_MERGE_SHM_SIZE)) ) {
+        close(fd);
+        return -1;
     }
+    hdr = mmap(NULL, SCAN_MERGE_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    close(fd);
+    if( hdr == MAP_FAILED )
+        return -1;
 
-    return( number_items );
+    /* Generation goes on from the previous writer, if any */
+    if( (hdr->magic == SCAN_MERGE_SHM_MAGIC) &&
+        (hdr->version == SCAN_MERGE_SHM_VERSION) )
+        seq = hdr->seq;
+    hdr->seq = seq | 1;
+    SCAN_SHM_BARRIER();
+    hdr->magic = SCAN_MERGE_SHM_MAGIC;
+    hdr->version = SCAN_MERGE_SHM_VERSION;
+    hdr->res_size = sizeof(scan_shm_res_t);
+    hdr->size = SCAN_MERGE_SHM_SIZE;
+    hdr->count = 0;
+    hdr->data_len = 0;
+    hdr->flags = 0;
+    SCAN_SHM_BARRIER();
+    hdr->seq++;
+    cache->shm = hdr;
+    cache->shm_size = SCAN_MERGE_SHM_SIZE;
+    scan_shm_publish(&(mydrv->scan_merge_list), cache);
+    return 0;
 }
 
 /*-----------------------------------------------------------------------------
-Routine Name: scan_get_by_bssid
-Routine Description: Gets scan_result pointer to item by bssid
+Routine Name: scan_shm_stop
+Routine Description: Stops sharing scan merge list. Readers get an empty list
+                     flagged SCAN_SHM_F_STOPPED
 Arguments:
-   mydrv   - pointer to private driver data structure
-   bssid   - pointer to bssid value
-Return Value: pointer to scan_result item
+   mydrv - pointer to private driver data structure
+Return Value: NONE
 -----------------------------------------------------------------------------*/
-scan_result_t *scan_get_by_bssid( struct wpa_driver_ti_data *mydrv, u8 *bssid )
+void scan_shm_stop( struct wpa_driver_ti_data *mydrv )
 {
-    SHLIST *head = &(mydrv->scan_merge_list);
-    SHLIST *item;
-    scan_result_t *cur_res;
-    scan_ssid_t *p_ssid;
+    scan_cache_t *cache = scan_cache_get(mydrv);
+    scan_shm_hdr_t *hdr;
 
-    item = shListGetFirstItem(head);
-    if( item == NULL )
-        return( NULL );
-    do {
-        cur_res = (scan_result_t *)&(((scan_merge_t *)(item->data))->scanres);
-        p_ssid = scan_get_ssid(cur_res);
-        if( (!os_memcmp(cur_res->bssid, bssid, ETH_ALEN)) &&
-            (!IS_HIDDEN_AP(p_ssid)) ) {
-            return( cur_res );
+    if( (cache == NULL) || (cache->shm == NULL) )
+        return;
+    hdr = cache->shm;
+    hdr->seq++;
+    SCAN_SHM_BARRIER();
+    hdr->count = 0;
+    hdr->data_len = 0;
+    hdr->flags = SCAN_SHM_F_STOPPED;
+    hdr->msec = scan_get_msec();
+    SCAN_SHM_BARRIER();
+    hdr->seq++;
+    munmap(hdr, cache->shm_size);
+    cache->shm = NULL;
+}
+
+/*-----------------------------------------------------------------------------
+Routine Name: scan_shm_read
+Routine Description: Copies consistent shared scan list: header, then records.
+                     Needs no driver data, so other processes can use it.
+                     Retries while the writer publishes, never blocks it
+Arguments:
+   path    - segment file, NULL - SCAN_MERGE_SHM_FILE
+   buf     - buffer to fill, 8-byte aligned
+   buf_len - buffer size, SCAN_MERGE_SHM_SIZE is always enough
+Return Value: Bytes copied, -1 - on failure
+-----------------------------------------------------------------------------*/
+int scan_shm_read( const char *path, u8 *buf, size_t buf_len )
+{
+    const scan_shm_hdr_t *hdr;
+    struct stat st;
+    u8 *map;
+    size_t len;
+    u32 seq;
+    int fd, i, ret = -1;
+
+    if( path == NULL )
+        path = SCAN_MERGE_SHM_FILE;
+    fd = open(path, O_RDONLY);
+    if( fd < 0 )
+        return -1;
+    if( fstat(fd, &st) || (st.st_size < (off_t)sizeof(scan_shm_hdr_t)) ) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if( map == MAP_FAILED )
+        return -1;
+
+    hdr = (const scan_shm_hdr_t *)map;
+    for(i=0;( i < SCAN_MERGE_SHM_TRIES );i++) {
+        seq = hdr->seq;
+        SCAN_SHM_BARRIER();
+        if( seq & 1 ) {     /* Writer is publishing */
+            sched_yield();
+            continue;
         }
-        item = shListGetNextItem(head, item);
-    } while( item != NULL );
+        if( (hdr->magic != SCAN_MERGE_SHM_MAGIC) ||
+            (hdr->version != SCAN_MERGE_SHM_VERSION) ||
+            (hdr->res_size != sizeof(scan_shm_res_t)) )
+            break;
+        len = sizeof(scan_shm_hdr_t) + hdr->data_len;
+        if( (len > (size_t)st.st_size) || (len > buf_len) )
+            len = 0;
+        else
+            os_memcpy(buf, map, len);
+        SCAN_SHM_BARRIER();
+        if( hdr->seq != seq )
+            continue;
+        ret = len ? (int)len : -1;
+        break;
+    }
+    munmap(map, st.st_size);
+    return ret;
+}
 
-    return( NULL );
+/*-----------------------------------------------------------------------------
+Routine Name: scan_shm_next
+Routine Description: Walks records of shared scan list copy
+Arguments:
+   buf  - pointer to list copy from scan_shm_read()
+   len  - list copy length
+   prev - pointer to previous record, NULL - get first record
+Return Value: Pointer to record, or NULL at end of list
+-----------------------------------------------------------------------------*/
+const scan_shm_res_t *scan_shm_next( const u8 *buf, size_t len,
+                                     const scan_shm_res_t *prev )
+{
+    const scan_shm_res_t *rec;
+    size_t off;
+
+    if( len < sizeof(scan_shm_hdr_t) )
+        return NULL;
+    if( prev )
+        off = ((const u8 *)prev - buf) + SCAN_SHM_REC_LEN(prev->ie_len);
+    else
+        off = sizeof(scan_shm_hdr_t);
+    if( (off > len) || (len - off < sizeof(scan_shm_res_t)) )
+        return NULL;
+    rec = (const scan_shm_res_t *)(buf + off);
+    if( rec->ie_len > len - off - sizeof(scan_shm_res_t) )
+        return NULL;
+    return rec;
 }
+#endif
@@ -20,8 +20,67 @@
 #include "common.h"
 #include "driver.h"
 #include "driver_ti.h"
+#include "shlist.h"
 
 #define SCAN_MERGE_COUNT        4
+#define SCAN_MERGE_HASH_SIZE    256     /* must be a power of 2 */
+#define SCAN_MERGE_TYPES        8       /* scan types with own TTL */
+#define SCAN_MERGE_TTL_DEFAULT  60000   /* msec */
+#define SCAN_MERGE_LEVEL_SHIFT  2       /* new level weight is 1/4 */
+#define SCAN_MERGE_LEVEL_FRAC   4       /* fraction bits of level_avg */
+#define SCAN_MERGE_LEVEL_RESTART 60000  /* msec unseen, smoothing restarts */
+#define SCAN_MERGE_DELTA_LEVEL  6       /* dB, level bucket of delta mode */
+#define SCAN_MERGE_MAX_ENTRIES  0       /* 0 - unlimited, scan_set_limits() */
+#define SCAN_MERGE_MAX_BYTES    0       /* 0 - unlimited, scan_set_limits() */
+#define SCAN_MERGE_CHANNELS     384     /* channel slots tracked */
+
+#ifdef CONFIG_SCAN_MERGE_SNAPSHOT
+#ifndef SCAN_MERGE_SNAPSHOT_FILE     /* per interface: <this>-<ifname>.bin */
+#define SCAN_MERGE_SNAPSHOT_FILE    "/data/misc/wifi/scan_merge"
+#endif
+#define SCAN_MERGE_SNAPSHOT_PATH    128     /* bytes of file name */
+#define SCAN_MERGE_SNAPSHOT_MAGIC   0x47524d53  /* "SMRG" */
+#define SCAN_MERGE_SNAPSHOT_VERSION 1
+#endif
+
+/* Capture records wpa_scan_res and IEs, so it needs the 0.6.x API */
+#if defined(CONFIG_SCAN_MERGE_CAPTURE) && !defined(WPA_SUPPLICANT_VER_0_6_X)
+#undef CONFIG_SCAN_MERGE_CAPTURE
+#endif
+
+/* IE pool stores IEs after wpa_scan_res, so it needs the 0.6.x API */
+#if defined(CONFIG_SCAN_MERGE_IE_POOL) && !defined(WPA_SUPPLICANT_VER_0_6_X)
+#undef CONFIG_SCAN_MERGE_IE_POOL
+#endif
+
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+#define SCAN_MERGE_IE_POOL_SIZE 256     /* must be a power of 2 */
+#endif
+
+#ifdef CONFIG_SCAN_MERGE_CAPTURE
+#define SCAN_MERGE_CAPTURE_MAGIC    0x50414353  /* "SCAP" */
+#define SCAN_MERGE_CAPTURE_VERSION  1
+#define SCAN_CAPTURE_REC_LEN(ie_len) \
+    ((sizeof(scan_capture_res_t) + (ie_len) + 7) & ~(size_t)7)
+#endif
+
+#ifdef CONFIG_SCAN_MERGE_SHM
+#ifndef SCAN_MERGE_SHM_FILE
+#define SCAN_MERGE_SHM_FILE     "/data/misc/wifi/scan_merge.shm"
+#endif
+#define SCAN_MERGE_SHM_SIZE     (64 * 1024) /* segment, header included */
+#define SCAN_MERGE_SHM_MAGIC    0x4d485353  /* "SSHM" */
+#define SCAN_MERGE_SHM_VERSION  1
+#define SCAN_MERGE_SHM_TRIES    1000        /* reader retries */
+#define SCAN_SHM_REC_LEN(ie_len) \
+    ((sizeof(scan_shm_res_t) + (ie_len) + 7) & ~(size_t)7)
+#define SCAN_SHM_F_TRUNCATED    0x01    /* list did not fit the segment */
+#define SCAN_SHM_F_STOPPED      0x02    /* writer is gone, list is empty */
+#endif
+
+/* Eviction policy when cache is full */
+#define SCAN_MERGE_EVICT_LRU    0       /* least recently seen first */
+#define SCAN_MERGE_EVICT_LEVEL  1       /* lowest smoothed level first */
 
 typedef
 #ifdef WPA_SUPPLICANT_VER_0_6_X
@@ -36,15 +95,283 @@ typedef struct {
     size_t ssid_len;
 } scan_ssid_t;
 
+/* Zero-copy SSID: points into the scan result it was taken from */
+typedef struct {
+    const u8 *ssid;
+    size_t ssid_len;
+} scan_ssid_view_t;
+
+#define SCAN_MERGE_F_NO_SSID    0x01    /* result carries no SSID IE */
+#define SCAN_MERGE_F_HIDDEN     0x02    /* empty or zeroed SSID */
+#define SCAN_MERGE_F_ESS        0x04    /* linked in ESS index */
+#define SCAN_MERGE_F_VICTIM     0x08    /* in cache victim heap */
+#define SCAN_MERGE_F_ADDED      0x10    /* added by delta merge in progress */
+#define SCAN_MERGE_F_CHANGED    0x20    /* changed by delta merge in progress */
+
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+/* Interned IE, stored once and shared by all items carrying it. Bytes at
+   the end of IEs that do not form a whole IE are interned as one chunk. */
+typedef struct SCANIE_STRUCT {
+    struct SCANIE_STRUCT *next;     /* pool hash chain */
+    u32 hash;
+    unsigned int refcnt;
+    size_t len;
+    u8 data[1];                     /* len octets */
+} scan_ie_t;
+
+/* Contiguous copy of pooled item, handed out to callers */
+typedef struct {
+    struct SCANMERGE_STRUCT *item;
+    scan_result_t res;              /* IEs follow */
+} scan_flat_t;
+#endif
+
 typedef struct SCANMERGE_STRUCT {
+    SHLIST link;            /* scan_merge_list node, must be first */
+    struct SCANMERGE_STRUCT *hash_next;
+    struct SCANMERGE_STRUCT *ess_next;
     unsigned long count;
-    scan_result_t scanres;
+    unsigned long last_seen;    /* msec, monotonic */
+    int level_avg;              /* smoothed level, SCAN_MERGE_LEVEL_FRAC */
+    int level_bucket;           /* smoothed level / SCAN_MERGE_DELTA_LEVEL */
+    u32 ie_hash;                /* to detect IE changes */
+    scan_ssid_view_t ssid;      /* points into scanres, set on insert/update */
+    u32 ssid_hash;              /* ESS index key, valid with F_ESS */
+    unsigned int flags;
+    unsigned int refcnt;        /* list holds one, scan_res_hold() adds */
+    u16 chan_slot;              /* slot of scanres.freq, 0 - unknown */
+    unsigned int victim_pos;    /* slot in cache victim heap, F_VICTIM */
+#ifdef CONFIG_SCAN_MERGE_SOA
+    unsigned int soa_idx;       /* slot in cache SoA table */
+    unsigned int soa_seq;       /* insertion order in SoA table */
+#endif
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+    size_t ie_size;             /* IE room allocated after scanres */
+#endif
+#ifdef CONFIG_SCAN_MERGE_IE_POOL
+    unsigned int num_ies;       /* IE references after scanres */
+    scan_flat_t *flat;          /* built on demand, dropped on update */
+#endif
+    scan_result_t scanres;      /* must be last: IEs (or IE references
+                                   with IE pool) follow on 0.6.x */
 } scan_merge_t;
 
-void scan_init( struct wpa_driver_ti_data *mydrv );
+/* Delta mode output. Result pointers refer to cache items and stay valid
+   until the next merge call, or until scan_res_release() if held; the
+   arrays are owned by the cache. */
+typedef struct {
+    scan_result_t **added;
+    unsigned int num_added;
+    scan_result_t **changed;
+    unsigned int num_changed;
+    u8 (*removed)[ETH_ALEN];
+    unsigned int num_removed;
+} scan_delta_t;
+
+/* Ranked output of scan_merge(): only the top_k best items are returned,
+   best first. Score is the smoothed level in dB, plus band_bonus on 5 GHz
+   with SCAN_RANK_F_BAND; with SCAN_RANK_F_SSID items of configured SSIDs
+   rank above all others. */
+#define SCAN_RANK_F_BAND        0x01
+#define SCAN_RANK_F_SSID        0x02
+#define SCAN_RANK_MAX_SSIDS     16
+
+typedef struct {
+    unsigned int top_k;         /* 0 - ranking off */
+    unsigned int flags;         /* SCAN_RANK_F_* */
+    int band_bonus;             /* dB */
+    const scan_ssid_t *ssids;   /* copied by scan_set_ranking() */
+    unsigned int num_ssids;
+} scan_rank_t;
+
+/* Ranking candidate: new scan result, or cached item missing from scan */
+typedef struct {
+    scan_result_t *res_ptr;
+    int score;
+    unsigned int idx;           /* order of arrival, breaks ties */
+    scan_merge_t *item;         /* cache item missing from scan, or NULL */
+} scan_rank_ent_t;
+
+/* Memory accounting of a cache; bytes include the item header and IEs, or
+   IE references when IEs are pooled */
+typedef struct {
+    unsigned long entries;
+    unsigned long bytes;
+    unsigned long peak_bytes;
+    unsigned long evictions;
+    unsigned long rejects;      /* inserts/growing updates dropped */
+    unsigned long ie_chunks;    /* IE pool, shared by all caches */
+    unsigned long ie_bytes;
+} scan_mem_stats_t;
+
+#ifdef CONFIG_SCAN_MERGE_SHM
+/* Shared scan list, host byte order: header, then count records. Each
+   record is scan_shm_res_t followed by ie_len octets of IEs, padded to
+   8 bytes (0.5.x results are exported as SSID, WPA and RSN IEs). The merge
+   code is the single writer and publishes the whole list after every
+   merge; seq is odd while it does, so readers copy the list and retry if
+   seq was odd or changed meanwhile (see scan_shm_read()). */
+typedef struct {
+    u32 magic;
+    u16 version;
+    u16 res_size;               /* sizeof(scan_shm_res_t) of the writer */
+    volatile u32 seq;           /* +2 per publish, odd while writing */
+    u32 size;                   /* segment size */
+    u32 count;
+    u32 data_len;               /* bytes of records after header */
+    u32 flags;                  /* SCAN_SHM_F_* */
+    u32 msec;                   /* monotonic time of publishing, low bits */
+} scan_shm_hdr_t;
+
+typedef struct {
+    u8 bssid[ETH_ALEN];
+    u16 caps;
+    s32 freq;
+    u16 beacon_int;
+    u16 reserved;
+    s32 qual;
+    s32 noise;
+    s32 level;                  /* smoothed */
+    u32 ie_len;
+    u32 age;                    /* msec since BSS was seen, at publishing */
+    u32 reserved2;
+    u64 tsf;
+} scan_shm_res_t;
+#endif
+
+/* Per-driver hash index over scan_merge_list. Entries are keyed by BSSID;
+   the SSID (with hidden SSID acting as a wildcard) is checked on the chain,
+   so a lookup costs one bucket walk instead of a full list walk. A second
+   index keyed by SSID links the BSSes of each ESS; items without a known
+   SSID are left out of it.
+   Memory is bounded by max_entries/max_bytes; items refreshed by the scan
+   being merged are never evicted, and one that would need more IE room than
+   eviction can free keeps its old data, so both bounds are hard. The other items are kept in a heap
+   ordered by the eviction policy, so an eviction takes its root. */
+typedef struct SCANCACHE_STRUCT {
+    struct SCANCACHE_STRUCT *next;
+    struct wpa_driver_ti_data *drv;
+    scan_merge_t *hash[SCAN_MERGE_HASH_SIZE];
+    scan_merge_t *ess[SCAN_MERGE_HASH_SIZE];   /* by SSID hash */
+    unsigned long ttl[SCAN_MERGE_TYPES];    /* msec, by scan type */
+    unsigned int level_shift;               /* 0 - no smoothing */
+    scan_result_t **delta_res;              /* delta mode output storage */
+    unsigned int delta_size;
+    u8 (*delta_gone)[ETH_ALEN];
+    unsigned int gone_size;
+    scan_delta_t *delta;                    /* set during delta merge */
+    unsigned int max_entries;
+    size_t max_bytes;
+    int evict_policy;
+    scan_merge_t **victims;                 /* heap, first is evicted */
+    unsigned int num_victims;
+    unsigned int victims_size;
+    scan_mem_stats_t mem;
+    /* Channels covered by the next merge; items on other channels are
+       kept as they are, not aged out */
+    u32 scan_chans[SCAN_MERGE_CHANNELS / 32];
+    int scan_chans_set;                     /* 0 - all channels */
+    scan_rank_t rank;
+    scan_ssid_t rank_ssids[SCAN_RANK_MAX_SSIDS];
+    scan_rank_ent_t *rank_heap;             /* top_k entries */
+#ifndef WPA_SUPPLICANT_VER_0_6_X
+    scan_result_t *rank_buf;                /* top_k results, for reorder */
+#endif
+#ifdef CONFIG_SCAN_MERGE_SOA
+    /* Struct-of-arrays open addressing table: lookups compare packed
+       BSSIDs a slot group at a time with SIMD, and check SSID hash and
+       flags before touching items */
+    u64 *soa_key;                           /* BSSID, zero padded */
+    scan_merge_t **soa_item;
+    u32 *soa_ssid_hash;
+    u8 *soa_flags;                          /* SCAN_MERGE_F_* */
+    unsigned int soa_size;                  /* slots, power of 2 */
+    unsigned int soa_count;                 /* items */
+    unsigned int soa_used;                  /* items and deleted slots */
+    unsigned int soa_seq;
+    int soa_failed;                         /* use hash chains instead */
+#endif
+#ifdef CONFIG_SCAN_MERGE_CAPTURE
+    int capture_fd;                         /* -1 - not capturing */
+    unsigned long capture_start;            /* msec */
+#endif
+#ifdef CONFIG_SCAN_MERGE_SHM
+    scan_shm_hdr_t *shm;                    /* NULL - not shared */
+    size_t shm_size;
+#endif
+#ifdef CONFIG_SCAN_MERGE_SNAPSHOT
+    char snapshot_file[SCAN_MERGE_SNAPSHOT_PATH];   /* "" - no snapshot */
+#endif
+} scan_cache_t;
+
+#ifdef CONFIG_SCAN_MERGE_SNAPSHOT
+/* Snapshot file layout: header, then count records. Each record is
+   scan_snapshot_rec_t followed by scan_result_t and its IEs, padded to
+   8 bytes, so the file can be used in place through mmap. */
+typedef struct {
+    u32 magic;
+    u16 version;
+    u16 res_size;               /* sizeof(scan_result_t) of the writer */
+    u32 count;
+    u32 data_len;               /* bytes of records after header */
+    u32 data_hash;              /* FNV-1a of records */
+    u32 saved_msec;             /* monotonic time of writing, low bits */
+    u8 boot_id[40];             /* snapshot is dropped after reboot */
+} scan_snapshot_hdr_t;
+
+typedef struct {
+    u32 rec_len;                /* including this header and padding */
+    u32 age;                    /* msec since item was seen, at writing */
+    s32 level_avg;
+    u32 count;
+} scan_snapshot_rec_t;
+#endif
+
+#ifdef CONFIG_SCAN_MERGE_CAPTURE
+/* Capture file layout, host byte order: header, then for every merged scan
+   scan_capture_scan_t followed by count results. Each result is
+   scan_capture_res_t followed by ie_len octets of IEs, padded to 8 bytes.
+   Results are recorded as the driver passed them in, before merging. */
+typedef struct {
+    u32 magic;
+    u16 version;
+    u16 res_size;               /* sizeof(scan_capture_res_t) of the writer */
+} scan_capture_hdr_t;
+
+typedef struct {
+    u32 msec;                   /* since capture start */
+    s32 scan_type;
+    u32 count;
+    u32 force_flag;
+} scan_capture_scan_t;
+
+typedef struct {
+    u8 bssid[ETH_ALEN];
+    u16 caps;
+    s32 freq;
+    u16 beacon_int;
+    u16 reserved;
+    s32 qual;
+    s32 noise;
+    s32 level;
+    u32 ie_len;
+    u64 tsf;
+} scan_capture_res_t;
+#endif
+
+/* Heap accounting of the merge code, including SHLIST node pool refills */
+typedef struct {
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long list_calls;
+    unsigned long last_merge;   /* heap calls made by last scan_merge() */
+} scan_alloc_stats_t;
+
+void scan_init( struct wpa_driver_ti_data *mydrv, const char *ifname );
 void scan_exit( struct wpa_driver_ti_data *mydrv );
 unsigned long scan_count( struct wpa_driver_ti_data *mydrv );
 scan_ssid_t *scan_get_ssid( scan_result_t *res_ptr );
+int scan_get_ssid_view( scan_result_t *res_ptr, scan_ssid_view_t *view );
 #ifdef WPA_SUPPLICANT_VER_0_6_X
 unsigned int scan_merge( struct wpa_driver_ti_data *mydrv,
                          scan_result_t **results, int force_flag,
@@ -54,5 +381,46 @@ unsigned int scan_merge( struct wpa_driver_ti_data *mydrv,
                          scan_result_t *results, int force_flag,
                          unsigned int number_items, unsigned int max_size );
 #endif
+#ifdef WPA_SUPPLICANT_VER_0_6_X
+int scan_merge_delta( struct wpa_driver_ti_data *mydrv,
+                      scan_result_t **results, unsigned int number_items,
+                      scan_delta_t *delta );
+#else
+int scan_merge_delta( struct wpa_driver_ti_data *mydrv,
+                      scan_result_t *results, unsigned int number_items,
+                      scan_delta_t *delta );
+#endif
 scan_result_t *scan_get_by_bssid( struct wpa_driver_ti_data *mydrv, u8 *bssid );
+unsigned int scan_get_ess( struct wpa_driver_ti_data *mydrv,
+                           const u8 *ssid, size_t ssid_len,
+                           scan_result_t **results, unsigned int max_results );
+void scan_res_hold( scan_result_t *res_ptr );
+void scan_res_release( scan_result_t *res_ptr );
+void scan_get_alloc_stats( scan_alloc_stats_t *stats );
+void scan_set_ttl( struct wpa_driver_ti_data *mydrv, int scan_type,
+                   unsigned long ttl );
+void scan_set_smoothing( struct wpa_driver_ti_data *mydrv,
+                         unsigned int level_shift );
+void scan_set_limits( struct wpa_driver_ti_data *mydrv,
+                      unsigned int max_entries, size_t max_bytes,
+                      int evict_policy );
+int scan_set_scan_freqs( struct wpa_driver_ti_data *mydrv,
+                         const int *freqs, unsigned int num_freqs );
+int scan_set_ranking( struct wpa_driver_ti_data *mydrv,
+                      const scan_rank_t *rank );
+int scan_get_mem_stats( struct wpa_driver_ti_data *mydrv,
+                        scan_mem_stats_t *stats );
+int scan_print_mem_stats( struct wpa_driver_ti_data *mydrv,
+                          char *buf, size_t buf_len );
+#ifdef CONFIG_SCAN_MERGE_CAPTURE
+int scan_capture_start( struct wpa_driver_ti_data *mydrv, const char *path );
+void scan_capture_stop( struct wpa_driver_ti_data *mydrv );
+#endif
+#ifdef CONFIG_SCAN_MERGE_SHM
+int scan_shm_start( struct wpa_driver_ti_data *mydrv, const char *path );
+void scan_shm_stop( struct wpa_driver_ti_data *mydrv );
+int scan_shm_read( const char *path, u8 *buf, size_t buf_len );
+const scan_shm_res_t *scan_shm_next( const u8 *buf, size_t len,
+                                     const scan_shm_res_t *prev );
+#endif
 #endif
@@ -7,6 +7,97 @@
 #include <stdlib.h>
 #include "shlist.h"
 /*-------------------------------------------------------------------*/
+/* Nodes are carved from fixed-size chunks and recycled through a     */
+/* free list, so list insert/delete does not hit the heap each time.  */
+/* Like the rest of the list code this is not thread safe.            */
+#define SH_LIST_POOL_CHUNK  32
+
+typedef struct SHLIST_CHUNK_STRUC {
+  struct SHLIST_CHUNK_STRUC *next;
+  SHLIST nodes[SH_LIST_POOL_CHUNK];
+} SHLIST_CHUNK;
+
+static SHLIST_CHUNK *shListChunks = NULL;
+static SHLIST *shListFreeNodes = NULL;
+static unsigned long shListUsedNodes = 0;
+static unsigned long shListHeapCalls = 0;
+
+static SHLIST *shListNodeAlloc( void )
+{
+  SHLIST_CHUNK *chunk;
+  SHLIST *item;
+  int i;
+
+  if( shListFreeNodes == NULL ) {
+    chunk = (SHLIST_CHUNK *)malloc( sizeof(SHLIST_CHUNK) );
+    shListHeapCalls++;
+    if( chunk == NULL )
+      return( NULL );
+    chunk->next = shListChunks;
+    shListChunks = chunk;
+    for(i=0;( i < SH_LIST_POOL_CHUNK );i++) {
+      chunk->nodes[i].next = shListFreeNodes;
+      shListFreeNodes = &(chunk->nodes[i]);
+    }
+  }
+  item = shListFreeNodes;
+  shListFreeNodes = item->next;
+  shListUsedNodes++;
+  return( item );
+}
+
+#ifdef SH_LIST_DEBUG
+static int shListNodeOwned( SHLIST *item )
+{ /* 1 if node was carved from the pool, 0 if it is caller-owned */
+  SHLIST_CHUNK *chunk;
+
+  for(chunk=shListChunks;( chunk != NULL );chunk=chunk->next)
+    if( (item >= chunk->nodes) && (item < chunk->nodes + SH_LIST_POOL_CHUNK) )
+      return( 1 );
+  return( 0 );
+}
+
+static void shListNodeCheck( SHLIST *item, int owned, const char *func )
+{
+  if( shListNodeOwned( item ) == owned )
+    return;
+  fprintf(stderr, "%s: %s node %lx\n", func,
+          owned ? "caller-owned" : "pool", (unsigned long)item);
+  abort();
+}
+#endif
+
+static void shListNodeFree( SHLIST *item )
+{
+#ifdef SH_LIST_DEBUG
+  shListNodeCheck( item, 1, "shListDelItem" );
+#endif
+  item->data = (void *)0L;
+  item->next = shListFreeNodes;
+  shListFreeNodes = item;
+  shListUsedNodes--;
+}
+
+void shListPoolFlush( void )
+{ /* Give chunks back to the heap once no node is in use */
+  SHLIST_CHUNK *chunk;
+
+  if( shListUsedNodes != 0 )
+    return;
+  while( shListChunks != NULL ) {
+    chunk = shListChunks;
+    shListChunks = chunk->next;
+    free( chunk );
+    shListHeapCalls++;
+  }
+  shListFreeNodes = NULL;
+}
+
+unsigned long shListGetHeapCalls( void )
+{
+  return( shListHeapCalls );
+}
+/*-------------------------------------------------------------------*/
 void shListInitList( SHLIST *listPtr )
 {
   listPtr->data = (void *)0L;
@@ -87,7 +178,7 @@ void shListDelItem( SHLIST *head, SHLIST *item, shListFree func )
   if( func && item->data ) {
     func( (void *)(item->data) );
   }
-  free( item );
+  shListNodeFree( item );
   head->data = (void *)((unsigned long)(head->data) - 1);
 }
 
@@ -95,7 +186,7 @@ void shListInsFirstItem( SHLIST *head, void *val )
 { /* Insert to the beginning of the list */
   SHLIST *item;
 
-  item = (SHLIST *)malloc( sizeof(SHLIST) );
+  item = shListNodeAlloc();
   if( item == NULL )
     return;
   item->data = val;
@@ -113,7 +204,7 @@ void shListInsLastItem( SHLIST *head, void *val )
 { /* Insert to the end of the list */
   SHLIST *item;
 
-  item = (SHLIST *)malloc( sizeof(SHLIST) );
+  item = shListNodeAlloc();
   if( item == NULL )
     return;
   item->data = val;
@@ -135,7 +226,7 @@ void shListInsBeforeItem( SHLIST *head, void *val, void *etal,
   if( func == NULL )
     shListInsFirstItem( head, val );
   else {
-    item = (SHLIST *)malloc( sizeof(SHLIST) );
+    item = shListNodeAlloc();
     if( item == NULL )
       return;
     item->data = val;
@@ -153,6 +244,43 @@ void shListInsBeforeItem( SHLIST *head, void *val, void *etal,
   }
 }
 
+void shListInsLastNode( SHLIST *head, SHLIST *node, void *val )
+{ /* Insert caller-owned node to the end of the list */
+  node->data = val;
+  node->next = head;
+  node->prev = head->prev;
+  (head->prev)->next = node;
+  head->prev = node;
+#ifdef SH_LIST_DEBUG
+  fprintf(stderr, "Ins Last Node %lx\n", (unsigned long)(node->data));
+#endif
+  head->data = (void *)((unsigned long)(head->data) + 1);
+}
+
+void shListUnlinkNode( SHLIST *head, SHLIST *node )
+{ /* Remove caller-owned node; its memory stays with the owner */
+  if( node == NULL )
+    return;
+#ifdef SH_LIST_DEBUG
+  fprintf(stderr, "Unlink %lx\n", (unsigned long)(node->data));
+  shListNodeCheck( node, 0, "shListUnlinkNode" );
+#endif
+  (node->prev)->next = node->next;
+  (node->next)->prev = node->prev;
+  node->next = node->prev = node;
+  head->data = (void *)((unsigned long)(head->data) - 1);
+}
+
+void shListReplaceNode( SHLIST *node, SHLIST *newnode, void *val )
+{ /* Put caller-owned node in place of another one */
+  newnode->data = val;
+  newnode->next = node->next;
+  newnode->prev = node->prev;
+  (node->prev)->next = newnode;
+  (node->next)->prev = newnode;
+  node->next = node->prev = node;
+}
+
 void shListDelAllItems( SHLIST *head, shListFree func )
 {
   SHLIST *item;
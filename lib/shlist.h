@@ -30,5 +30,15 @@ void shListInsLastItem( SHLIST *head, void *val );
 void shListDelAllItems( SHLIST *head, shListFree func );
 void shListPrintAllItems( SHLIST *head, shListPrint func );
 unsigned long shListGetCount( SHLIST *head );
+/* Intrusive variant: the node is embedded in the owning structure, so no  */
+/* allocation takes place. A list of such nodes must only use the *Node    */
+/* calls: shListDelItem/shListDelAllItems would put the embedded node in   */
+/* the node pool free list. SH_LIST_DEBUG builds abort on such a mix-up.   */
+void shListInsLastNode( SHLIST *head, SHLIST *node, void *val );
+void shListUnlinkNode( SHLIST *head, SHLIST *node );
+void shListReplaceNode( SHLIST *node, SHLIST *newnode, void *val );
+/* Node pool used by the allocating functions above */
+void shListPoolFlush( void );
+unsigned long shListGetHeapCalls( void );
 
 #endif
@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
 #include <stdbool.h>
 
 #include <netlink/genl/genl.h>
@@ -54,6 +55,9 @@ static inline int __genl_ctrl_alloc_cache(struct nl_sock *h,
 
 int calibrator_debug;
 
+/* Longest wait for a reply, calibrations like TX BIP take a few seconds */
+#define NL_REPLY_TIMEOUT_MS 20000
+
 static int nl80211_init(struct nl80211_state *state)
 {
     int err;
@@ -459,8 +463,20 @@ static int __handle_cmd(struct nl80211_state *state, enum id_input idby,
     nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &err);
     nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &err);
 
-    while (err > 0)
+    while (err > 0) {
+        struct pollfd pfd;
+
+        /* A wedged firmware must not hang the tool */
+        pfd.fd = nl_socket_get_fd(state->nl_sock);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, NL_REPLY_TIMEOUT_MS) <= 0) {
+            fprintf(stderr, "no reply from driver\n");
+            err = -ETIMEDOUT;
+            break;
+        }
         nl_recvmsgs(state->nl_sock, cb);
+    }
 
  out:
     nl_cb_put(cb);
@@ -24,6 +24,7 @@
 #include <net/if.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <cutils/properties.h>
@@ -48,6 +49,10 @@
 #include "config_ssid.h"
 #include "wpa_debug.h"
 
+#ifndef WPA_EVENT_SIGNAL_CHANGE
+#define WPA_EVENT_SIGNAL_CHANGE "CTRL-EVENT-SIGNAL-CHANGE "
+#endif
+
 
 static int wpa_driver_wext_flush_pmkid(void *priv);
 static int wpa_driver_wext_get_range(void *priv);
@@ -55,6 +60,152 @@ static void wpa_driver_wext_finish_drv_init(struct wpa_driver_wext_data *drv);
 static void wpa_driver_wext_disconnect(struct wpa_driver_wext_data *drv);
 
 
+/* SIOCGIWSCAN fetch statistics, see "SCAN-STATS" */
+struct wext_scan_stats {
+    unsigned long fetches;
+    unsigned long retries;          /* E2BIG retries, all fetches */
+    unsigned long bytes;            /* scan data copied, all fetches */
+    unsigned int last_retries;
+    unsigned int last_bytes;
+    unsigned int max_retries;
+};
+
+#define WEXT_SCAN_MAX_SSIDS     4
+#define WEXT_SCAN_MAX_FREQS     16
+#define WEXT_ESS_FREQS          3
+#define WEXT_ESS_MAX_AGE_MS     60000
+
+/* Targeted scan request, see wpa_driver_wext_scan_params() */
+struct wext_scan_params {
+    struct {
+        const u8 *ssid;
+        size_t ssid_len;
+    } ssids[WEXT_SCAN_MAX_SSIDS];
+    size_t num_ssids;               /* 0 - broadcast */
+    const int *freqs;               /* MHz, 0 terminated, NULL - all */
+};
+
+/* Strongest channels the last associated ESS was seen on */
+struct wext_ess_seen {
+    u8 ssid[MAX_SSID_LEN];
+    int ssid_len;                   /* 0 - none yet */
+    int freqs[WEXT_ESS_FREQS + 1];  /* 0 terminated */
+    struct os_time seen;
+};
+
+struct wpa_driver_custom_data;
+
+/* Completion of an nl80211 request, err is 0 or negative */
+typedef void (*wext_nl_done_fn)(struct wpa_driver_custom_data *cdrv, int err,
+                void *arg);
+
+/* nl80211 request waiting for its reply, see wext_nl_request() */
+struct wext_nl_req {
+    u32 seq;                        /* 0 - slot free */
+    struct os_time deadline;
+    int (*valid)(struct nl_msg *msg, void *arg);    /* reply messages */
+    void *valid_arg;
+    wext_nl_done_fn done;
+    void *arg;
+};
+
+#define WEXT_NL_MAX_PENDING     4
+#define WEXT_NL_TIMEOUT_MS      2000
+
+/* nl80211 context of an interface, see wext_nl_init() */
+struct wext_nl_ctx {
+    struct nl_handle *sock;         /* NULL - not set up */
+    struct nl_cb *cb;
+    struct nl_msg *msg;             /* reused for every request */
+    int family;                     /* nl80211 family id */
+    struct wext_nl_req req[WEXT_NL_MAX_PENDING];
+    int hanged;                     /* HANGED reported for a timeout */
+    int mlme_group;                 /* multicast id, 0 - not joined */
+};
+
+#define WEXT_LINK_MAX_AGE_MS    2000
+
+#define WEXT_LINK_RSSI          0x01
+#define WEXT_LINK_RATE          0x02
+
+/*
+ * Link quality answered to RSSI and LINKSPEED, see wext_link_get(). Reset by
+ * wext_link_invalidate() when the association changes.
+ */
+struct wext_link_cache {
+    u8 bssid[ETH_ALEN];             /* AP of cached values, zero - none */
+    int rssi;                       /* dBm, -1 - unknown */
+    int linkspeed;                  /* Mbps, -1 - unknown */
+    u8 ssid[MAX_SSID_LEN + 1];
+    int ssid_len;                   /* 0 - unknown, asked once per AP */
+    struct os_time rssi_updated;
+    struct os_time rate_updated;
+    unsigned int max_age_ms;        /* staleness bound, LINK-MAXAGE */
+    int cqm_thold;                  /* dBm, 0 - no CQM, RSSI-MONITOR */
+    unsigned int cqm_hyst;
+};
+
+/*
+ * Per-interface state of this driver. wpa_driver_wext_data belongs to the
+ * supplicant's driver_wext.c, so the state is attached to it by
+ * wpa_driver_custom_init() and looked up with wpa_driver_custom_get().
+ */
+struct wpa_driver_custom_data {
+    struct wpa_driver_custom_data *next;
+    struct wpa_driver_wext_data *drv;
+    u8 *scan_buf;                   /* SIOCGIWSCAN buffer, kept across scans */
+    size_t scan_buf_len;
+    size_t scan_len_hint;           /* decaying max of fetched sizes */
+    u8 *scan_arena;                 /* IE arena of scan result parsing */
+    size_t scan_arena_len;
+    struct wext_scan_stats scan_stats;
+    struct wext_nl_ctx nl;
+    struct wext_link_cache link;
+    int power_mode;                 /* last POWERMODE, starts with "auto" */
+    u8 scan_type;                   /* IW_SCAN_TYPE_*, SCAN-ACTIVE/PASSIVE */
+    int scan_freqs[WEXT_SCAN_MAX_FREQS + 1];    /* next scan, SCAN-FREQS */
+    int scan_ess;                   /* next scan probes the ESS too */
+    struct wext_ess_seen ess;
+};
+
+static struct wpa_driver_custom_data *wpa_driver_custom_list = NULL;
+
+
+static struct wpa_driver_custom_data *
+wpa_driver_custom_get(struct wpa_driver_wext_data *drv)
+{
+    struct wpa_driver_custom_data *cdrv;
+
+    for (cdrv = wpa_driver_custom_list; cdrv; cdrv = cdrv->next) {
+        if (cdrv->drv == drv) {
+            return cdrv;
+        }
+    }
+    return NULL;
+}
+
+
+/* Drops cached link quality on disassociation (bssid NULL) or a new AP */
+static void wext_link_invalidate(struct wpa_driver_custom_data *cdrv,
+                 const u8 *bssid)
+{
+    struct wext_link_cache *link = &cdrv->link;
+
+    if (bssid && os_memcmp(link->bssid, bssid, ETH_ALEN) == 0) {
+        return;
+    }
+    if (bssid) {
+        os_memcpy(link->bssid, bssid, ETH_ALEN);
+    } else {
+        os_memset(link->bssid, 0, ETH_ALEN);
+    }
+    link->rssi = -1;
+    link->linkspeed = -1;
+    link->ssid_len = 0;
+    link->ssid[0] = '\0';
+}
+
+
 static int wpa_driver_wext_send_oper_ifla(struct wpa_driver_wext_data *drv,
                       int linkmode, int operstate)
 {
@@ -324,6 +475,7 @@ static void wpa_driver_wext_event_assoc_ies(struct wpa_driver_wext_data *drv)
 static void wpa_driver_wext_event_wireless(struct wpa_driver_wext_data *drv,
                        void *ctx, char *data, int len)
 {
+    struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
     struct iw_event iwe_buf, *iwe = &iwe_buf;
     char *pos, *end, *custom, *buf;
 
@@ -367,6 +519,9 @@ static void wpa_driver_wext_event_wireless(struct wpa_driver_wext_data *drv,
                 os_memcmp(iwe->u.ap_addr.sa_data,
                       "\x44\x44\x44\x44\x44\x44", ETH_ALEN) ==
                 0) {
+                if (cdrv) {
+                    wext_link_invalidate(cdrv, NULL);
+                }
                 os_free(drv->assoc_req_ies);
                 drv->assoc_req_ies = NULL;
                 os_free(drv->assoc_resp_ies);
@@ -383,6 +538,10 @@ static void wpa_driver_wext_event_wireless(struct wpa_driver_wext_data *drv,
 #endif
 
             } else {
+                if (cdrv) {
+                    wext_link_invalidate(cdrv,
+                        (const u8 *) iwe->u.ap_addr.sa_data);
+                }
 #ifdef ANDROID
                 drv->skip_disconnect = 0;
 #endif
@@ -814,16 +973,81 @@ static void wpa_driver_wext_set_scan_timeout(void *priv)
 }
 
 
+/* Initial size of the scan result array: one slot per this many bytes of
+ * SIOCGIWSCAN data plus a minimum, doubled when full */
+#define WEXT_SCAN_BSS_BYTES     256
+#define WEXT_SCAN_RES_MIN       16
+
+/* SIOCGIWSCAN buffer sizing: a fetch starts from the size hint plus 1/8
+ * slack. The hint follows larger fetches at once and decays towards
+ * smaller ones by 1/8 of the difference per fetch; the kept buffer is
+ * shrunk when it gets twice as large as needed. */
+#define WEXT_SCAN_BUF_MAX       65535   /* 16-bit length field */
+#define WEXT_SCAN_HINT_DECAY    3       /* shift */
+#define WEXT_SCAN_SLACK         3       /* shift */
+
+
+static size_t wext_scan_buf_start(struct wpa_driver_custom_data *cdrv)
+{
+    size_t len = cdrv->scan_len_hint;
+
+    len += len >> WEXT_SCAN_SLACK;
+    if (len < IW_SCAN_MAX_DATA) {
+        len = IW_SCAN_MAX_DATA;
+    }
+    if (len > WEXT_SCAN_BUF_MAX) {
+        len = WEXT_SCAN_BUF_MAX;
+    }
+    return len;
+}
+
+
+static void wext_scan_len_update(struct wpa_driver_custom_data *cdrv,
+                 size_t len)
+{
+    if (len >= cdrv->scan_len_hint) {
+        cdrv->scan_len_hint = len;
+    } else {
+        cdrv->scan_len_hint -= (cdrv->scan_len_hint - len) >>
+            WEXT_SCAN_HINT_DECAY;
+    }
+}
+
+
+static u8 * wext_scan_buf_get(struct wpa_driver_custom_data *cdrv,
+                  size_t len)
+{
+    if (cdrv->scan_buf_len < len || cdrv->scan_buf_len > 2 * len) {
+        /* Contents are not kept, so no realloc */
+        os_free(cdrv->scan_buf);
+        cdrv->scan_buf = os_malloc(len);
+        cdrv->scan_buf_len = cdrv->scan_buf ? len : 0;
+    }
+    return cdrv->scan_buf;
+}
+
+
+/*
+ * Returns the SIOCGIWSCAN data in the buffer kept by the interface; it stays
+ * valid until the next fetch and must not be freed.
+ */
 static u8 * wpa_driver_wext_giwscan(struct wpa_driver_wext_data *drv,
                     size_t *len)
 {
+    struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+    struct wext_scan_stats *stats;
     struct iwreq iwr;
     u8 *res_buf;
     size_t res_buf_len;
+    unsigned int retries = 0;
 
-    res_buf_len = IW_SCAN_MAX_DATA;
+    if (cdrv == NULL) {
+        return NULL;
+    }
+    stats = &cdrv->scan_stats;
+    res_buf_len = wext_scan_buf_start(cdrv);
     for (;;) {
-        res_buf = os_malloc(res_buf_len);
+        res_buf = wext_scan_buf_get(cdrv, res_buf_len);
         if (res_buf == NULL) {
             return NULL;
         }
@@ -836,29 +1060,41 @@ static u8 * wpa_driver_wext_giwscan(struct wpa_driver_wext_data *drv,
             break;
         }
 
-        if (errno == E2BIG && res_buf_len < 65535) {
-            os_free(res_buf);
-            res_buf = NULL;
-            res_buf_len *= 2;
-            if (res_buf_len > 65535) {
-                res_buf_len = 65535; /* 16-bit length field */
+        if (errno == E2BIG && res_buf_len < WEXT_SCAN_BUF_MAX) {
+            retries++;
+            /* Some drivers report the needed size */
+            if (iwr.u.data.length > res_buf_len) {
+                res_buf_len = iwr.u.data.length;
+            } else {
+                res_buf_len *= 2;
+            }
+            if (res_buf_len > WEXT_SCAN_BUF_MAX) {
+                res_buf_len = WEXT_SCAN_BUF_MAX;
             }
             wpa_printf(MSG_DEBUG, "Scan results did not fit - "
                    "trying larger buffer (%lu bytes)",
                    (unsigned long) res_buf_len);
         } else {
             wpa_printf(MSG_ERROR, "ioctl[SIOCGIWSCAN]: %d", errno);
-            os_free(res_buf);
             return NULL;
         }
     }
 
     if (iwr.u.data.length > res_buf_len) {
-        os_free(res_buf);
         return NULL;
     }
     *len = iwr.u.data.length;
 
+    wext_scan_len_update(cdrv, *len);
+    stats->fetches++;
+    stats->retries += retries;
+    stats->bytes += *len;
+    stats->last_retries = retries;
+    stats->last_bytes = *len;
+    if (retries > stats->max_retries) {
+        stats->max_retries = retries;
+    }
+
     return res_buf;
 }
 
@@ -866,11 +1102,15 @@ static u8 * wpa_driver_wext_giwscan(struct wpa_driver_wext_data *drv,
 /*
  * Data structure for collecting WEXT scan results. This is needed to allow
  * the various methods of reporting IEs to be combined into a single IE buffer.
+ * The IE buffer is one arena as large as the SIOCGIWSCAN data: IEs of one
+ * BSS are either copied from it or hex-decoded to half their size, so they
+ * always fit and the arena is reused for every BSS.
  */
 struct wext_scan_data {
     struct wpa_scan_res res;
     u8 *ie;
     size_t ie_len;
+    size_t ie_size;     /* arena size, never exceeded by one BSS */
     u8 ssid[32];
     size_t ssid_len;
     int maxrate;
@@ -1002,7 +1242,6 @@ static void wext_get_scan_iwevgenie(struct iw_event *iwe,
                     char *end)
 {
     char *genie, *gpos, *gend;
-    u8 *tmp;
 
     if (iwe->u.data.length == 0) {
         return;
@@ -1015,12 +1254,10 @@ static void wext_get_scan_iwevgenie(struct iw_event *iwe,
         return;
     }
 
-    tmp = os_realloc(res->ie, res->ie_len + gend - gpos);
-    if (tmp == NULL) {
+    if (res->ie_len + (gend - gpos) > res->ie_size) {
         return;
     }
-    os_memcpy(tmp + res->ie_len, gpos, gend - gpos);
-    res->ie = tmp;
+    os_memcpy(res->ie + res->ie_len, gpos, gend - gpos);
     res->ie_len += gend - gpos;
 }
 
@@ -1030,7 +1267,6 @@ static void wext_get_scan_custom(struct iw_event *iwe,
                  char *end)
 {
     size_t clen;
-    u8 *tmp;
 
     clen = iwe->u.data.length;
     if (custom + clen > end) {
@@ -1046,12 +1282,10 @@ static void wext_get_scan_custom(struct iw_event *iwe,
             return;
         }
         bytes /= 2;
-        tmp = os_realloc(res->ie, res->ie_len + bytes);
-        if (tmp == NULL) {
+        if (res->ie_len + bytes > res->ie_size) {
             return;
         }
-        hexstr2bin(spos, tmp + res->ie_len, bytes);
-        res->ie = tmp;
+        hexstr2bin(spos, res->ie + res->ie_len, bytes);
         res->ie_len += bytes;
     } else if (clen > 7 && os_strncmp(custom, "rsn_ie=", 7) == 0) {
         char *spos;
@@ -1062,12 +1296,10 @@ static void wext_get_scan_custom(struct iw_event *iwe,
             return;
         }
         bytes /= 2;
-        tmp = os_realloc(res->ie, res->ie_len + bytes);
-        if (tmp == NULL) {
+        if (res->ie_len + bytes > res->ie_size) {
             return;
         }
-        hexstr2bin(spos, tmp + res->ie_len, bytes);
-        res->ie = tmp;
+        hexstr2bin(spos, res->ie + res->ie_len, bytes);
         res->ie_len += bytes;
     } else if (clen > 4 && os_strncmp(custom, "tsf=", 4) == 0) {
         char *spos;
@@ -1095,11 +1327,12 @@ static int wext_19_iw_point(struct wpa_driver_wext_data *drv, u16 cmd)
 
 
 static void wpa_driver_wext_add_scan_entry(struct wpa_scan_results *res,
+                       size_t *res_size,
                        struct wext_scan_data *data)
 {
     struct wpa_scan_res **tmp;
     struct wpa_scan_res *r;
-    size_t extra_len;
+    size_t extra_len, size;
     u8 *pos, *end, *ssid_ie = NULL, *rate_ie = NULL;
 
     /* Figure out whether we need to fake any IEs */
@@ -1157,14 +1390,218 @@ static void wpa_driver_wext_add_scan_entry(struct wpa_scan_results *res,
         os_memcpy(pos, data->ie, data->ie_len);
     }
 
-    tmp = os_realloc(res->res,
-             (res->num + 1) * sizeof(struct wpa_scan_res *));
-    if (tmp == NULL) {
-        os_free(r);
+    if (res->num == *res_size) {
+        size = *res_size ? *res_size * 2 : WEXT_SCAN_RES_MIN;
+        tmp = os_realloc(res->res, size * sizeof(struct wpa_scan_res *));
+        if (tmp == NULL) {
+            os_free(r);
+            return;
+        }
+        res->res = tmp;
+        *res_size = size;
+    }
+    res->res[res->num++] = r;
+}
+
+
+/**
+ * wext_ess_update - Remember where the current ESS was seen
+ * @cdrv: Per-interface state
+ * @res: Scan results just fetched
+ *
+ * Keeps the channels of the up to WEXT_ESS_FREQS strongest BSSes of the
+ * ESS we are, or were last, associated with, for "SCAN-FREQS LAST".
+ */
+static void wext_ess_update(struct wpa_driver_custom_data *cdrv,
+                struct wpa_scan_results *res)
+{
+    struct wext_ess_seen *ess = &cdrv->ess;
+    int level[WEXT_ESS_FREQS];
+    u8 ssid[MAX_SSID_LEN];
+    const u8 *ie;
+    struct wpa_scan_res *r;
+    size_t i;
+    int len, n = 0, j, k;
+
+    len = wpa_driver_wext_get_ssid(cdrv->drv, ssid);
+    if (len > 0 && len <= MAX_SSID_LEN &&
+        (len != ess->ssid_len || os_memcmp(ssid, ess->ssid, len) != 0)) {
+        os_memcpy(ess->ssid, ssid, len);
+        ess->ssid_len = len;
+        ess->freqs[0] = 0;
+    }
+    if (ess->ssid_len == 0) {
         return;
     }
-    tmp[res->num++] = r;
-    res->res = tmp;
+
+    for (i = 0; i < res->num; i++) {
+        r = res->res[i];
+        ie = wpa_scan_get_ie(r, WLAN_EID_SSID);
+        if (ie == NULL || ie[1] != ess->ssid_len || r->freq == 0 ||
+            os_memcmp(ie + 2, ess->ssid, ess->ssid_len) != 0) {
+            continue;
+        }
+        for (j = 0; j < n && ess->freqs[j] != r->freq; j++)
+            ;
+        if (j < n) {
+            /* Same channel, keep its strongest BSS */
+            if (r->level > level[j]) {
+                level[j] = r->level;
+            }
+            continue;
+        }
+        /* Insert by level, dropping the weakest when full */
+        for (j = 0; j < n && level[j] >= r->level; j++)
+            ;
+        if (j == WEXT_ESS_FREQS) {
+            continue;
+        }
+        if (n < WEXT_ESS_FREQS) {
+            n++;
+        }
+        for (k = n - 1; k > j; k--) {
+            ess->freqs[k] = ess->freqs[k - 1];
+            level[k] = level[k - 1];
+        }
+        ess->freqs[j] = r->freq;
+        level[j] = r->level;
+    }
+    if (n > 0) {
+        ess->freqs[n] = 0;
+        os_get_time(&ess->seen);
+    }
+}
+
+
+/**
+ * wpa_driver_wext_get_scan_results_custom - Fetch the latest scan results
+ * @priv: Pointer to private wext data from wpa_driver_wext_init()
+ * Returns: Scan results on success, %NULL on failure
+ *
+ * Parses the SIOCGIWSCAN buffer in one pass. IEs are collected in a single
+ * arena kept by the interface and the result array grows geometrically from
+ * an estimate based on the buffer size, so apart from one allocation per
+ * BSS (the entries are freed one by one by wpa_scan_results_free()) the
+ * number of allocations does not depend on the number of BSSes.
+ */
+static struct wpa_scan_results *
+wpa_driver_wext_get_scan_results_custom(void *priv)
+{
+    struct wpa_driver_wext_data *drv = priv;
+    struct wpa_driver_custom_data *cdrv;
+    size_t len, res_size;
+    int first;
+    u8 *res_buf;
+    struct iw_event iwe_buf, *iwe = &iwe_buf;
+    char *pos, *end, *custom;
+    struct wpa_scan_results *res;
+    struct wext_scan_data data;
+    u8 *arena;
+
+    res_buf = wpa_driver_wext_giwscan(drv, &len);
+    if (res_buf == NULL) {
+        return NULL;
+    }
+    cdrv = wpa_driver_custom_get(drv);
+
+    /* The arena is kept with the scan buffer and sized the same way */
+    if (cdrv->scan_arena_len < len ||
+        cdrv->scan_arena_len > 2 * cdrv->scan_buf_len) {
+        os_free(cdrv->scan_arena);
+        cdrv->scan_arena = os_malloc(cdrv->scan_buf_len);
+        cdrv->scan_arena_len = cdrv->scan_arena ? cdrv->scan_buf_len : 0;
+    }
+    arena = cdrv->scan_arena;
+
+    res = os_zalloc(sizeof(*res));
+    res_size = len / WEXT_SCAN_BSS_BYTES + WEXT_SCAN_RES_MIN;
+    if (res) {
+        res->res = os_malloc(res_size * sizeof(struct wpa_scan_res *));
+    }
+    if (res == NULL || arena == NULL || res->res == NULL) {
+        if (res) {
+            os_free(res->res);
+        }
+        os_free(res);
+        return NULL;
+    }
+
+    first = 1;
+    pos = (char *) res_buf;
+    end = (char *) res_buf + len;
+    os_memset(&data, 0, sizeof(data));
+    data.ie = arena;
+    data.ie_size = len;
+
+    while (pos + IW_EV_LCP_LEN <= end) {
+        /* Event data may be unaligned, so make a local, aligned copy
+         * before processing. */
+        os_memcpy(&iwe_buf, pos, IW_EV_LCP_LEN);
+        if (iwe->len <= IW_EV_LCP_LEN) {
+            break;
+        }
+
+        custom = pos + IW_EV_POINT_LEN;
+        if (wext_19_iw_point(drv, iwe->cmd)) {
+            /* WE-19 removed the pointer from struct iw_point */
+            char *dpos = (char *) &iwe_buf.u.data.length;
+            int dlen = dpos - (char *) &iwe_buf;
+            os_memcpy(dpos, pos + IW_EV_LCP_LEN,
+                  sizeof(struct iw_event) - dlen);
+        } else {
+            os_memcpy(&iwe_buf, pos, sizeof(struct iw_event));
+            custom += IW_EV_POINT_OFF;
+        }
+
+        switch (iwe->cmd) {
+        case SIOCGIWAP:
+            if (!first) {
+                wpa_driver_wext_add_scan_entry(res, &res_size, &data);
+            }
+            first = 0;
+            os_memset(&data, 0, sizeof(data));
+            data.ie = arena;
+            data.ie_size = len;
+            os_memcpy(data.res.bssid,
+                  iwe->u.ap_addr.sa_data, ETH_ALEN);
+            break;
+        case SIOCGIWMODE:
+            wext_get_scan_mode(iwe, &data);
+            break;
+        case SIOCGIWESSID:
+            wext_get_scan_ssid(iwe, &data, custom, end);
+            break;
+        case SIOCGIWFREQ:
+            wext_get_scan_freq(iwe, &data);
+            break;
+        case IWEVQUAL:
+            wext_get_scan_qual(iwe, &data);
+            break;
+        case SIOCGIWENCODE:
+            wext_get_scan_encode(iwe, &data);
+            break;
+        case SIOCGIWRATE:
+            wext_get_scan_rate(iwe, &data, pos, end);
+            break;
+        case IWEVGENIE:
+            wext_get_scan_iwevgenie(iwe, &data, custom, end);
+            break;
+        case IWEVCUSTOM:
+            wext_get_scan_custom(iwe, &data, custom, end);
+            break;
+        }
+
+        pos += iwe->len;
+    }
+    if (!first) {
+        wpa_driver_wext_add_scan_entry(res, &res_size, &data);
+    }
+    wext_ess_update(cdrv, res);
+
+    wpa_printf(MSG_DEBUG, "Received %lu bytes of scan results (%lu BSSes)",
+           (unsigned long) len, (unsigned long) res->num);
+
+    return res;
 }
 
 
@@ -1732,217 +2169,737 @@ static char *wpa_driver_get_country_code(int channels)
     return country;
 }
 
-/* global NL structures */
-struct nl_handle *nl_sock;
-struct nl_cache *nl_cache;
-struct genl_family *nl80211;
-
-static int wpa_driver_init_nl() {
-    int err;
+static struct wext_nl_req *wext_nl_req_find(struct wext_nl_ctx *nl, u32 seq)
+{
+    int i;
 
-    nl_sock = nl_socket_alloc();
-    if (!nl_sock) {
-        wpa_printf(MSG_DEBUG,"Failed to allocate netlink socket.");
-        return -ENOMEM;
+    for (i = 0; i < WEXT_NL_MAX_PENDING; i++) {
+        if (nl->req[i].seq && nl->req[i].seq == seq) {
+            return &nl->req[i];
+        }
     }
+    return NULL;
+}
 
-    if (genl_connect(nl_sock)) {
-        wpa_printf(MSG_DEBUG,"Failed to connect to generic netlink.");
-        err = -ENOLINK;
-        goto out_handle_destroy;
-    }
+static void wext_nl_schedule(struct wpa_driver_custom_data *cdrv);
+static void wext_nl_timeout(void *eloop_ctx, void *timeout_ctx);
 
-    genl_ctrl_alloc_cache(nl_sock, &nl_cache);
-    if (!nl_cache) {
-        wpa_printf(MSG_DEBUG,"Failed to allocate generic netlink cache.");
-        err = -ENOMEM;
-        goto out_handle_destroy;
-    }
+/* Completes a request: frees its slot first, so done() may send again */
+static void wext_nl_complete(struct wpa_driver_custom_data *cdrv,
+                 struct wext_nl_req *req, int err)
+{
+    wext_nl_done_fn done = req->done;
+    void *arg = req->arg;
 
-    nl80211 = genl_ctrl_search_by_name(nl_cache, "nl80211");
-    if (!nl80211) {
-        wpa_printf(MSG_DEBUG,"nl80211 not found.");
-        err = -ENOENT;
-        goto out_cache_free;
+    req->seq = 0;
+    if (err != -ETIMEDOUT) {
+        cdrv->nl.hanged = 0;
+    }
+    if (done) {
+        done(cdrv, err, arg);
     }
-
-    return 0;
-
-out_cache_free:
-    nl_cache_free(nl_cache);
-out_handle_destroy:
-    nl_socket_free(nl_sock);
-    return err;
 }
 
-static void wpa_driver_deinit_nl() {
-    genl_family_put(nl80211);
-    nl_cache_free(nl_cache);
-    nl_socket_free(nl_sock);
+static void wext_nl_fail_all(struct wpa_driver_custom_data *cdrv, int err)
+{
+    int i;
+
+    for (i = 0; i < WEXT_NL_MAX_PENDING; i++) {
+        if (cdrv->nl.req[i].seq) {
+            wext_nl_complete(cdrv, &cdrv->nl.req[i], err);
+        }
+    }
 }
 
 static int nl_error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
 {
-    int *ret = (int *)arg;
-    *ret = err->error;
-    return NL_STOP;
-}
+    struct wpa_driver_custom_data *cdrv = arg;
+    struct wext_nl_req *req;
 
-static int nl_finish_handler(struct nl_msg *msg, void *arg)
-{
-     int *ret = (int *)arg;
-     *ret = 0;
-     return NL_SKIP;
+    req = wext_nl_req_find(&cdrv->nl, err->msg.nlmsg_seq);
+    if (req) {
+        wext_nl_complete(cdrv, req, err->error);
+    }
+    return NL_SKIP;
 }
 
 static int nl_ack_handler(struct nl_msg *msg, void *arg)
 {
-    int *ret = (int *)arg;
-    *ret = 0;
-    return NL_STOP;
+    struct wpa_driver_custom_data *cdrv = arg;
+    struct wext_nl_req *req;
+
+    req = wext_nl_req_find(&cdrv->nl, nlmsg_hdr(msg)->nlmsg_seq);
+    if (req) {
+        wext_nl_complete(cdrv, req, 0);
+    }
+    return NL_SKIP;
 }
 
-static int wpa_driver_set_power_save(char *iface, int state)
+static void wext_nl_event(struct wpa_driver_custom_data *cdrv,
+              struct nl_msg *msg);
+
+/* Passes replies to their request and multicast events to wext_nl_event() */
+static int nl_valid_handler(struct nl_msg *msg, void *arg)
 {
-    int ret;
-    struct nl_cb *cb;
-    struct nl_msg *msg;
-    int devidx = 0;
-    int err;
-    enum nl80211_ps_state ps_state;
+    struct wpa_driver_custom_data *cdrv = arg;
+    struct wext_nl_req *req;
+    u32 seq = nlmsg_hdr(msg)->nlmsg_seq;
 
-    ret = wpa_driver_init_nl();
-    if (ret != 0) {
-        return ret;
+    if (seq == 0) {
+        wext_nl_event(cdrv, msg);
+        return NL_SKIP;
+    }
+    req = wext_nl_req_find(&cdrv->nl, seq);
+    if (req && req->valid) {
+        req->valid(msg, req->valid_arg);
     }
+    return NL_SKIP;
+}
 
-    ret = -1;
+/* Replies are matched to requests by sequence number instead */
+static int nl_no_seq_check(struct nl_msg *msg, void *arg)
+{
+    return NL_OK;
+}
 
-        devidx = if_nametoindex(iface);
-        if (devidx == 0) {
-            wpa_printf(MSG_DEBUG,"failed to translate ifname to idx");
-            goto exit;
-        }
+static void wext_nl_deinit(struct wpa_driver_custom_data *cdrv)
+{
+    struct wext_nl_ctx *nl = &cdrv->nl;
 
-    msg = nlmsg_alloc();
-    if (!msg) {
-        wpa_printf(MSG_DEBUG,"failed to allocate netlink message");
-        goto exit;
+    if (nl->sock) {
+        eloop_unregister_read_sock(nl_socket_get_fd(nl->sock));
     }
-
-    cb = nl_cb_alloc(NL_CB_DEFAULT);
-    if (!cb) {
-        wpa_printf(MSG_DEBUG,"failed to allocate netlink callbacks");
-        goto out_free_msg;
+    eloop_cancel_timeout(wext_nl_timeout, cdrv, NULL);
+    if (nl->msg) {
+        nlmsg_free(nl->msg);
     }
-
-    genlmsg_put(msg, 0, 0, genl_family_get_id(nl80211), 0, 0,
-            NL80211_CMD_SET_POWER_SAVE, 0);
-
-    if (state != 0) {
-        ps_state = NL80211_PS_ENABLED;
-    } else {
-        ps_state = NL80211_PS_DISABLED;
+    if (nl->cb) {
+        nl_cb_put(nl->cb);
+    }
+    if (nl->sock) {
+        nl_socket_free(nl->sock);
     }
+    nl->sock = NULL;
+    nl->msg = NULL;
+    nl->cb = NULL;
+    /* Replies of pending requests are lost with the socket */
+    wext_nl_fail_all(cdrv, -ENOLINK);
+}
 
-    NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, devidx);
-    NLA_PUT_U32(msg, NL80211_ATTR_PS_STATE, ps_state);
+/* Services the nl80211 socket of an interface, from eloop or a waiter */
+static void wext_nl_receive(int sock, void *eloop_ctx, void *sock_ctx)
+{
+    struct wpa_driver_custom_data *cdrv = eloop_ctx;
+    int err;
 
-    err = nl_send_auto_complete(nl_sock, msg);
+    err = nl_recvmsgs(cdrv->nl.sock, cdrv->nl.cb);
     if (err < 0) {
-        wpa_printf(MSG_DEBUG, "could not send auto_complete: %d", err);
-        goto out;
+        wpa_printf(MSG_DEBUG, "nl80211 receive error %d, reconnecting", err);
+        wext_nl_deinit(cdrv);
+        return;
     }
-
-    err = 1;
-
-    nl_cb_err(cb, NL_CB_CUSTOM, nl_error_handler, &err);
-    nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, nl_finish_handler, &err);
-    nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, nl_ack_handler, &err);
-
-    while (err > 0)
-        nl_recvmsgs(nl_sock, cb);
-
-    ret = 0;
-out:
-    nl_cb_put(cb);
-out_free_msg:
-    nlmsg_free(msg);
-nla_put_failure:
-
-exit:
-    wpa_driver_deinit_nl();
-    return ret;
+    wext_nl_schedule(cdrv);
 }
 
-static int wpa_driver_set_country(char *iface, char *country)
+/*
+ * Sets up the nl80211 context of an interface on first use: socket, family
+ * id, callbacks and one message, all kept until an error or deinit. The
+ * socket is serviced from eloop.
+ */
+static int wext_nl_init(struct wpa_driver_custom_data *cdrv)
 {
-    int ret;
-    struct nl_cb *cb;
-    struct nl_msg *msg;
-    int devidx = 0;
+    struct wext_nl_ctx *nl = &cdrv->nl;
+    struct nl_cache *cache = NULL;
+    struct genl_family *family;
     int err;
-    char alpha2[3];
-    ret = wpa_driver_init_nl();
-    if (ret != 0) {
-        return ret;
+
+    if (nl->sock) {
+        return 0;
     }
 
-    ret = -1;
+    nl->sock = nl_socket_alloc();
+    if (!nl->sock) {
+        wpa_printf(MSG_DEBUG,"Failed to allocate netlink socket.");
+        return -ENOMEM;
+    }
 
-    devidx = if_nametoindex(iface);
-    if (devidx == 0) {
-        wpa_printf(MSG_DEBUG,"failed to translate ifname to idx");
-        goto exit;
+    if (genl_connect(nl->sock)) {
+        wpa_printf(MSG_DEBUG,"Failed to connect to generic netlink.");
+        err = -ENOLINK;
+        goto fail;
     }
 
-    msg = nlmsg_alloc();
-    if (!msg) {
-        wpa_printf(MSG_DEBUG,"failed to allocate netlink message");
-        goto exit;
+    /* The family id does not change, so the cache is only needed once */
+    genl_ctrl_alloc_cache(nl->sock, &cache);
+    if (!cache) {
+        wpa_printf(MSG_DEBUG,"Failed to allocate generic netlink cache.");
+        err = -ENOMEM;
+        goto fail;
     }
 
-    cb = nl_cb_alloc(NL_CB_DEFAULT);
-    if (!cb) {
-        wpa_printf(MSG_DEBUG,"failed to allocate netlink callbacks");
-        goto out_free_msg;
+    family = genl_ctrl_search_by_name(cache, "nl80211");
+    if (!family) {
+        wpa_printf(MSG_DEBUG,"nl80211 not found.");
+        nl_cache_free(cache);
+        err = -ENOENT;
+        goto fail;
     }
+    nl->family = genl_family_get_id(family);
+    genl_family_put(family);
+    nl_cache_free(cache);
 
-    alpha2[0] = country[0];
+    nl->msg = nlmsg_alloc();
+    if (!nl->msg) {
+        wpa_printf(MSG_DEBUG,"failed to allocate netlink message");
+        err = -ENOMEM;
+        goto fail;
+    }
+
+    nl->cb = nl_cb_alloc(NL_CB_DEFAULT);
+    if (!nl->cb) {
+        wpa_printf(MSG_DEBUG,"failed to allocate netlink callbacks");
+        err = -ENOMEM;
+        goto fail;
+    }
+    nl_cb_err(nl->cb, NL_CB_CUSTOM, nl_error_handler, cdrv);
+    nl_cb_set(nl->cb, NL_CB_ACK, NL_CB_CUSTOM, nl_ack_handler, cdrv);
+    nl_cb_set(nl->cb, NL_CB_VALID, NL_CB_CUSTOM, nl_valid_handler, cdrv);
+    nl_cb_set(nl->cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, nl_no_seq_check, NULL);
+
+    /* Group ids do not change, so CQM events survive a reconnect */
+    if (nl->mlme_group > 0 &&
+        nl_socket_add_membership(nl->sock, nl->mlme_group)) {
+        wpa_printf(MSG_DEBUG, "nl80211: failed to rejoin mlme group");
+        nl->mlme_group = 0;
+    }
+
+    if (eloop_register_read_sock(nl_socket_get_fd(nl->sock), wext_nl_receive,
+                     cdrv, NULL)) {
+        wpa_printf(MSG_DEBUG,"failed to register netlink socket");
+        err = -ENOMEM;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    wext_nl_deinit(cdrv);
+    return err;
+}
+
+/*
+ * Returns the kept message, emptied and with the generic netlink header of
+ * family and cmd, or NULL if netlink is not available.
+ */
+static struct nl_msg *wext_nl_msg_family(struct wpa_driver_custom_data *cdrv,
+                     int family, int cmd)
+{
+    struct wext_nl_ctx *nl = &cdrv->nl;
+    struct nlmsghdr *nlh;
+
+    if (wext_nl_init(cdrv)) {
+        return NULL;
+    }
+
+    nlh = nlmsg_hdr(nl->msg);
+    os_memset(nlh, 0, NLMSG_HDRLEN);
+    nlh->nlmsg_len = NLMSG_HDRLEN;
+
+    genlmsg_put(nl->msg, 0, 0, family, 0, 0, cmd, 0);
+    return nl->msg;
+}
+
+/*
+ * Returns the kept message, emptied and with the nl80211 header of cmd and
+ * the interface index already put, or NULL if nl80211 is not available.
+ */
+static struct nl_msg *wext_nl_msg(struct wpa_driver_custom_data *cdrv,
+                  int cmd)
+{
+    struct nl_msg *msg;
+
+    if (wext_nl_init(cdrv)) {
+        return NULL;
+    }
+    msg = wext_nl_msg_family(cdrv, cdrv->nl.family, cmd);
+    NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, cdrv->drv->ifindex);
+    return msg;
+
+nla_put_failure:
+    return NULL;
+}
+
+/* Completes requests past their deadline and reports a wedged firmware */
+static void wext_nl_timeout(void *eloop_ctx, void *timeout_ctx)
+{
+    struct wpa_driver_custom_data *cdrv = eloop_ctx;
+    struct wext_nl_req *req;
+    struct os_time now;
+    int i, expired = 0;
+
+    os_get_time(&now);
+    for (i = 0; i < WEXT_NL_MAX_PENDING; i++) {
+        req = &cdrv->nl.req[i];
+        if (req->seq && !os_time_before(&now, &req->deadline)) {
+            wpa_printf(MSG_ERROR, "nl80211 request %u timed out", req->seq);
+            wext_nl_complete(cdrv, req, -ETIMEDOUT);
+            expired++;
+        }
+    }
+    if (expired && !cdrv->nl.hanged) {
+        /* Once, until a request is answered again */
+        cdrv->nl.hanged = 1;
+        wpa_msg(cdrv->drv->ctx, MSG_INFO, WPA_EVENT_DRIVER_STATE "HANGED");
+    }
+    wext_nl_schedule(cdrv);
+}
+
+/* Arms the timeout for the earliest deadline of pending requests */
+static void wext_nl_schedule(struct wpa_driver_custom_data *cdrv)
+{
+    struct wext_nl_req *req, *first = NULL;
+    struct os_time now, left;
+    int i;
+
+    eloop_cancel_timeout(wext_nl_timeout, cdrv, NULL);
+    for (i = 0; i < WEXT_NL_MAX_PENDING; i++) {
+        req = &cdrv->nl.req[i];
+        if (req->seq && (first == NULL ||
+                 os_time_before(&req->deadline, &first->deadline))) {
+            first = req;
+        }
+    }
+    if (first == NULL) {
+        return;
+    }
+    os_get_time(&now);
+    if (os_time_before(&now, &first->deadline)) {
+        os_time_sub(&first->deadline, &now, &left);
+    } else {
+        left.sec = 0;
+        left.usec = 0;
+    }
+    eloop_register_timeout(left.sec, left.usec, wext_nl_timeout, cdrv, NULL);
+}
+
+/*
+ * Sends the kept message as a request that done() completes with 0 or a
+ * negative error: the ACK or error from the kernel, -ETIMEDOUT after
+ * timeout_ms, or a socket error. Reply messages before the ACK are passed
+ * to valid(), if any. On a send error the context is set up again and the
+ * message resent once. The sequence number of the request is stored to
+ * seq, if not NULL.
+ * Returns 0 once sent, or a negative error if nothing was sent and done()
+ * is not called.
+ */
+static int wext_nl_request(struct wpa_driver_custom_data *cdrv,
+               unsigned int timeout_ms,
+               int (*valid)(struct nl_msg *msg, void *arg),
+               void *valid_arg, wext_nl_done_fn done, void *arg,
+               u32 *seq)
+{
+    struct wext_nl_ctx *nl = &cdrv->nl;
+    struct wext_nl_req *req = NULL;
+    struct nl_msg *msg;
+    struct nlmsghdr *nlh;
+    int retry = 1, err, i;
+
+    for (i = 0; i < WEXT_NL_MAX_PENDING; i++) {
+        if (nl->req[i].seq == 0) {
+            req = &nl->req[i];
+            break;
+        }
+    }
+    if (req == NULL) {
+        wpa_printf(MSG_DEBUG, "nl80211: too many pending requests");
+        return -EBUSY;
+    }
+
+    for (;;) {
+        err = nl_send_auto_complete(nl->sock, nl->msg);
+        if (err >= 0) {
+            break;
+        }
+        wpa_printf(MSG_DEBUG, "nl80211 socket error %d%s", err,
+               retry ? ", reconnecting" : "");
+        if (!retry) {
+            wext_nl_deinit(cdrv);
+            return err;
+        }
+        retry = 0;
+
+        /* Carry the request over to a new context */
+        msg = nl->msg;
+        nl->msg = NULL;
+        wext_nl_deinit(cdrv);
+        err = wext_nl_init(cdrv);
+        if (err) {
+            nlmsg_free(msg);
+            return err;
+        }
+        nlmsg_free(nl->msg);
+        nl->msg = msg;
+        /* Let the new socket fill in its port and sequence number */
+        nlh = nlmsg_hdr(msg);
+        nlh->nlmsg_pid = 0;
+        nlh->nlmsg_seq = 0;
+    }
+
+    req->seq = nlmsg_hdr(nl->msg)->nlmsg_seq;
+    req->valid = valid;
+    req->valid_arg = valid_arg;
+    req->done = done;
+    req->arg = arg;
+    os_get_time(&req->deadline);
+    req->deadline.sec += timeout_ms / 1000;
+    req->deadline.usec += (timeout_ms % 1000) * 1000;
+    if (req->deadline.usec >= 1000000) {
+        req->deadline.sec++;
+        req->deadline.usec -= 1000000;
+    }
+    wext_nl_schedule(cdrv);
+    if (seq) {
+        *seq = req->seq;
+    }
+    return 0;
+}
+
+static void wext_nl_sync_done(struct wpa_driver_custom_data *cdrv, int err,
+                  void *arg)
+{
+    *(int *)arg = err;
+}
+
+/*
+ * Sends the kept message and waits for the reply, at most timeout_ms, for
+ * callers that need the result at once. Other requests completing meanwhile
+ * get their callbacks as from eloop. The result, 0 or a negative error as
+ * wext_nl_request() done() gets it, is stored to result.
+ * Returns 0 once sent, or a negative error if nothing was sent.
+ */
+static int wext_nl_send_sync(struct wpa_driver_custom_data *cdrv,
+                 unsigned int timeout_ms,
+                 int (*valid)(struct nl_msg *msg, void *arg),
+                 void *valid_arg, int *result)
+{
+    struct wext_nl_req *req;
+    struct pollfd pfd;
+    struct os_time now, left;
+    u32 seq;
+    int err;
+
+    *result = 1;
+    err = wext_nl_request(cdrv, timeout_ms, valid, valid_arg,
+                  wext_nl_sync_done, result, &seq);
+    if (err < 0) {
+        return err;
+    }
+    /* Completion of the request, also by error or timeout, sets result */
+    while (*result > 0) {
+        req = wext_nl_req_find(&cdrv->nl, seq);
+        os_get_time(&now);
+        if (!os_time_before(&now, &req->deadline)) {
+            wext_nl_timeout(cdrv, NULL);
+            continue;
+        }
+        os_time_sub(&req->deadline, &now, &left);
+        pfd.fd = nl_socket_get_fd(cdrv->nl.sock);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, left.sec * 1000 + (left.usec + 999) / 1000) > 0) {
+            wext_nl_receive(pfd.fd, cdrv, NULL);
+        }
+    }
+    return 0;
+}
+
+static void wext_nl_log_done(struct wpa_driver_custom_data *cdrv, int err,
+                 void *arg)
+{
+    if (err < 0) {
+        wpa_printf(MSG_DEBUG, "%s: failed: %d", (const char *)arg, err);
+    }
+}
+
+static int wpa_driver_set_power_save(struct wpa_driver_wext_data *drv,
+                     int state)
+{
+    struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+    struct nl_msg *msg;
+    enum nl80211_ps_state ps_state;
+    int result;
+
+    if (cdrv == NULL) {
+        return -1;
+    }
+    msg = wext_nl_msg(cdrv, NL80211_CMD_SET_POWER_SAVE);
+    if (!msg) {
+        return -1;
+    }
+
+    if (state != 0) {
+        ps_state = NL80211_PS_ENABLED;
+    } else {
+        ps_state = NL80211_PS_DISABLED;
+    }
+
+    NLA_PUT_U32(msg, NL80211_ATTR_PS_STATE, ps_state);
+
+    /* POWERMODE fails only if the request could not be sent */
+    if (wext_nl_send_sync(cdrv, WEXT_NL_TIMEOUT_MS, NULL, NULL, &result)) {
+        return -1;
+    }
+    if (result < 0) {
+        wpa_printf(MSG_DEBUG, "%s: failed: %d", __func__, result);
+    }
+    return 0;
+
+nla_put_failure:
+    return -1;
+}
+
+/*
+ * Last COUNTRY requested, "" - none. The regulatory domain is system-wide,
+ * so this is too; START clears it as the driver may come back reset.
+ */
+static char wext_country[3];
+
+static void wext_nl_country_done(struct wpa_driver_custom_data *cdrv, int err,
+                 void *arg)
+{
+    if (err < 0) {
+        /* Not applied, let the next COUNTRY try again */
+        wext_country[0] = '\0';
+    }
+    wext_nl_log_done(cdrv, err, arg);
+}
+
+static int wpa_driver_set_country(struct wpa_driver_wext_data *drv,
+                  char *country)
+{
+    struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+    struct nl_msg *msg;
+    char alpha2[3];
+
+    if (cdrv == NULL) {
+        return -1;
+    }
+
+    alpha2[0] = country[0];
     alpha2[1] = country[1];
     alpha2[2] = '\0';
 
-    genlmsg_put(msg, 0, 0, genl_family_get_id(nl80211), 0, 0,
-            NL80211_CMD_REQ_SET_REG, 0);
+    if (os_strcmp(wext_country, alpha2) == 0) {
+        return 0;
+    }
+    msg = wext_nl_msg(cdrv, NL80211_CMD_REQ_SET_REG);
+    if (!msg) {
+        return -1;
+    }
 
-    NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, devidx);
     NLA_PUT_STRING(msg, NL80211_ATTR_REG_ALPHA2, alpha2);
 
-    err = nl_send_auto_complete(nl_sock, msg);
-    if (err < 0) {
-        wpa_printf(MSG_DEBUG, "could not send auto_complete: %d", err);
-        goto out;
+    /* Regulatory hints are applied later by the kernel anyway */
+    if (wext_nl_request(cdrv, WEXT_NL_TIMEOUT_MS, NULL, NULL,
+                wext_nl_country_done, (void *)__func__, NULL) < 0) {
+        return -1;
     }
+    os_memcpy(wext_country, alpha2, sizeof(wext_country));
+    return 0;
 
-    err = 1;
+nla_put_failure:
+    return -1;
+}
 
-    nl_cb_err(cb, NL_CB_CUSTOM, nl_error_handler, &err);
-    nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, nl_finish_handler, &err);
-    nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, nl_ack_handler, &err);
+static unsigned int wext_msec_since(struct os_time *t, struct os_time *now)
+{
+    struct os_time diff;
 
-    while (err > 0)
-        nl_recvmsgs(nl_sock, cb);
+    if (os_time_before(now, t)) {
+        return 0;
+    }
+    os_time_sub(now, t, &diff);
+    return diff.sec * 1000 + diff.usec / 1000;
+}
+
+/*
+ * Queries what of RSSI (WEXT_LINK_RSSI) and link speed (WEXT_LINK_RATE) is
+ * asked for, and the SSID if not known yet for this AP. Failures are not
+ * cached, the next command asks again.
+ */
+static void wext_link_refresh(struct wpa_driver_custom_data *cdrv, int what)
+{
+    struct wext_link_cache *link = &cdrv->link;
+
+    if (link->ssid_len == 0) {
+        link->ssid_len = wpa_driver_wext_get_ssid(cdrv->drv, link->ssid);
+        if (link->ssid_len < 0 || link->ssid_len > MAX_SSID_LEN) {
+            link->ssid_len = 0;
+        }
+        link->ssid[link->ssid_len] = '\0';
+    }
+    if (what & WEXT_LINK_RSSI) {
+        link->rssi = wpa_driver_wext_get_rssi(cdrv->drv);
+        os_get_time(&link->rssi_updated);
+    }
+    if (what & WEXT_LINK_RATE) {
+        link->linkspeed = wpa_driver_wext_get_linkspeed(cdrv->drv);
+        os_get_time(&link->rate_updated);
+    }
+}
+
+/*
+ * Returns link quality with what is asked for no older than the staleness
+ * bound, one query each per bound at most. CQM threshold events refresh it
+ * in between.
+ */
+static struct wext_link_cache *wext_link_get(struct wpa_driver_custom_data *cdrv,
+                         int what)
+{
+    struct wext_link_cache *link = &cdrv->link;
+    struct os_time now;
+    int stale = 0;
+
+    os_get_time(&now);
+    if ((what & WEXT_LINK_RSSI) && (link->rssi == -1 ||
+        wext_msec_since(&link->rssi_updated, &now) > link->max_age_ms)) {
+        stale |= WEXT_LINK_RSSI;
+    }
+    if ((what & WEXT_LINK_RATE) && (link->linkspeed == -1 ||
+        wext_msec_since(&link->rate_updated, &now) > link->max_age_ms)) {
+        stale |= WEXT_LINK_RATE;
+    }
+    if (stale || link->ssid_len == 0) {
+        wext_link_refresh(cdrv, stale);
+    }
+    return link;
+}
+
+static int wext_nl_family_handler(struct nl_msg *msg, void *arg)
+{
+    struct nlattr *tb[CTRL_ATTR_MAX + 1];
+    struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+    struct nlattr *mcgrp, *tb2[CTRL_ATTR_MCAST_GRP_MAX + 1];
+    int *group = arg;
+    int rem;
+
+    nla_parse(tb, CTRL_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+          genlmsg_attrlen(gnlh, 0), NULL);
+    if (!tb[CTRL_ATTR_MCAST_GROUPS]) {
+        return NL_SKIP;
+    }
+    nla_for_each_nested(mcgrp, tb[CTRL_ATTR_MCAST_GROUPS], rem) {
+        nla_parse(tb2, CTRL_ATTR_MCAST_GRP_MAX, nla_data(mcgrp),
+              nla_len(mcgrp), NULL);
+        if (tb2[CTRL_ATTR_MCAST_GRP_NAME] && tb2[CTRL_ATTR_MCAST_GRP_ID] &&
+            os_strcmp(nla_data(tb2[CTRL_ATTR_MCAST_GRP_NAME]), "mlme") == 0) {
+            *group = nla_get_u32(tb2[CTRL_ATTR_MCAST_GRP_ID]);
+            break;
+        }
+    }
+    return NL_SKIP;
+}
+
+/* Subscribes the nl80211 socket to mlme events, which carry CQM */
+static int wext_nl_join_mlme(struct wpa_driver_custom_data *cdrv)
+{
+    struct wext_nl_ctx *nl = &cdrv->nl;
+    struct nl_msg *msg;
+    int group = 0, err, result;
+
+    if (nl->mlme_group > 0) {
+        return 0;
+    }
+    msg = wext_nl_msg_family(cdrv, GENL_ID_CTRL, CTRL_CMD_GETFAMILY);
+    if (!msg) {
+        return -1;
+    }
+    NLA_PUT_STRING(msg, CTRL_ATTR_FAMILY_NAME, "nl80211");
+    err = wext_nl_send_sync(cdrv, WEXT_NL_TIMEOUT_MS, wext_nl_family_handler,
+                &group, &result);
+    if (err == 0) {
+        err = result;
+    }
+    if (err < 0 || group <= 0 || nl_socket_add_membership(nl->sock, group)) {
+        wpa_printf(MSG_DEBUG, "nl80211: failed to join mlme group: %d", err);
+        return -1;
+    }
+    nl->mlme_group = group;
+    return 0;
 
-    ret = 0;
-out:
-    nl_cb_put(cb);
-out_free_msg:
-    nlmsg_free(msg);
 nla_put_failure:
+    return -1;
+}
 
-exit:
-    wpa_driver_deinit_nl();
-    return ret;
+/* Multicast nl80211 events: CQM RSSI threshold crossings */
+static void wext_nl_event(struct wpa_driver_custom_data *cdrv,
+              struct nl_msg *msg)
+{
+    struct nlattr *tb[NL80211_ATTR_MAX + 1];
+    struct nlattr *cqm[NL80211_ATTR_CQM_MAX + 1];
+    struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+    struct wext_link_cache *link;
+    u32 event;
+
+    if (gnlh->cmd != NL80211_CMD_NOTIFY_CQM) {
+        return;
+    }
+    nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+          genlmsg_attrlen(gnlh, 0), NULL);
+    if (!tb[NL80211_ATTR_IFINDEX] || !tb[NL80211_ATTR_CQM] ||
+        (int) nla_get_u32(tb[NL80211_ATTR_IFINDEX]) != cdrv->drv->ifindex ||
+        nla_parse_nested(cqm, NL80211_ATTR_CQM_MAX, tb[NL80211_ATTR_CQM],
+                 NULL) ||
+        !cqm[NL80211_ATTR_CQM_RSSI_THRESHOLD_EVENT]) {
+        return;
+    }
+    event = nla_get_u32(cqm[NL80211_ATTR_CQM_RSSI_THRESHOLD_EVENT]);
+
+    link = &cdrv->link;
+    wext_link_refresh(cdrv, WEXT_LINK_RSSI | WEXT_LINK_RATE);
+    wpa_msg(cdrv->drv->ctx, MSG_INFO, WPA_EVENT_SIGNAL_CHANGE
+        "above=%d signal=%d linkspeed=%d",
+        event == NL80211_CQM_RSSI_THRESHOLD_EVENT_HIGH,
+        link->rssi, link->linkspeed);
+}
+
+/* Sets CQM RSSI threshold and hysteresis, a threshold of 0 disables it */
+static int wext_link_monitor(struct wpa_driver_custom_data *cdrv, int thold,
+                 unsigned int hyst)
+{
+    struct nl_msg *msg;
+    struct nlattr *cqm;
+    int err, result;
+
+    if (thold && wext_nl_join_mlme(cdrv)) {
+        return -1;
+    }
+    msg = wext_nl_msg(cdrv, NL80211_CMD_SET_CQM);
+    if (!msg) {
+        return -1;
+    }
+    cqm = nla_nest_start(msg, NL80211_ATTR_CQM);
+    if (!cqm) {
+        return -1;
+    }
+    NLA_PUT_U32(msg, NL80211_ATTR_CQM_RSSI_THOLD, thold);
+    NLA_PUT_U32(msg, NL80211_ATTR_CQM_RSSI_HYST, hyst);
+    nla_nest_end(msg, cqm);
+
+    err = wext_nl_send_sync(cdrv, WEXT_NL_TIMEOUT_MS, NULL, NULL, &result);
+    if (err == 0) {
+        err = result;
+    }
+    if (err < 0) {
+        wpa_printf(MSG_DEBUG, "%s: failed: %d", __func__, err);
+        return -1;
+    }
+    cdrv->link.cqm_thold = thold;
+    cdrv->link.cqm_hyst = hyst;
+    return 0;
+
+nla_put_failure:
+    return -1;
 }
 
 static int wpa_driver_toggle_btcoex_state(char state)
@@ -1966,15 +2923,6 @@ static int wpa_driver_toggle_rx_filter(char state)
     return 0; /* not implemented yet */
 }
 
-/* we start with "auto" power mode - power_save is on */
-int g_power_mode = 0;
-
-/* currently cached scan type */
-u8 g_scan_type = IW_SCAN_TYPE_ACTIVE;
-
-/* start with "world" num of channels */
-int g_num_channels = 13;
-
 static int wpa_driver_priv_driver_cmd( void *priv, char *cmd, char *buf, size_t buf_len )
 {
     struct wpa_driver_wext_data *drv = priv;
@@ -1994,6 +2942,7 @@ static int wpa_driver_priv_driver_cmd( void *priv, char *cmd, char *buf, size_t
             !(flags & IFF_UP)) {
             wpa_driver_wext_set_ifflags(drv, flags | IFF_UP);
         }
+        wext_country[0] = '\0';
         wpa_msg(wpa_s, MSG_INFO, WPA_EVENT_DRIVER_STATE "STARTED");
     } else if (os_strcasecmp(cmd, "MACADDR") == 0) {
         u8 macaddr[ETH_ALEN] = {};
@@ -2005,56 +2954,169 @@ static int wpa_driver_priv_driver_cmd( void *priv, char *cmd, char *buf, size_t
 
         ret = os_snprintf(buf, buf_len, "Macaddr = " MACSTR "\n", MAC2STR(macaddr));
     } else if ((os_strcasecmp(cmd, "RSSI") == 0) || (os_strcasecmp(cmd, "RSSI-APPROX") == 0)) {
-        u8 ssid[MAX_SSID_LEN];
-        int rssi;
+        struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+        struct wext_link_cache *link;
 
-        rssi = wpa_driver_wext_get_rssi(priv);
-        if ((rssi != -1) && (wpa_driver_wext_get_ssid(priv, ssid) > 0)) {
-            ret = os_snprintf(buf, buf_len, "%s rssi %d\n", ssid, rssi);
+        if (cdrv == NULL) {
+            return -1;
+        }
+        link = wext_link_get(cdrv, WEXT_LINK_RSSI);
+        if ((link->rssi != -1) && (link->ssid_len > 0)) {
+            ret = os_snprintf(buf, buf_len, "%s rssi %d\n", link->ssid,
+                      link->rssi);
         } else {
             ret = -1;
         }
     } else if (os_strcasecmp(cmd, "LINKSPEED") == 0) {
-        int linkspeed;
+        struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+        struct wext_link_cache *link;
 
-        linkspeed = wpa_driver_wext_get_linkspeed(priv);
-        if (linkspeed != -1) {
-            ret = os_snprintf(buf, buf_len, "LinkSpeed %d\n", linkspeed);
+        if (cdrv == NULL) {
+            return -1;
+        }
+        link = wext_link_get(cdrv, WEXT_LINK_RATE);
+        if (link->linkspeed != -1) {
+            ret = os_snprintf(buf, buf_len, "LinkSpeed %d\n", link->linkspeed);
         } else {
             ret = -1;
         }
+    } else if( os_strncasecmp(cmd, "LINK-MAXAGE ", 12) == 0 ) {
+        struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+
+        if (cdrv == NULL) {
+            return -1;
+        }
+        cdrv->link.max_age_ms = atoi(cmd + 12);
+        ret = 0;
+    } else if( os_strncasecmp(cmd, "RSSI-MONITOR ", 13) == 0 ) {
+        struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+        int thold, hyst = 0;
+
+        if (cdrv == NULL) {
+            return -1;
+        }
+        /* "RSSI-MONITOR <threshold dBm> [hysteresis dB]" */
+        thold = atoi(cmd + 13);
+        if (os_strchr(cmd + 13, ' ')) {
+            hyst = atoi(os_strchr(cmd + 13, ' ') + 1);
+        }
+        ret = wext_link_monitor(cdrv, thold, hyst);
     } else if( os_strcasecmp(cmd, "RELOAD") == 0 ) {
         wpa_msg(wpa_s, MSG_INFO, WPA_EVENT_DRIVER_STATE "HANGED");
     } else if( os_strcasecmp(cmd, "SCAN-PASSIVE") == 0 ) {
-        g_scan_type = IW_SCAN_TYPE_PASSIVE;
+        struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+
+        if (cdrv == NULL) {
+            return -1;
+        }
+        cdrv->scan_type = IW_SCAN_TYPE_PASSIVE;
         ret = 0;
     } else if( os_strcasecmp(cmd, "SCAN-ACTIVE") == 0 ) {
-        g_scan_type = IW_SCAN_TYPE_ACTIVE;
+        struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+
+        if (cdrv == NULL) {
+            return -1;
+        }
+        cdrv->scan_type = IW_SCAN_TYPE_ACTIVE;
+        ret = 0;
+    } else if( os_strncasecmp(cmd, "SCAN-FREQS", 10) == 0 ) {
+        struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+        struct os_time now;
+        char *pos = cmd + 10;
+        int n = 0;
+
+        if (cdrv == NULL) {
+            return -1;
+        }
+        /*
+         * "SCAN-FREQS <MHz> ..." or "SCAN-FREQS LAST" for the channels the
+         * last associated ESS was seen on; applies to the next scan only.
+         * No channels clears it.
+         */
+        cdrv->scan_ess = 0;
+        if (os_strcasecmp(pos, " LAST") == 0) {
+            os_get_time(&now);
+            if (cdrv->ess.freqs[0] == 0 ||
+                wext_msec_since(&cdrv->ess.seen, &now) > WEXT_ESS_MAX_AGE_MS) {
+                cdrv->scan_freqs[0] = 0;
+                return -1;
+            }
+            os_memcpy(cdrv->scan_freqs, cdrv->ess.freqs,
+                  sizeof(cdrv->ess.freqs));
+            cdrv->scan_ess = 1;
+        } else {
+            while (*pos == ' ' && n < WEXT_SCAN_MAX_FREQS) {
+                cdrv->scan_freqs[n] = atoi(pos + 1);
+                if (cdrv->scan_freqs[n] <= 0) {
+                    break;
+                }
+                n++;
+                pos = os_strchr(pos + 1, ' ');
+                if (pos == NULL) {
+                    break;
+                }
+            }
+            cdrv->scan_freqs[n] = 0;
+        }
         ret = 0;
     } else if( os_strcasecmp(cmd, "SCAN-MODE") == 0 ) {
-        ret = snprintf(buf, buf_len, "ScanMode = %u\n", g_scan_type);
+        struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+
+        if (cdrv == NULL) {
+            return -1;
+        }
+        ret = snprintf(buf, buf_len, "ScanMode = %u\n", cdrv->scan_type);
         if (ret < (int)buf_len) {
             return ret;
         }
+    } else if( os_strcasecmp(cmd, "SCAN-STATS") == 0 ) {
+        struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+        struct wext_scan_stats *stats;
+
+        if (cdrv == NULL) {
+            return -1;
+        }
+        stats = &cdrv->scan_stats;
+        ret = os_snprintf(buf, buf_len,
+                  "fetches=%lu retries=%lu bytes=%lu last_retries=%u "
+                  "last_bytes=%u max_retries=%u buf=%lu hint=%lu\n",
+                  stats->fetches, stats->retries, stats->bytes,
+                  stats->last_retries, stats->last_bytes,
+                  stats->max_retries,
+                  (unsigned long) cdrv->scan_buf_len,
+                  (unsigned long) cdrv->scan_len_hint);
+        if (ret < 0 || ret >= (int)buf_len) {
+            ret = -1;
+        }
     } else if( os_strncasecmp(cmd, "POWERMODE", 9) == 0 ) {
+        struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
         int mode = atoi(cmd + 9);
 
-        if (mode == g_power_mode) {
+        if (cdrv == NULL) {
+            return -1;
+        }
+        /* Unchanged on this interface, skip the round trip */
+        if (mode == cdrv->power_mode) {
             ret = 0;
         } else if (mode == 1) { /* active mode */
-            ret = wpa_driver_set_power_save(drv->ifname, 0);
+            ret = wpa_driver_set_power_save(drv, 0);
         } else if (mode == 0) { /* auto mode */
-            ret = wpa_driver_set_power_save(drv->ifname, 1);
+            ret = wpa_driver_set_power_save(drv, 1);
         }
 
         if (!ret) {
-            g_power_mode = mode;
+            cdrv->power_mode = mode;
         }
 
-        wpa_printf(MSG_DEBUG, "global POWERMODE set to %d (wanted %d), ret %d",
-               g_power_mode, mode, ret);
+        wpa_printf(MSG_DEBUG, "%s POWERMODE set to %d (wanted %d), ret %d",
+               drv->ifname, cdrv->power_mode, mode, ret);
     } else if( os_strcasecmp(cmd, "GETPOWER") == 0 ) {
-        ret = sprintf(buf, "powermode = %u\n", g_power_mode);
+        struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+
+        if (cdrv == NULL) {
+            return -1;
+        }
+        ret = sprintf(buf, "powermode = %u\n", cdrv->power_mode);
     } else if( os_strncasecmp(cmd, "BTCOEXMODE", 10) == 0 ) {
         int mode = atoi(cmd + 10);
 
@@ -2074,7 +3136,7 @@ static int wpa_driver_priv_driver_cmd( void *priv, char *cmd, char *buf, size_t
         ret = wpa_driver_toggle_rx_filter('0');
     } else if( os_strncasecmp(cmd, "country", 7) == 0 ) {
         wpa_printf(MSG_DEBUG, "setting country code to: %s", cmd + 8);
-        ret = wpa_driver_set_country(drv->ifname, cmd + 8);
+        ret = wpa_driver_set_country(drv, cmd + 8);
     } else {
         wpa_printf(MSG_ERROR, "Unsupported command: %s", cmd);
         ret = -1;
@@ -2086,45 +3148,187 @@ out:
 
 #endif
 
+#ifdef ANDROID
+#define WEXT_SCAN_RETRY_SEC     1   /* failed scan reported after this */
+
+/*
+ * Kernel answer to the scan trigger. A started scan gets the usual timeout;
+ * a rejected one is reported as done shortly, so the supplicant reads the
+ * results it has and schedules the next scan.
+ */
+static void wext_scan_nl_done(struct wpa_driver_custom_data *cdrv, int err,
+                  void *arg)
+{
+    struct wpa_driver_wext_data *drv = cdrv->drv;
+
+    if (err == 0) {
+        wpa_driver_wext_set_scan_timeout(drv);
+        return;
+    }
+    wpa_printf(MSG_DEBUG, "%s: failed: %d", __func__, err);
+    eloop_cancel_timeout(wpa_driver_wext_scan_timeout, drv, drv->ctx);
+    eloop_register_timeout(WEXT_SCAN_RETRY_SEC, 0,
+                   wpa_driver_wext_scan_timeout, drv, drv->ctx);
+}
+
+/*
+ * Triggers the scan through nl80211, which takes all SSIDs and channels,
+ * without waiting for the kernel: wext_scan_nl_done() takes its answer.
+ * Returns 0 if the request reached nl80211, -1 if it is not available.
+ */
+static int wext_scan_nl(struct wpa_driver_custom_data *cdrv,
+            const struct wext_scan_params *params, u8 scan_type)
+{
+    struct nl_msg *msg;
+    struct nlattr *attr;
+    size_t i;
+
+    msg = wext_nl_msg(cdrv, NL80211_CMD_TRIGGER_SCAN);
+    if (!msg) {
+        return -1;
+    }
+
+    /* Passive scans carry no SSIDs, active ones at least the wildcard */
+    if (scan_type == IW_SCAN_TYPE_ACTIVE) {
+        attr = nla_nest_start(msg, NL80211_ATTR_SCAN_SSIDS);
+        if (!attr) {
+            goto nla_put_failure;
+        }
+        for (i = 0; i < params->num_ssids; i++) {
+            NLA_PUT(msg, i + 1, params->ssids[i].ssid_len,
+                params->ssids[i].ssid);
+        }
+        if (params->num_ssids == 0) {
+            NLA_PUT(msg, 1, 0, "");
+        }
+        nla_nest_end(msg, attr);
+    }
+
+    if (params->freqs) {
+        attr = nla_nest_start(msg, NL80211_ATTR_SCAN_FREQUENCIES);
+        if (!attr) {
+            goto nla_put_failure;
+        }
+        for (i = 0; params->freqs[i]; i++) {
+            NLA_PUT_U32(msg, i + 1, params->freqs[i]);
+        }
+        nla_nest_end(msg, attr);
+    }
+
+    /* cfg80211 reports completion as SIOCGIWSCAN like for WEXT scans */
+    if (wext_nl_request(cdrv, WEXT_NL_TIMEOUT_MS, NULL, NULL,
+                wext_scan_nl_done, NULL, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+
+nla_put_failure:
+    return -1;
+}
+#endif
+
+
 /**
- * wpa_driver_wext_scan_custom - Request the driver to initiate scan
+ * wpa_driver_wext_scan_params - Request a scan of given SSIDs and channels
  * @priv: Pointer to private wext data from wpa_driver_wext_init()
- * @ssid: Specific SSID to scan for (ProbeReq) or %NULL to scan for
- *    all SSIDs (either active scan with broadcast SSID or passive
- *    scan
- * @ssid_len: Length of the SSID
+ * @params: SSIDs to probe for and channels to scan
  * Returns: 0 on success, -1 on failure
+ *
+ * Uses nl80211 when available, WEXT only if nl80211 can not be reached; a
+ * scan the kernel rejects is reported finished for the supplicant to retry.
+ * The WEXT fallback probes for the first SSID only, channels are passed in
+ * either case.
  */
-int wpa_driver_wext_scan_custom(void *priv, const u8 *ssid, size_t ssid_len)
+static int wpa_driver_wext_scan_params(void *priv,
+                       const struct wext_scan_params *params)
 {
     struct wpa_driver_wext_data *drv = priv;
+    struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+    u8 scan_type = cdrv ? cdrv->scan_type : IW_SCAN_TYPE_ACTIVE;
     struct iwreq iwr;
     int ret = 0;
+    size_t i;
     struct iw_scan_req req;
-#ifdef ANDROID
-    struct wpa_supplicant *wpa_s = (struct wpa_supplicant *)(drv->ctx);
-    int scan_probe_flag = 0;
-#endif
 
-    if (ssid_len > IW_ESSID_MAX_SIZE) {
-        wpa_printf(MSG_DEBUG, "%s: too long SSID (%lu)",
-               __FUNCTION__, (unsigned long) ssid_len);
-        return -1;
+    for (i = 0; i < params->num_ssids; i++) {
+        if (params->ssids[i].ssid_len > IW_ESSID_MAX_SIZE) {
+            wpa_printf(MSG_DEBUG, "%s: too long SSID (%lu)", __FUNCTION__,
+                   (unsigned long) params->ssids[i].ssid_len);
+            return -1;
+        }
+    }
+
+    wpa_printf(MSG_DEBUG, "%s: scanning with scan type: %s, %lu SSIDs, %s",
+           __func__, scan_type == IW_SCAN_TYPE_PASSIVE ? "PASSIVE" : "ACTIVE",
+           (unsigned long) params->num_ssids,
+           params->freqs ? "listed channels" : "all channels");
+
+#ifdef ANDROID
+    if (cdrv && wext_scan_nl(cdrv, params, scan_type) == 0) {
+        return 0;
     }
+#endif
 
     os_memset(&iwr, 0, sizeof(iwr));
     os_strlcpy(iwr.ifr_name, drv->ifname, IFNAMSIZ);
 
     os_memset(&req, 0, sizeof(req));
-    req.scan_type = g_scan_type; /* Scan type is cached */
+    req.scan_type = scan_type; /* Scan type is cached per interface */
     req.bssid.sa_family = ARPHRD_ETHER;
     os_memset(req.bssid.sa_data, 0xff, ETH_ALEN);
     iwr.u.data.pointer = (caddr_t) &req;
     iwr.u.data.length = sizeof(req);
     iwr.u.data.flags = IW_SCAN_THIS_ESSID;
 
-    wpa_printf(MSG_DEBUG, "%s: scanning with scan type: %s", __func__,
-           g_scan_type == IW_SCAN_TYPE_PASSIVE ? "PASSIVE" : "ACTIVE");
+    if (params->num_ssids) {
+        req.essid_len = params->ssids[0].ssid_len;
+        os_memcpy(req.essid, params->ssids[0].ssid, req.essid_len);
+    }
+    for (i = 0; params->freqs && i < IW_MAX_FREQUENCIES &&
+         params->freqs[i]; i++) {
+        /* m * 10^e Hz */
+        req.channel_list[i].m = params->freqs[i];
+        req.channel_list[i].e = 6;
+    }
+    req.num_channels = i;
+    if (req.num_channels) {
+        iwr.u.data.flags |= IW_SCAN_THIS_FREQ;
+    }
+
+    if (ioctl(drv->ioctl_sock, SIOCSIWSCAN, &iwr) < 0) {
+        wpa_printf(MSG_ERROR, "ioctl[SIOCSIWSCAN]");
+        ret = -1;
+    }
+
+    wpa_driver_wext_set_scan_timeout(priv);
+
+    return ret;
+}
+
+
+/**
+ * wpa_driver_wext_scan_custom - Request the driver to initiate scan
+ * @priv: Pointer to private wext data from wpa_driver_wext_init()
+ * @ssid: Specific SSID to scan for (ProbeReq) or %NULL to scan for
+ *    all SSIDs (either active scan with broadcast SSID or passive
+ *    scan
+ * @ssid_len: Length of the SSID
+ * Returns: 0 on success, -1 on failure
+ *
+ * Channels and the ESS set with "SCAN-FREQS" apply to this scan only.
+ */
+int wpa_driver_wext_scan_custom(void *priv, const u8 *ssid, size_t ssid_len)
+{
+    struct wpa_driver_wext_data *drv = priv;
+    struct wpa_driver_custom_data *cdrv = wpa_driver_custom_get(drv);
+    struct wext_scan_params params;
+    int freqs[WEXT_SCAN_MAX_FREQS + 1];
+#ifdef ANDROID
+    struct wpa_supplicant *wpa_s = (struct wpa_supplicant *)(drv->ctx);
+    int scan_probe_flag = 0;
+#endif
+
+    os_memset(&params, 0, sizeof(params));
 
 #ifdef ANDROID
     if (wpa_s->prev_scan_ssid != BROADCAST_SSID_SCAN) {
@@ -2136,18 +3340,93 @@ int wpa_driver_wext_scan_custom(void *priv, const u8 *ssid, size_t ssid_len)
 #else
     if (ssid && ssid_len) {
 #endif
-        req.essid_len = ssid_len;
-        os_memcpy(req.essid, ssid, ssid_len);
+        params.ssids[0].ssid = ssid;
+        params.ssids[0].ssid_len = ssid_len;
+        params.num_ssids = 1;
     }
 
-    if (ioctl(drv->ioctl_sock, SIOCSIWSCAN, &iwr) < 0) {
-        wpa_printf(MSG_ERROR, "ioctl[SIOCSIWSCAN]");
-        ret = -1;
+    if (cdrv && cdrv->scan_freqs[0]) {
+        os_memcpy(freqs, cdrv->scan_freqs, sizeof(freqs));
+        params.freqs = freqs;
+        cdrv->scan_freqs[0] = 0;
+    }
+    if (cdrv && cdrv->scan_ess) {
+        /*
+         * A hidden ESS answers only probes with its SSID. It goes first,
+         * the WEXT fallback probes for the first SSID only.
+         */
+        if (cdrv->ess.ssid_len &&
+            (params.num_ssids == 0 ||
+             params.ssids[0].ssid_len != (size_t) cdrv->ess.ssid_len ||
+             os_memcmp(params.ssids[0].ssid, cdrv->ess.ssid,
+                   cdrv->ess.ssid_len) != 0)) {
+            params.ssids[params.num_ssids] = params.ssids[0];
+            params.ssids[0].ssid = cdrv->ess.ssid;
+            params.ssids[0].ssid_len = cdrv->ess.ssid_len;
+            params.num_ssids++;
+        }
+        cdrv->scan_ess = 0;
     }
 
-    wpa_driver_wext_set_scan_timeout(priv);
+    return wpa_driver_wext_scan_params(priv, &params);
+}
 
-    return ret;
+/**
+ * wpa_driver_custom_init - Initialize WE driver interface with local state
+ * @ctx: context to be used when calling wpa_supplicant functions,
+ * e.g., wpa_supplicant_event()
+ * @ifname: interface name, e.g., wlan0
+ * Returns: Pointer to private data from wpa_driver_wext_init(), %NULL on
+ * failure
+ */
+static void * wpa_driver_custom_init(void *ctx, const char *ifname)
+{
+    struct wpa_driver_wext_data *drv;
+    struct wpa_driver_custom_data *cdrv;
+
+    drv = wpa_driver_wext_init(ctx, ifname);
+    if (drv == NULL) {
+        return NULL;
+    }
+    cdrv = os_zalloc(sizeof(*cdrv));
+    if (cdrv == NULL) {
+        wpa_driver_wext_deinit(drv);
+        return NULL;
+    }
+    cdrv->drv = drv;
+    cdrv->scan_len_hint = IW_SCAN_MAX_DATA;
+    wext_link_invalidate(cdrv, NULL);
+    cdrv->link.max_age_ms = WEXT_LINK_MAX_AGE_MS;
+    cdrv->power_mode = 0; /* power_save is on */
+    cdrv->scan_type = IW_SCAN_TYPE_ACTIVE;
+    cdrv->next = wpa_driver_custom_list;
+    wpa_driver_custom_list = cdrv;
+    return drv;
+}
+
+
+/**
+ * wpa_driver_custom_deinit - Deinitialize WE driver interface
+ * @priv: Pointer to private wext data from wpa_driver_custom_init()
+ */
+static void wpa_driver_custom_deinit(void *priv)
+{
+    struct wpa_driver_custom_data **pcdrv, *cdrv;
+
+    for (pcdrv = &wpa_driver_custom_list; *pcdrv; pcdrv = &(*pcdrv)->next) {
+        if ((*pcdrv)->drv == priv) {
+            cdrv = *pcdrv;
+            *pcdrv = cdrv->next;
+            os_free(cdrv->scan_buf);
+            os_free(cdrv->scan_arena);
+#ifdef ANDROID
+            wext_nl_deinit(cdrv);
+#endif
+            os_free(cdrv);
+            break;
+        }
+    }
+    wpa_driver_wext_deinit(priv);
 }
 
 const struct wpa_driver_ops wpa_driver_custom_ops = {
@@ -2160,14 +3439,14 @@ const struct wpa_driver_ops wpa_driver_custom_ops = {
     .set_countermeasures = wpa_driver_wext_set_countermeasures,
     .set_drop_unencrypted = wpa_driver_wext_set_drop_unencrypted,
     .scan = wpa_driver_wext_scan_custom,
-    .get_scan_results2 = wpa_driver_wext_get_scan_results,
+    .get_scan_results2 = wpa_driver_wext_get_scan_results_custom,
     .deauthenticate = wpa_driver_wext_deauthenticate,
     .disassociate = wpa_driver_wext_disassociate,
     .set_mode = wpa_driver_wext_set_mode,
     .associate = wpa_driver_wext_associate,
     .set_auth_alg = wpa_driver_wext_set_auth_alg,
-    .init = wpa_driver_wext_init,
-    .deinit = wpa_driver_wext_deinit,
+    .init = wpa_driver_custom_init,
+    .deinit = wpa_driver_custom_deinit,
     .add_pmkid = wpa_driver_wext_add_pmkid,
     .remove_pmkid = wpa_driver_wext_remove_pmkid,
     .flush_pmkid = wpa_driver_wext_flush_pmkid,
@@ -31,25 +31,132 @@
 
 #define WPA_PS_ENABLED   0
 #define WPA_PS_DISABLED  1
+#define WPA_PS_AUTO      2
 
 #define BLUETOOTH_COEXISTENCE_MODE_ENABLED   0
 #define BLUETOOTH_COEXISTENCE_MODE_DISABLED  1
 #define BLUETOOTH_COEXISTENCE_MODE_SENSE     2
 
+#ifndef WPA_EVENT_SIGNAL_CHANGE
+#define WPA_EVENT_SIGNAL_CHANGE "CTRL-EVENT-SIGNAL-CHANGE "
+#endif
+
+#define LINK_MAX_AGE_MS 2000
+#define STA_INFO_BUF    512	/* first size of the payload copy */
+
+/* Station statistics of the current AP from one NL80211_CMD_GET_STATION */
+struct nl80211_sta_stats {
+	struct wpa_signal_info sig;	/* view for RSSI and LINKSPEED */
+	u8 *info;			/* NL80211_ATTR_STA_INFO payload */
+	int info_len;
+	int info_size;			/* allocated, grows to the longest */
+};
+
+/* Answers RSSI, LINKSPEED and LINKSTATS, see nl80211_link_get() */
+struct nl80211_link_cache {
+	int valid;
+	u8 bssid[ETH_ALEN];		/* station the values belong to */
+	struct nl80211_sta_stats sta;
+	struct os_time updated;
+	unsigned int max_age_ms;	/* staleness bound, LINK-MAXAGE */
+	int cqm_thold;			/* dBm, 0 - no CQM, RSSI-MONITOR */
+	unsigned int cqm_hyst;
+};
+
+#define LINK_SAMPLE_NUM         64
+#define LINK_SAMPLE_MIN_MS      100
+#define LINK_EWMA_WEIGHT        8	/* signal EWMA takes 1/8 of a sample */
+
+/* Station info attributes newer than our nl80211.h copy, kernel ABI */
+#define STA_INFO_CONNECTED_TIME 16	/* u32, sec */
+#define STA_INFO_RX_BYTES64     23
+#define STA_INFO_TX_BYTES64     24
+
+struct nl80211_link_sample {
+	struct os_time t;
+	u64 rx_bytes;			/* u32 counter without bytes64 */
+	u64 tx_bytes;
+	int bytes64;			/* both byte counters are 64-bit */
+	u32 connected_time;		/* sec, 0 - not reported */
+	u32 rx_packets;
+	u32 tx_packets;
+	u32 tx_retries;
+	u32 tx_failed;
+	int signal;			/* dBm */
+	int txrate;			/* kbit/s */
+};
+
+/* Periodic station samples, see nl80211_link_sample_timer() */
+struct nl80211_link_sampler {
+	unsigned int interval_ms;	/* 0 - stopped, LINKSAMPLE */
+	struct nl_msg *msg;		/* GET_STATION, reused by every sample */
+	struct nlattr *mac;		/* its NL80211_ATTR_MAC */
+	u8 bssid[ETH_ALEN];		/* station the ring belongs to */
+	int signal_ewma;		/* dBm * LINK_EWMA_WEIGHT */
+	unsigned int head;		/* next slot to fill */
+	unsigned int count;
+	struct nl80211_link_sample ring[LINK_SAMPLE_NUM];
+};
+
+#define PS_AUTO_INTERVAL_MS     500
+#define PS_AUTO_BURST_PPS       20
+#define PS_AUTO_IDLE_MS         2000
+#define PS_AUTO_HOLD_MS         1000
+#define PS_AUTO_MAX_POLL_MS     2000	/* backed off poll, 2 * hold */
+
+/* Power save state and the auto controller, see nl80211_ps_auto_update() */
+struct nl80211_ps_ctrl {
+	int mode;			/* last POWERMODE, -1 - never set */
+	int ps_on;			/* state set in the driver, -1 - unknown */
+	unsigned int interval_ms;	/* traffic poll period in auto */
+	unsigned int poll_ms;		/* current period, doubles while idle */
+	unsigned int max_poll_ms;	/* backoff limit, slowest reaction */
+	unsigned int burst_pps;		/* tx+rx packets/s turning PS off */
+	unsigned int idle_ms;		/* quiet time turning PS back on */
+	unsigned int hold_ms;		/* minimum time between switches */
+	int quiet;			/* below burst_pps since quiet_since */
+	struct os_time quiet_since;
+	struct os_time switched;	/* last change of ps_on */
+	struct os_time accounted;	/* on_ms/off_ms count up to here */
+	unsigned int switches;
+	unsigned long on_ms;
+	unsigned long off_ms;
+};
+
+/*
+ * Per-interface state of the private commands. wpa_driver_nl80211_data
+ * belongs to the supplicant's driver_nl80211.c, so the state is kept in a
+ * list keyed by it and created on first use.
+ */
+struct nl80211_custom_data {
+	struct nl80211_custom_data *next;
+	struct wpa_driver_nl80211_data *drv;	/* see nl80211_custom_alive() */
+	int ifindex;			/* tells a reused drv address apart */
+	struct nl80211_global *global;
+	struct i802_bss *bss;
+	int drv_errors;			/* sequential failures, see HANGED */
+	struct nl_handle *event_sock;	/* mlme events, NULL - not joined */
+	struct nl_cb *event_cb;
+	struct nl80211_link_cache link;
+	struct nl80211_link_sampler sampler;
+	struct nl80211_ps_ctrl ps;
+	int stopped;			/* STOP, no timer until START */
+};
+
+static struct nl80211_custom_data *nl80211_custom_list = NULL;
 
-static int g_drv_errors = 0;
-static int g_power_mode = 0;
 
 int send_and_recv_msgs(struct wpa_driver_nl80211_data *drv, struct nl_msg *msg,
                        int (*valid_handler)(struct nl_msg *, void *),
                        void *valid_data);
 
-static void wpa_driver_send_hang_msg(struct wpa_driver_nl80211_data *drv)
+static void wpa_driver_send_hang_msg(struct nl80211_custom_data *cdata)
 {
-	g_drv_errors++;
-	if (g_drv_errors > DRV_NUMBER_SEQUENTIAL_ERRORS) {
-		g_drv_errors = 0;
-		wpa_msg(drv->ctx, MSG_INFO, WPA_EVENT_DRIVER_STATE "HANGED");
+	cdata->drv_errors++;
+	if (cdata->drv_errors > DRV_NUMBER_SEQUENTIAL_ERRORS) {
+		cdata->drv_errors = 0;
+		wpa_msg(cdata->drv->ctx, MSG_INFO,
+			WPA_EVENT_DRIVER_STATE "HANGED");
 	}
 }
 
@@ -68,7 +175,10 @@ static int get_link_signal(struct nl_msg *msg, void *arg)
 		[NL80211_RATE_INFO_40_MHZ_WIDTH] = { .type = NLA_FLAG },
 		[NL80211_RATE_INFO_SHORT_GI] = { .type = NLA_FLAG },
 	};
-	struct wpa_signal_info *sig_change = arg;
+	struct nl80211_sta_stats *sta = arg;
+	struct wpa_signal_info *sig_change = &sta->sig;
+	u8 *info;
+	int len;
 
 	nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
 		  genlmsg_attrlen(gnlh, 0), NULL);
@@ -79,6 +189,21 @@ static int get_link_signal(struct nl_msg *msg, void *arg)
 	if (!sinfo[NL80211_STA_INFO_SIGNAL])
 		return NL_SKIP;
 
+	/* Kept whole for LINKSTATS, attributes are walked on demand */
+	len = nla_len(tb[NL80211_ATTR_STA_INFO]);
+	if (len > sta->info_size) {
+		info = os_realloc(sta->info, len);
+		if (info == NULL) {
+			wpa_printf(MSG_DEBUG, "nl80211: station info too "
+				   "long: %d", len);
+			return NL_SKIP;
+		}
+		sta->info = info;
+		sta->info_size = len;
+	}
+	sta->info_len = len;
+	os_memcpy(sta->info, nla_data(tb[NL80211_ATTR_STA_INFO]), len);
+
 	sig_change->current_signal =
 		(s8) nla_get_u8(sinfo[NL80211_STA_INFO_SIGNAL]);
 
@@ -99,15 +224,16 @@ static int get_link_signal(struct nl_msg *msg, void *arg)
 	return NL_SKIP;
 }
 
-static int wpa_driver_get_link_signal(void *priv, struct wpa_signal_info *sig)
+static int wpa_driver_get_link_signal(void *priv, struct nl80211_sta_stats *sta)
 {
 	struct i802_bss *bss = priv;
 	struct wpa_driver_nl80211_data *drv = bss->drv;
 	struct nl_msg *msg;
 	int ret = -1;
 
-	sig->current_signal = -9999;
-	sig->current_txrate = 0;
+	sta->sig.current_signal = -9999;
+	sta->sig.current_txrate = 0;
+	sta->info_len = 0;
 
 	msg = nlmsg_alloc();
 	if (!msg)
@@ -119,7 +245,7 @@ static int wpa_driver_get_link_signal(void *priv, struct wpa_signal_info *sig)
 	NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, drv->ifindex);
 	NLA_PUT(msg, NL80211_ATTR_MAC, ETH_ALEN, drv->bssid);
 
-	ret = send_and_recv_msgs(drv, msg, get_link_signal, sig);
+	ret = send_and_recv_msgs(drv, msg, get_link_signal, sta);
 	msg = NULL;
 	if (ret < 0)
 		wpa_printf(MSG_ERROR, "nl80211: get link signal fail: %d", ret);
@@ -128,6 +254,738 @@ nla_put_failure:
 	return ret;
 }
 
+static void nl80211_custom_free(struct nl80211_custom_data *cdata);
+
+/*
+ * A new interface may get the address of a removed one whose state was not
+ * dropped yet; that state (PS, sampler message, event socket) belongs to
+ * the old ifindex and is replaced.
+ */
+static struct nl80211_custom_data *nl80211_custom_get(struct i802_bss *bss)
+{
+	struct nl80211_custom_data *cdata;
+
+	for (cdata = nl80211_custom_list; cdata; cdata = cdata->next) {
+		if (cdata->drv != bss->drv)
+			continue;
+		if (cdata->ifindex == bss->drv->ifindex &&
+		    cdata->global == bss->drv->global) {
+			cdata->bss = bss;
+			return cdata;
+		}
+		nl80211_custom_free(cdata);
+		break;
+	}
+	cdata = os_zalloc(sizeof(*cdata));
+	if (cdata == NULL)
+		return NULL;
+	cdata->link.sta.info = os_malloc(STA_INFO_BUF);
+	if (cdata->link.sta.info == NULL) {
+		os_free(cdata);
+		return NULL;
+	}
+	cdata->link.sta.info_size = STA_INFO_BUF;
+	cdata->drv = bss->drv;
+	cdata->ifindex = bss->drv->ifindex;
+	cdata->global = bss->drv->global;
+	cdata->bss = bss;
+	cdata->link.max_age_ms = LINK_MAX_AGE_MS;
+	cdata->ps.mode = -1;
+	cdata->ps.ps_on = -1;
+	cdata->ps.interval_ms = PS_AUTO_INTERVAL_MS;
+	cdata->ps.poll_ms = PS_AUTO_INTERVAL_MS;
+	cdata->ps.burst_pps = PS_AUTO_BURST_PPS;
+	cdata->ps.idle_ms = PS_AUTO_IDLE_MS;
+	cdata->ps.hold_ms = PS_AUTO_HOLD_MS;
+	cdata->ps.max_poll_ms = PS_AUTO_MAX_POLL_MS;
+	cdata->next = nl80211_custom_list;
+	nl80211_custom_list = cdata;
+	return cdata;
+}
+
+static void nl80211_link_sample_timer(void *eloop_ctx, void *timeout_ctx);
+
+/*
+ * No deinit reaches this file, so timer and event callbacks check that the
+ * interface is still in the process-wide list before using drv; cdata->drv
+ * is only compared here, never followed. Without the list it is trusted.
+ */
+static int nl80211_custom_alive(struct nl80211_custom_data *cdata)
+{
+	struct wpa_driver_nl80211_data *drv;
+
+	if (cdata->global == NULL)
+		return 1;
+	dl_list_for_each(drv, &cdata->global->interfaces,
+			 struct wpa_driver_nl80211_data, list) {
+		if (drv == cdata->drv)
+			return 1;
+	}
+	return 0;
+}
+
+/* Drops the state of a removed interface, from its callbacks or on reuse */
+static void nl80211_custom_free(struct nl80211_custom_data *cdata)
+{
+	struct nl80211_custom_data **pos;
+
+	for (pos = &nl80211_custom_list; *pos; pos = &(*pos)->next) {
+		if (*pos == cdata) {
+			*pos = cdata->next;
+			break;
+		}
+	}
+	eloop_cancel_timeout(nl80211_link_sample_timer, cdata, NULL);
+	if (cdata->event_sock) {
+		eloop_unregister_read_sock(nl_socket_get_fd(cdata->event_sock));
+		nl80211_handle_destroy(cdata->event_sock);
+		nl_cb_put(cdata->event_cb);
+	}
+	if (cdata->sampler.msg)
+		nlmsg_free(cdata->sampler.msg);
+	os_free(cdata->link.sta.info);
+	os_free(cdata);
+}
+
+static unsigned int nl80211_msec_since(struct os_time *t)
+{
+	struct os_time now, diff;
+
+	os_get_time(&now);
+	if (os_time_before(&now, t))
+		return 0;
+	os_time_sub(&now, t, &diff);
+	return diff.sec * 1000 + diff.usec / 1000;
+}
+
+static void nl80211_link_store(struct nl80211_custom_data *cdata)
+{
+	struct nl80211_link_cache *link = &cdata->link;
+
+	os_memcpy(link->bssid, cdata->drv->bssid, ETH_ALEN);
+	os_get_time(&link->updated);
+	link->valid = 1;
+}
+
+/*
+ * Returns station statistics of the current AP no older than the staleness
+ * bound, from one GET_STATION shared by RSSI, LINKSPEED and LINKSTATS, or
+ * NULL on failure. CQM threshold events refresh it in between.
+ */
+static struct nl80211_sta_stats *
+nl80211_link_get(struct nl80211_custom_data *cdata)
+{
+	struct nl80211_link_cache *link = &cdata->link;
+
+	if (link->valid &&
+	    os_memcmp(link->bssid, cdata->drv->bssid, ETH_ALEN) == 0 &&
+	    nl80211_msec_since(&link->updated) <= link->max_age_ms)
+		return &link->sta;
+
+	link->valid = 0;
+	if (wpa_driver_get_link_signal(cdata->bss, &link->sta) < 0)
+		return NULL;
+	nl80211_link_store(cdata);
+	return &link->sta;
+}
+
+enum { STAT_SKIP, STAT_U8, STAT_S8, STAT_U16, STAT_U32, STAT_U64, STAT_FLAG,
+       STAT_RATE };
+
+struct nl80211_stat_key {
+	const char *name;
+	int type;
+};
+
+/*
+ * LINKSTATS keys, indexed by attribute number. The numbers are kernel ABI,
+ * so attributes newer than our nl80211.h copy are listed by value.
+ */
+static const struct nl80211_stat_key sta_info_keys[] = {
+	[NL80211_STA_INFO_INACTIVE_TIME] = { "inactive_time", STAT_U32 },
+	[NL80211_STA_INFO_RX_BYTES] = { "rx_bytes", STAT_U32 },
+	[NL80211_STA_INFO_TX_BYTES] = { "tx_bytes", STAT_U32 },
+	[NL80211_STA_INFO_LLID] = { "llid", STAT_U16 },
+	[NL80211_STA_INFO_PLID] = { "plid", STAT_U16 },
+	[NL80211_STA_INFO_PLINK_STATE] = { "plink_state", STAT_U8 },
+	[NL80211_STA_INFO_SIGNAL] = { "signal", STAT_S8 },
+	[NL80211_STA_INFO_TX_BITRATE] = { "tx", STAT_RATE },
+	[NL80211_STA_INFO_RX_PACKETS] = { "rx_packets", STAT_U32 },
+	[NL80211_STA_INFO_TX_PACKETS] = { "tx_packets", STAT_U32 },
+	[NL80211_STA_INFO_TX_RETRIES] = { "tx_retries", STAT_U32 },
+	[NL80211_STA_INFO_TX_FAILED] = { "tx_failed", STAT_U32 },
+	[13] = { "signal_avg", STAT_S8 },
+	[14] = { "rx", STAT_RATE },
+	[15] = { "bss_param", STAT_SKIP },	/* nested */
+	[16] = { "connected_time", STAT_U32 },
+	[17] = { "sta_flags", STAT_SKIP },	/* struct */
+	[18] = { "beacon_loss", STAT_U32 },
+	[19] = { "t_offset", STAT_U64 },
+	[23] = { "rx_bytes64", STAT_U64 },
+	[24] = { "tx_bytes64", STAT_U64 },
+	[25] = { "chain_signal", STAT_SKIP },	/* nested */
+	[26] = { "chain_signal_avg", STAT_SKIP },	/* nested */
+	[28] = { "rx_drop_misc", STAT_U64 },
+	[29] = { "beacon_rx", STAT_U64 },
+	[31] = { "tid_stats", STAT_SKIP },	/* nested */
+	[33] = { "pad", STAT_SKIP },
+};
+
+static const struct nl80211_stat_key rate_info_keys[] = {
+	[NL80211_RATE_INFO_BITRATE] = { "bitrate", STAT_U16 },
+	[NL80211_RATE_INFO_MCS] = { "mcs", STAT_U8 },
+	[NL80211_RATE_INFO_40_MHZ_WIDTH] = { "40_mhz", STAT_FLAG },
+	[NL80211_RATE_INFO_SHORT_GI] = { "short_gi", STAT_FLAG },
+	[5] = { "bitrate32", STAT_U32 },
+};
+
+/*
+ * Tells if an attribute without a key holds nested attributes rather than a
+ * number: flagged so, or a u64 sized payload of well-formed attributes,
+ * like a nest of one u32. Shorter ones are taken as numbers.
+ */
+static int nl80211_stat_nested(struct nlattr *nla)
+{
+	struct nlattr *pos;
+	int rem;
+
+	if (nla->nla_type & NLA_F_NESTED)
+		return 1;
+	if (nla_len(nla) < 2 * NLA_HDRLEN)
+		return 0;
+	nla_for_each_nested(pos, nla, rem) {
+		if (nla_type(pos) == 0)
+			return 0;
+	}
+	return rem == 0;
+}
+
+/*
+ * Prints each attribute as "<prefix><key>=<value>" per line. Attributes
+ * without a key are printed by number and length so none are dropped,
+ * except nested ones, which have no single value.
+ */
+static int nl80211_stat_print(char *buf, size_t buf_len, const char *prefix,
+			      const struct nl80211_stat_key *keys, int num_keys,
+			      struct nlattr *attrs, int len)
+{
+	char *pos = buf, *end = buf + buf_len;
+	char name[32], sub[8];
+	struct nlattr *nla;
+	int rem, type, kind, ret;
+
+	nla_for_each_attr(nla, attrs, len, rem) {
+		type = nla_type(nla);
+		if (type < num_keys && keys[type].name) {
+			os_snprintf(name, sizeof(name), "%s%s", prefix,
+				    keys[type].name);
+			kind = keys[type].type;
+		} else {
+			os_snprintf(name, sizeof(name), "%sattr%d", prefix,
+				    type);
+			if (nl80211_stat_nested(nla))
+				continue;
+			switch (nla_len(nla)) {
+			case 0: kind = STAT_FLAG; break;
+			case 1: kind = STAT_U8; break;
+			case 2: kind = STAT_U16; break;
+			case 4: kind = STAT_U32; break;
+			case 8: kind = STAT_U64; break;
+			default: continue;
+			}
+		}
+
+		switch (kind) {
+		case STAT_U8:
+			ret = os_snprintf(pos, end - pos, "%s=%u\n", name,
+					  nla_get_u8(nla));
+			break;
+		case STAT_S8:
+			ret = os_snprintf(pos, end - pos, "%s=%d\n", name,
+					  (s8) nla_get_u8(nla));
+			break;
+		case STAT_U16:
+			ret = os_snprintf(pos, end - pos, "%s=%u\n", name,
+					  nla_get_u16(nla));
+			break;
+		case STAT_U32:
+			ret = os_snprintf(pos, end - pos, "%s=%u\n", name,
+					  nla_get_u32(nla));
+			break;
+		case STAT_U64:
+			ret = os_snprintf(pos, end - pos, "%s=%llu\n", name,
+					  (unsigned long long) nla_get_u64(nla));
+			break;
+		case STAT_FLAG:
+			ret = os_snprintf(pos, end - pos, "%s=1\n", name);
+			break;
+		case STAT_RATE:
+			os_snprintf(sub, sizeof(sub), "%s_", keys[type].name);
+			ret = nl80211_stat_print(pos, end - pos, sub,
+						 rate_info_keys,
+						 sizeof(rate_info_keys) /
+						 sizeof(rate_info_keys[0]),
+						 nla_data(nla), nla_len(nla));
+			break;
+		default:
+			continue;
+		}
+		if (ret < 0 || ret >= end - pos)
+			break;
+		pos += ret;
+	}
+	return pos - buf;
+}
+
+/* LINKSTATS reply, every station attribute of one GET_STATION */
+static int nl80211_link_stats(struct nl80211_custom_data *cdata,
+			      struct nl80211_sta_stats *sta,
+			      char *buf, size_t buf_len)
+{
+	int ret;
+
+	ret = os_snprintf(buf, buf_len, "bssid=" MACSTR "\nage=%u\n",
+			  MAC2STR(cdata->link.bssid),
+			  nl80211_msec_since(&cdata->link.updated));
+	if (ret < 0 || (size_t) ret >= buf_len)
+		return -1;
+	return ret + nl80211_stat_print(buf + ret, buf_len - ret, "",
+					sta_info_keys,
+					sizeof(sta_info_keys) /
+					sizeof(sta_info_keys[0]),
+					(struct nlattr *) sta->info,
+					sta->info_len);
+}
+
+static int family_handler(struct nl_msg *msg, void *arg)
+{
+	struct nlattr *tb[CTRL_ATTR_MAX + 1];
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr *mcgrp, *tb2[CTRL_ATTR_MCAST_GRP_MAX + 1];
+	int *group = arg;
+	int rem;
+
+	nla_parse(tb, CTRL_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		  genlmsg_attrlen(gnlh, 0), NULL);
+	if (!tb[CTRL_ATTR_MCAST_GROUPS])
+		return NL_SKIP;
+
+	nla_for_each_nested(mcgrp, tb[CTRL_ATTR_MCAST_GROUPS], rem) {
+		nla_parse(tb2, CTRL_ATTR_MCAST_GRP_MAX, nla_data(mcgrp),
+			  nla_len(mcgrp), NULL);
+		if (tb2[CTRL_ATTR_MCAST_GRP_NAME] &&
+		    tb2[CTRL_ATTR_MCAST_GRP_ID] &&
+		    os_strcmp(nla_data(tb2[CTRL_ATTR_MCAST_GRP_NAME]),
+			      "mlme") == 0) {
+			*group = nla_get_u32(tb2[CTRL_ATTR_MCAST_GRP_ID]);
+			break;
+		}
+	}
+	return NL_SKIP;
+}
+
+/*
+ * Takes one station sample into the ring. The GET_STATION message is built
+ * once and only its MAC and header are rewritten, so sampling allocates
+ * nothing of its own. The sample also refreshes the link cache.
+ */
+static int nl80211_link_sample(struct nl80211_custom_data *cdata)
+{
+	struct wpa_driver_nl80211_data *drv = cdata->drv;
+	struct nl80211_link_sampler *ls = &cdata->sampler;
+	struct nl80211_link_cache *link = &cdata->link;
+	struct nl80211_link_sample *s, *prev;
+	struct nlmsghdr *hdr;
+	struct nlattr *nla;
+	int ret, rem, rx64 = 0, tx64 = 0;
+
+	if (ls->msg == NULL) {
+		ls->msg = nlmsg_alloc();
+		if (!ls->msg)
+			return -1;
+		genlmsg_put(ls->msg, 0, 0, genl_family_get_id(drv->nl80211), 0,
+			    0, NL80211_CMD_GET_STATION, 0);
+		if (nla_put_u32(ls->msg, NL80211_ATTR_IFINDEX, drv->ifindex) ||
+		    (ls->mac = nla_reserve(ls->msg, NL80211_ATTR_MAC,
+					   ETH_ALEN)) == NULL) {
+			nlmsg_free(ls->msg);
+			ls->msg = NULL;
+			return -1;
+		}
+	}
+
+	os_memcpy(nla_data(ls->mac), drv->bssid, ETH_ALEN);
+	hdr = nlmsg_hdr(ls->msg);
+	hdr->nlmsg_seq = 0;
+	hdr->nlmsg_pid = 0;
+
+	link->valid = 0;
+	link->sta.sig.current_signal = -9999;
+	link->sta.sig.current_txrate = 0;
+	link->sta.info_len = 0;
+
+	/* send_and_recv_msgs() drops a reference to what it sends */
+	nlmsg_get(ls->msg);
+	ret = send_and_recv_msgs(drv, ls->msg, get_link_signal, &link->sta);
+	if (ret < 0 || link->sta.info_len == 0) {
+		wpa_printf(MSG_DEBUG, "nl80211: link sample fail: %d", ret);
+		return -1;
+	}
+	nl80211_link_store(cdata);
+
+	if (os_memcmp(ls->bssid, link->bssid, ETH_ALEN) != 0) {
+		os_memcpy(ls->bssid, link->bssid, ETH_ALEN);
+		ls->count = 0;
+		ls->signal_ewma = link->sta.sig.current_signal *
+			LINK_EWMA_WEIGHT;
+	}
+
+	s = &ls->ring[ls->head];
+	os_memset(s, 0, sizeof(*s));
+	s->t = link->updated;
+	s->signal = link->sta.sig.current_signal;
+	s->txrate = link->sta.sig.current_txrate;
+	nla_for_each_attr(nla, (struct nlattr *) link->sta.info,
+			  link->sta.info_len, rem) {
+		switch (nla_type(nla)) {
+		case NL80211_STA_INFO_RX_BYTES:
+			if (!rx64)
+				s->rx_bytes = nla_get_u32(nla);
+			break;
+		case NL80211_STA_INFO_TX_BYTES:
+			if (!tx64)
+				s->tx_bytes = nla_get_u32(nla);
+			break;
+		case STA_INFO_RX_BYTES64:
+			s->rx_bytes = nla_get_u64(nla);
+			rx64 = 1;
+			break;
+		case STA_INFO_TX_BYTES64:
+			s->tx_bytes = nla_get_u64(nla);
+			tx64 = 1;
+			break;
+		case STA_INFO_CONNECTED_TIME:
+			s->connected_time = nla_get_u32(nla);
+			break;
+		case NL80211_STA_INFO_RX_PACKETS:
+			s->rx_packets = nla_get_u32(nla);
+			break;
+		case NL80211_STA_INFO_TX_PACKETS:
+			s->tx_packets = nla_get_u32(nla);
+			break;
+		case NL80211_STA_INFO_TX_RETRIES:
+			s->tx_retries = nla_get_u32(nla);
+			break;
+		case NL80211_STA_INFO_TX_FAILED:
+			s->tx_failed = nla_get_u32(nla);
+			break;
+		}
+	}
+
+	s->bytes64 = rx64 && tx64;
+
+	/*
+	 * u32 counters wrap, so a smaller value is no reset. The counters
+	 * start over with a new station entry: another BSSID (above) or a
+	 * reconnect to the same one, seen as connected_time going back.
+	 */
+	prev = &ls->ring[(ls->head + LINK_SAMPLE_NUM - 1) % LINK_SAMPLE_NUM];
+	if (ls->count && s->connected_time < prev->connected_time) {
+		wpa_printf(MSG_DEBUG, "nl80211: station reconnected");
+		ls->count = 0;
+	}
+
+	ls->signal_ewma += s->signal - ls->signal_ewma / LINK_EWMA_WEIGHT;
+	ls->head = (ls->head + 1) % LINK_SAMPLE_NUM;
+	if (ls->count < LINK_SAMPLE_NUM)
+		ls->count++;
+	return 0;
+}
+
+static void nl80211_ps_auto_update(struct nl80211_custom_data *cdata,
+				   int sampled);
+
+/* The sampler and the auto power save share one timer, at the faster rate */
+static unsigned int nl80211_link_timer_ms(struct nl80211_custom_data *cdata)
+{
+	unsigned int ms = cdata->sampler.interval_ms;
+
+	if (cdata->ps.mode == WPA_PS_AUTO &&
+	    (ms == 0 || cdata->ps.poll_ms < ms))
+		ms = cdata->ps.poll_ms;
+	return ms;
+}
+
+static void nl80211_link_sample_timer(void *eloop_ctx, void *timeout_ctx)
+{
+	struct nl80211_custom_data *cdata = eloop_ctx;
+	struct nl80211_link_sampler *ls = &cdata->sampler;
+	unsigned int ms;
+	int sampled = 0;
+
+	if (!nl80211_custom_alive(cdata)) {
+		nl80211_custom_free(cdata);
+		return;
+	}
+	if (cdata->drv->associated) {
+		sampled = nl80211_link_sample(cdata) == 0;
+	} else {
+		/* Nothing to compare the next association with */
+		os_memset(ls->bssid, 0, ETH_ALEN);
+		ls->count = 0;
+	}
+	if (cdata->ps.mode == WPA_PS_AUTO)
+		nl80211_ps_auto_update(cdata, sampled);
+
+	ms = nl80211_link_timer_ms(cdata);
+	if (ms)
+		eloop_register_timeout(ms / 1000, (ms % 1000) * 1000,
+				       nl80211_link_sample_timer, cdata, NULL);
+}
+
+static void nl80211_link_timer_restart(struct nl80211_custom_data *cdata)
+{
+	eloop_cancel_timeout(nl80211_link_sample_timer, cdata, NULL);
+	if (!cdata->stopped && nl80211_link_timer_ms(cdata))
+		eloop_register_timeout(0, 0, nl80211_link_sample_timer,
+				       cdata, NULL);
+}
+
+/* Starts sampling every interval_ms, 0 stops it; the ring is kept */
+static void nl80211_link_sampler_set(struct nl80211_custom_data *cdata,
+				     unsigned int interval_ms)
+{
+	if (interval_ms && interval_ms < LINK_SAMPLE_MIN_MS)
+		interval_ms = LINK_SAMPLE_MIN_MS;
+	cdata->sampler.interval_ms = interval_ms;
+	nl80211_link_timer_restart(cdata);
+}
+
+/* Byte count between two samples; u32 counters only give it modulo 2^32 */
+static u64 nl80211_link_bytes(u64 last, u64 first, int bytes64)
+{
+	return bytes64 ? last - first : (u32) (last - first);
+}
+
+/*
+ * LINKQUALITY reply, derived over the samples in the ring: goodput in
+ * kbit/s, tx retries and failures per mille of tx packets, signal EWMA in
+ * dBm and the number of tx rate changes.
+ */
+static int nl80211_link_quality(struct nl80211_custom_data *cdata, char *buf,
+				size_t buf_len)
+{
+	struct nl80211_link_sampler *ls = &cdata->sampler;
+	struct nl80211_link_sample *first, *last, *prev, *s;
+	unsigned int i, window_ms, rate_changes = 0;
+	u32 tx_packets, tx_retries, tx_failed;
+	u64 tx_bytes, rx_bytes;
+	int bytes64;
+	struct os_time diff;
+	int ret;
+
+	if (ls->count < 2) {
+		ret = os_snprintf(buf, buf_len, "interval=%u\nsamples=%u\n",
+				  ls->interval_ms, ls->count);
+		if (ret < 0 || (size_t) ret >= buf_len)
+			return -1;
+		return ret;
+	}
+
+	first = &ls->ring[(ls->head + LINK_SAMPLE_NUM - ls->count) %
+			  LINK_SAMPLE_NUM];
+	last = &ls->ring[(ls->head + LINK_SAMPLE_NUM - 1) % LINK_SAMPLE_NUM];
+	prev = first;
+	for (i = 1; i < ls->count; i++) {
+		s = &ls->ring[(ls->head + LINK_SAMPLE_NUM - ls->count + i) %
+			      LINK_SAMPLE_NUM];
+		if (s->txrate != prev->txrate)
+			rate_changes++;
+		prev = s;
+	}
+
+	os_time_sub(&last->t, &first->t, &diff);
+	window_ms = diff.sec * 1000 + diff.usec / 1000;
+	if (window_ms == 0)
+		window_ms = 1;
+	/* u32 counters wrap, their differences survive it */
+	bytes64 = first->bytes64 && last->bytes64;
+	tx_bytes = nl80211_link_bytes(last->tx_bytes, first->tx_bytes, bytes64);
+	rx_bytes = nl80211_link_bytes(last->rx_bytes, first->rx_bytes, bytes64);
+	tx_packets = last->tx_packets - first->tx_packets;
+	tx_retries = last->tx_retries - first->tx_retries;
+	tx_failed = last->tx_failed - first->tx_failed;
+
+	ret = os_snprintf(buf, buf_len,
+			  "interval=%u\nsamples=%u\nwindow=%u\n"
+			  "tx_kbps=%u\nrx_kbps=%u\ntx_packets=%u\n"
+			  "retry_permille=%u\nfail_permille=%u\n"
+			  "signal=%d\nsignal_ewma=%d\ntxrate=%d\n"
+			  "rate_changes=%u\n",
+			  ls->interval_ms, ls->count, window_ms,
+			  (u32) (tx_bytes * 8 / window_ms),
+			  (u32) (rx_bytes * 8 / window_ms),
+			  tx_packets,
+			  tx_packets ? (u32) ((u64) tx_retries * 1000 /
+					      tx_packets) : 0,
+			  tx_packets ? (u32) ((u64) tx_failed * 1000 /
+					      tx_packets) : 0,
+			  last->signal, ls->signal_ewma / LINK_EWMA_WEIGHT,
+			  last->txrate / 1000, rate_changes);
+	if (ret < 0 || (size_t) ret >= buf_len)
+		return -1;
+	return ret;
+}
+
+static int no_seq_check(struct nl_msg *msg, void *arg)
+{
+	return NL_OK;
+}
+
+/* CQM RSSI threshold crossings refresh the cache and are passed on */
+static int nl80211_custom_event(struct nl_msg *msg, void *arg)
+{
+	struct nl80211_custom_data *cdata = arg;
+	struct nlattr *tb[NL80211_ATTR_MAX + 1];
+	struct nlattr *cqm[NL80211_ATTR_CQM_MAX + 1];
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nl80211_sta_stats *sta;
+	u32 event;
+
+	if (gnlh->cmd != NL80211_CMD_NOTIFY_CQM)
+		return NL_SKIP;
+
+	nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		  genlmsg_attrlen(gnlh, 0), NULL);
+	if (!tb[NL80211_ATTR_IFINDEX] || !tb[NL80211_ATTR_CQM] ||
+	    (int) nla_get_u32(tb[NL80211_ATTR_IFINDEX]) != cdata->drv->ifindex ||
+	    nla_parse_nested(cqm, NL80211_ATTR_CQM_MAX, tb[NL80211_ATTR_CQM],
+			     NULL) ||
+	    !cqm[NL80211_ATTR_CQM_RSSI_THRESHOLD_EVENT])
+		return NL_SKIP;
+	event = nla_get_u32(cqm[NL80211_ATTR_CQM_RSSI_THRESHOLD_EVENT]);
+
+	cdata->link.valid = 0;
+	if (!cdata->drv->associated)
+		return NL_SKIP;
+	sta = nl80211_link_get(cdata);
+	wpa_msg(cdata->drv->ctx, MSG_INFO, WPA_EVENT_SIGNAL_CHANGE
+		"above=%d signal=%d txrate=%d",
+		event == NL80211_CQM_RSSI_THRESHOLD_EVENT_HIGH,
+		sta ? sta->sig.current_signal : -9999,
+		sta ? sta->sig.current_txrate : 0);
+	return NL_SKIP;
+}
+
+static void nl80211_custom_receive(int sock, void *eloop_ctx, void *handle)
+{
+	struct nl80211_custom_data *cdata = eloop_ctx;
+
+	if (!nl80211_custom_alive(cdata)) {
+		nl80211_custom_free(cdata);
+		return;
+	}
+	nl_recvmsgs(cdata->event_sock, cdata->event_cb);
+}
+
+/*
+ * Opens a socket of our own on the nl80211 mlme group, which carries CQM
+ * events; the supplicant's event socket is not reachable from here. It is
+ * kept until the interface goes away, see nl80211_custom_free().
+ */
+static int nl80211_custom_events(struct nl80211_custom_data *cdata)
+{
+	struct wpa_driver_nl80211_data *drv = cdata->drv;
+	struct nl_msg *msg;
+	int group = 0, ret;
+
+	if (cdata->event_sock)
+		return 0;
+
+	msg = nlmsg_alloc();
+	if (!msg)
+		return -1;
+	genlmsg_put(msg, 0, 0, GENL_ID_CTRL, 0, 0, CTRL_CMD_GETFAMILY, 0);
+	NLA_PUT_STRING(msg, CTRL_ATTR_FAMILY_NAME, "nl80211");
+	ret = send_and_recv_msgs(drv, msg, family_handler, &group);
+	msg = NULL;
+	if (ret < 0 || group <= 0) {
+		wpa_printf(MSG_ERROR, "nl80211: mlme group not found: %d", ret);
+		return -1;
+	}
+
+	cdata->event_cb = nl_cb_alloc(NL_CB_DEFAULT);
+	if (!cdata->event_cb)
+		return -1;
+	cdata->event_sock = nl80211_handle_alloc(cdata->event_cb);
+	if (!cdata->event_sock)
+		goto fail;
+	if (genl_connect(cdata->event_sock) ||
+	    nl_socket_add_membership(cdata->event_sock, group)) {
+		wpa_printf(MSG_ERROR, "nl80211: failed to join mlme group");
+		goto fail;
+	}
+	nl_cb_set(cdata->event_cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM,
+		  no_seq_check, NULL);
+	nl_cb_set(cdata->event_cb, NL_CB_VALID, NL_CB_CUSTOM,
+		  nl80211_custom_event, cdata);
+	if (eloop_register_read_sock(nl_socket_get_fd(cdata->event_sock),
+				     nl80211_custom_receive, cdata, NULL))
+		goto fail;
+	return 0;
+
+fail:
+	if (cdata->event_sock)
+		nl80211_handle_destroy(cdata->event_sock);
+	nl_cb_put(cdata->event_cb);
+	cdata->event_sock = NULL;
+	cdata->event_cb = NULL;
+	return -1;
+nla_put_failure:
+	nlmsg_free(msg);
+	return -1;
+}
+
+/* Sets CQM RSSI threshold and hysteresis, a threshold of 0 disables it */
+static int nl80211_link_monitor(struct nl80211_custom_data *cdata, int thold,
+				unsigned int hyst)
+{
+	struct wpa_driver_nl80211_data *drv = cdata->drv;
+	struct nl_msg *msg;
+	struct nlattr *cqm;
+	int ret = -1;
+
+	if (thold && nl80211_custom_events(cdata) < 0)
+		return -1;
+
+	msg = nlmsg_alloc();
+	if (!msg)
+		return -1;
+
+	genlmsg_put(msg, 0, 0, genl_family_get_id(drv->nl80211), 0, 0,
+		    NL80211_CMD_SET_CQM, 0);
+
+	NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, drv->ifindex);
+	cqm = nla_nest_start(msg, NL80211_ATTR_CQM);
+	if (!cqm)
+		goto nla_put_failure;
+	NLA_PUT_U32(msg, NL80211_ATTR_CQM_RSSI_THOLD, thold);
+	NLA_PUT_U32(msg, NL80211_ATTR_CQM_RSSI_HYST, hyst);
+	nla_nest_end(msg, cqm);
+
+	ret = send_and_recv_msgs(drv, msg, NULL, NULL);
+	msg = NULL;
+	if (ret < 0) {
+		wpa_printf(MSG_ERROR, "nl80211: Set CQM fail: %d", ret);
+	} else {
+		cdata->link.cqm_thold = thold;
+		cdata->link.cqm_hyst = hyst;
+	}
+nla_put_failure:
+	nlmsg_free(msg);
+	return ret;
+}
+
 static int wpa_driver_toggle_btcoex_state(char state)
 {
 	int ret;
@@ -175,6 +1033,122 @@ nla_put_failure:
 	return ret;
 }
 
+static void nl80211_ps_account(struct nl80211_ps_ctrl *ps)
+{
+	unsigned int ms = nl80211_msec_since(&ps->accounted);
+
+	if (ps->ps_on > 0)
+		ps->on_ms += ms;
+	else if (ps->ps_on == 0)
+		ps->off_ms += ms;
+	os_get_time(&ps->accounted);
+}
+
+static int nl80211_ps_set(struct nl80211_custom_data *cdata, int on)
+{
+	struct nl80211_ps_ctrl *ps = &cdata->ps;
+
+	/* Known to be set on this interface, skip the round trip */
+	if (ps->ps_on == on)
+		return 0;
+	if (wpa_driver_set_power_save(cdata->bss, on ? WPA_PS_ENABLED :
+				      WPA_PS_DISABLED) < 0) {
+		wpa_driver_send_hang_msg(cdata);
+		return -1;
+	}
+	cdata->drv_errors = 0;
+
+	nl80211_ps_account(ps);
+	ps->switches++;
+	os_get_time(&ps->switched);
+	ps->ps_on = on;
+	return 0;
+}
+
+/*
+ * Auto power save: PS goes off as soon as tx+rx packets reach burst_pps and
+ * back on once traffic stayed below it for idle_ms. Switches are at least
+ * hold_ms apart, so a bursty link does not flap. No association counts as
+ * idle. While idle with PS on, the poll period doubles up to max_poll_ms;
+ * traffic brings it back to interval_ms. A burst is thus seen at worst
+ * max_poll_ms after it starts, if it averages burst_pps over that poll, and
+ * PS goes off no sooner than hold_ms after it went on: the worst reaction
+ * is max(max_poll_ms, hold_ms), 2 s with the defaults.
+ */
+static void nl80211_ps_auto_update(struct nl80211_custom_data *cdata,
+				   int sampled)
+{
+	struct nl80211_ps_ctrl *ps = &cdata->ps;
+	struct nl80211_link_sampler *ls = &cdata->sampler;
+	struct nl80211_link_sample *prev, *last;
+	struct os_time diff;
+	unsigned int ms, pps = 0;
+	u32 rx, tx;
+
+	if (cdata->drv->associated) {
+		if (!sampled || ls->count < 2)
+			return;
+		prev = &ls->ring[(ls->head + LINK_SAMPLE_NUM - 2) %
+				 LINK_SAMPLE_NUM];
+		last = &ls->ring[(ls->head + LINK_SAMPLE_NUM - 1) %
+				 LINK_SAMPLE_NUM];
+		os_time_sub(&last->t, &prev->t, &diff);
+		ms = diff.sec * 1000 + diff.usec / 1000;
+		if (ms == 0)
+			return;
+		/* Resets clear the ring, so these are wraps at most */
+		tx = last->tx_packets - prev->tx_packets;
+		rx = last->rx_packets - prev->rx_packets;
+		pps = (u32) (((u64) tx + rx) * 1000 / ms);
+	}
+
+	if (pps >= ps->burst_pps) {
+		ps->quiet = 0;
+		ps->poll_ms = ps->interval_ms;
+		if (ps->ps_on != 0 &&
+		    nl80211_msec_since(&ps->switched) >= ps->hold_ms) {
+			wpa_printf(MSG_DEBUG, "nl80211: auto PS off, %u pps",
+				   pps);
+			nl80211_ps_set(cdata, 0);
+		}
+		return;
+	}
+
+	if (!ps->quiet) {
+		ps->quiet = 1;
+		os_get_time(&ps->quiet_since);
+	}
+	if (ps->ps_on != 1 &&
+	    nl80211_msec_since(&ps->quiet_since) >= ps->idle_ms &&
+	    nl80211_msec_since(&ps->switched) >= ps->hold_ms) {
+		wpa_printf(MSG_DEBUG, "nl80211: auto PS on, %u pps", pps);
+		nl80211_ps_set(cdata, 1);
+	}
+	if (ps->ps_on == 1 && ps->poll_ms < ps->max_poll_ms) {
+		ps->poll_ms *= 2;
+		if (ps->poll_ms > ps->max_poll_ms)
+			ps->poll_ms = ps->max_poll_ms;
+	} else if (ps->ps_on != 1) {
+		ps->poll_ms = ps->interval_ms;
+	}
+}
+
+/* POWERMODE: WPA_PS_ENABLED, WPA_PS_DISABLED or WPA_PS_AUTO */
+static int nl80211_ps_mode(struct nl80211_custom_data *cdata, int mode)
+{
+	struct nl80211_ps_ctrl *ps = &cdata->ps;
+
+	/* Auto starts saving power and leaves it on the first burst */
+	if (nl80211_ps_set(cdata, mode == WPA_PS_ENABLED ||
+			   mode == WPA_PS_AUTO) < 0)
+		return -1;
+	ps->mode = mode;
+	ps->quiet = 0;
+	ps->poll_ms = ps->interval_ms;
+	nl80211_link_timer_restart(cdata);
+	return 0;
+}
+
 int wpa_driver_nl80211_driver_cmd(void *priv, char *cmd, char *buf,
 				  size_t buf_len )
 {
@@ -184,25 +1158,88 @@ int wpa_driver_nl80211_driver_cmd(void *priv, char *cmd, char *buf,
 	int ret = 0;
 
 	if (os_strcasecmp(cmd, "STOP") == 0) {
+		struct nl80211_custom_data *cdata = nl80211_custom_get(bss);
+
+		if (cdata) {
+			cdata->stopped = 1;
+			nl80211_link_timer_restart(cdata);
+		}
 		linux_set_iface_flags(drv->ioctl_sock, bss->ifname, 0);
 		wpa_msg(drv->ctx, MSG_INFO, WPA_EVENT_DRIVER_STATE "STOPPED");
 	} else if (os_strcasecmp(cmd, "START") == 0) {
+		struct nl80211_custom_data *cdata = nl80211_custom_get(bss);
+
 		linux_set_iface_flags(drv->ioctl_sock, bss->ifname, 1);
+		/* The driver may come back with its defaults, set PS again */
+		if (cdata) {
+			nl80211_ps_account(&cdata->ps);
+			cdata->ps.ps_on = -1;
+			cdata->stopped = 0;
+			nl80211_link_timer_restart(cdata);
+		}
 		wpa_msg(drv->ctx, MSG_INFO, WPA_EVENT_DRIVER_STATE "STARTED");
 	} else if (os_strcasecmp(cmd, "RELOAD") == 0) {
 		wpa_msg(drv->ctx, MSG_INFO, WPA_EVENT_DRIVER_STATE "HANGED");
 	} else if (os_strncasecmp(cmd, "POWERMODE ", 10) == 0) {
+		struct nl80211_custom_data *cdata = nl80211_custom_get(bss);
 		int mode;
-		mode = atoi(cmd + 10);
-		ret = wpa_driver_set_power_save(priv, mode);
-		if (ret < 0) {
-			wpa_driver_send_hang_msg(drv);
-		} else {
-			g_power_mode = mode;
-			g_drv_errors = 0;
+
+		if (!cdata)
+			return -1;
+		if (os_strcasecmp(cmd + 10, "AUTO") == 0)
+			mode = WPA_PS_AUTO;
+		else
+			mode = atoi(cmd + 10);
+		ret = nl80211_ps_mode(cdata, mode);
+	} else if (os_strncasecmp(cmd, "POWERMODE-AUTO ", 15) == 0) {
+		struct nl80211_custom_data *cdata = nl80211_custom_get(bss);
+		unsigned int val[5];
+		int num;
+
+		if (!cdata)
+			return -1;
+		/*
+		 * "POWERMODE-AUTO <burst pps> [idle ms [hold ms [poll ms
+		 * [max poll ms]]]]", the last one bounds the reaction time
+		 */
+		num = sscanf(cmd + 15, "%u %u %u %u %u", &val[0], &val[1],
+			     &val[2], &val[3], &val[4]);
+		if (num < 1)
+			return -1;
+		cdata->ps.burst_pps = val[0];
+		if (num > 1)
+			cdata->ps.idle_ms = val[1];
+		if (num > 2)
+			cdata->ps.hold_ms = val[2];
+		if (num > 3 && val[3] >= LINK_SAMPLE_MIN_MS) {
+			cdata->ps.interval_ms = val[3];
+			cdata->ps.poll_ms = val[3];
+			nl80211_link_timer_restart(cdata);
 		}
+		if (num > 4)
+			cdata->ps.max_poll_ms = val[4];
+		if (cdata->ps.max_poll_ms < cdata->ps.interval_ms)
+			cdata->ps.max_poll_ms = cdata->ps.interval_ms;
 	} else if (os_strncasecmp(cmd, "GETPOWER", 8) == 0) {
-		ret = os_snprintf(buf, buf_len, "POWERMODE = %d\n", g_power_mode);
+		struct nl80211_custom_data *cdata = nl80211_custom_get(bss);
+
+		if (!cdata)
+			return -1;
+		ret = os_snprintf(buf, buf_len, "POWERMODE = %d\n",
+				  cdata->ps.mode < 0 ? WPA_PS_ENABLED :
+				  cdata->ps.mode);
+	} else if (os_strcasecmp(cmd, "POWERSTATS") == 0) {
+		struct nl80211_custom_data *cdata = nl80211_custom_get(bss);
+
+		if (!cdata)
+			return -1;
+		nl80211_ps_account(&cdata->ps);
+		ret = os_snprintf(buf, buf_len,
+				  "mode=%d\nps=%d\nswitches=%u\n"
+				  "ps_on_ms=%lu\nps_off_ms=%lu\n",
+				  cdata->ps.mode, cdata->ps.ps_on,
+				  cdata->ps.switches, cdata->ps.on_ms,
+				  cdata->ps.off_ms);
 	} else if (os_strncasecmp(cmd, "BTCOEXMODE ", 11) == 0) {
 		int mode = atoi(cmd + 11);
 		if (mode == BLUETOOTH_COEXISTENCE_MODE_DISABLED) { /* disable BT-coex */
@@ -214,35 +1251,82 @@ int wpa_driver_nl80211_driver_cmd(void *priv, char *cmd, char *buf,
 			ret = -1;
 		}
 	} else if ((os_strcasecmp(cmd, "RSSI") == 0) || (os_strcasecmp(cmd, "RSSI-APPROX") == 0)) {
-		struct wpa_signal_info sig;
+		struct nl80211_custom_data *cdata = nl80211_custom_get(bss);
+		struct nl80211_sta_stats *sta;
 		int rssi;
 
-		if (!drv->associated)
+		if (!drv->associated || !cdata)
 			return -1;
 
-		ret = wpa_driver_get_link_signal(priv, &sig);
-		if (ret < 0) {
-			wpa_driver_send_hang_msg(drv);
+		sta = nl80211_link_get(cdata);
+		if (!sta) {
+			wpa_driver_send_hang_msg(cdata);
+			ret = -1;
 		} else {
-			rssi = sig.current_signal;
+			rssi = sta->sig.current_signal;
 			wpa_printf(MSG_DEBUG, "%s rssi %d\n", drv->ssid, rssi);
 			ret = os_snprintf(buf, buf_len, "%s rssi %d\n", drv->ssid, rssi);
 		}
 	} else if (os_strcasecmp(cmd, "LINKSPEED") == 0) {
-		struct wpa_signal_info sig;
+		struct nl80211_custom_data *cdata = nl80211_custom_get(bss);
+		struct nl80211_sta_stats *sta;
 		int linkspeed;
 
-		if (!drv->associated)
+		if (!drv->associated || !cdata)
 			return -1;
 
-		ret = wpa_driver_get_link_signal(priv, &sig);
-		if (ret < 0) {
-			wpa_driver_send_hang_msg(drv);
+		sta = nl80211_link_get(cdata);
+		if (!sta) {
+			wpa_driver_send_hang_msg(cdata);
+			ret = -1;
 		} else {
-			linkspeed = sig.current_txrate / 1000;
+			linkspeed = sta->sig.current_txrate / 1000;
 			wpa_printf(MSG_DEBUG, "LinkSpeed %d\n", linkspeed);
 			ret = os_snprintf(buf, buf_len, "LinkSpeed %d\n", linkspeed);
 		}
+	} else if (os_strcasecmp(cmd, "LINKSTATS") == 0) {
+		struct nl80211_custom_data *cdata = nl80211_custom_get(bss);
+		struct nl80211_sta_stats *sta;
+
+		if (!drv->associated || !cdata)
+			return -1;
+
+		sta = nl80211_link_get(cdata);
+		if (!sta) {
+			wpa_driver_send_hang_msg(cdata);
+			ret = -1;
+		} else {
+			ret = nl80211_link_stats(cdata, sta, buf, buf_len);
+		}
+	} else if (os_strncasecmp(cmd, "LINKSAMPLE ", 11) == 0) {
+		struct nl80211_custom_data *cdata = nl80211_custom_get(bss);
+
+		if (!cdata)
+			return -1;
+		/* "LINKSAMPLE <interval ms>", 0 stops sampling */
+		nl80211_link_sampler_set(cdata, atoi(cmd + 11));
+	} else if (os_strcasecmp(cmd, "LINKQUALITY") == 0) {
+		struct nl80211_custom_data *cdata = nl80211_custom_get(bss);
+
+		if (!cdata)
+			return -1;
+		ret = nl80211_link_quality(cdata, buf, buf_len);
+	} else if (os_strncasecmp(cmd, "LINK-MAXAGE ", 12) == 0) {
+		struct nl80211_custom_data *cdata = nl80211_custom_get(bss);
+
+		if (!cdata)
+			return -1;
+		cdata->link.max_age_ms = atoi(cmd + 12);
+	} else if (os_strncasecmp(cmd, "RSSI-MONITOR ", 13) == 0) {
+		struct nl80211_custom_data *cdata = nl80211_custom_get(bss);
+		char *hyst;
+
+		if (!cdata)
+			return -1;
+		/* "RSSI-MONITOR <threshold dBm> [hysteresis dB]" */
+		hyst = os_strchr(cmd + 13, ' ');
+		ret = nl80211_link_monitor(cdata, atoi(cmd + 13),
+					   hyst ? atoi(hyst + 1) : 0);
 	} else if (os_strcasecmp(cmd, "MACADDR") == 0) {
 		u8 macaddr[ETH_ALEN] = {};
 